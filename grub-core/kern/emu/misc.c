@@ -28,6 +28,12 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include <grub/mm.h>
 #include <grub/err.h>
@@ -36,6 +42,7 @@
 #include <grub/misc.h>
 #include <grub/i18n.h>
 #include <grub/emu/misc.h>
+#include <grub/util/misc.h>
 
 int verbosity;
 
@@ -160,6 +167,179 @@ grub_exit (int rc)
 }
 #endif
 
+/* If set, the contents of the files read by grub_util_load_image are kept,
+   so that images built together share them.  Files are told apart by
+   their identity rather than by their name where the host has one.  The
+   cache holds up to FILE_CACHE_SIZE bytes, dropping the files used least
+   recently to make room; large files are never kept.  */
+int grub_util_cache_files;
+
+#define FILE_CACHE_SIZE (256 << 20)
+
+struct cached_file
+{
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  char *data;
+  /* The number of readers copying the data, which keep it from being
+     dropped, and when it was last asked for.  */
+  unsigned users;
+  unsigned long last_use;
+  /* Whether the file is in the cache, rather than read for one reader
+     because there was no room.  */
+  int cached;
+  struct cached_file *next;
+};
+
+static struct cached_file *file_cache;
+static size_t file_cache_size;
+static unsigned long file_cache_clock;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+lock_file_cache (void)
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&file_cache_lock);
+#endif
+}
+
+static void
+unlock_file_cache (void)
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&file_cache_lock);
+#endif
+}
+
+static void
+free_cached_file (struct cached_file *c)
+{
+  free (c->data);
+  free (c->path);
+  free (c);
+}
+
+/* Return the cached file at PATH with the identity ST and take a use of
+   it, or NULL.  Called with the lock held.  */
+static struct cached_file *
+find_cached_file (const char *path, const struct stat *st)
+{
+  struct cached_file *c;
+
+  for (c = file_cache; c; c = c->next)
+    if (c->size == st->st_size && c->mtime == st->st_mtime
+	&& (st->st_ino ? (c->dev == st->st_dev && c->ino == st->st_ino)
+	    : strcmp (c->path, path) == 0))
+      {
+	c->users++;
+	c->last_use = ++file_cache_clock;
+	return c;
+      }
+
+  return NULL;
+}
+
+/* Drop the files nobody is reading, least recently used first, until
+   SIZE more bytes fit.  Return whether they do.  Called with the lock
+   held.  */
+static int
+make_room (size_t size)
+{
+  while (file_cache_size + size > FILE_CACHE_SIZE)
+    {
+      struct cached_file **p, **victim = NULL;
+
+      for (p = &file_cache; *p; p = &(*p)->next)
+	if (!(*p)->users && (!victim || (*p)->last_use < (*victim)->last_use))
+	  victim = p;
+      if (!victim)
+	return 0;
+
+      {
+	struct cached_file *c = *victim;
+
+	*victim = c->next;
+	file_cache_size -= c->size;
+	free_cached_file (c);
+      }
+    }
+
+  return 1;
+}
+
+static void read_file (const char *path, char *buf, size_t size);
+
+/* Return the contents of the file at PATH, reading them in if they are
+   not cached yet, or NULL if the file is too large to be cached.  Give
+   them back with put_cached_file.  */
+static struct cached_file *
+get_cached_file (const char *path)
+{
+  struct cached_file *c, *found;
+  struct stat st;
+
+  if (stat (path, &st) < 0)
+    grub_util_error (_("cannot open `%s': %s"), path, strerror (errno));
+  if (st.st_size >= GRUB_UTIL_LARGE_FILE_SIZE)
+    return NULL;
+
+  lock_file_cache ();
+  found = find_cached_file (path, &st);
+  unlock_file_cache ();
+  if (found)
+    return found;
+
+  /* Read without holding the lock, so that other files can be read
+     meanwhile.  Whoever adds a file first wins.  */
+  c = xmalloc (sizeof (*c));
+  c->path = xstrdup (path);
+  c->dev = st.st_dev;
+  c->ino = st.st_ino;
+  c->size = st.st_size;
+  c->mtime = st.st_mtime;
+  c->data = xmalloc (c->size ? : 1);
+  c->users = 1;
+  c->cached = 0;
+  read_file (path, c->data, c->size);
+
+  lock_file_cache ();
+  found = find_cached_file (path, &st);
+  if (!found && make_room (c->size))
+    {
+      c->last_use = ++file_cache_clock;
+      c->cached = 1;
+      c->next = file_cache;
+      file_cache = c;
+      file_cache_size += c->size;
+    }
+  unlock_file_cache ();
+  if (!found)
+    return c;
+
+  free_cached_file (c);
+  return found;
+}
+
+static void
+put_cached_file (struct cached_file *c)
+{
+  if (!c->cached)
+    {
+      free_cached_file (c);
+      return;
+    }
+
+  lock_file_cache ();
+  c->users--;
+  unlock_file_cache ();
+}
+
 size_t
 grub_util_get_image_size (const char *path)
 {
@@ -187,23 +367,153 @@ grub_util_get_image_size (const char *path)
 }
 
 void
-grub_util_load_image (const char *path, char *buf)
+grub_util_drop_cache (int fd, off_t offset, off_t size)
 {
-  FILE *fp;
-  size_t size;
+#ifdef HAVE_SYNC_FILE_RANGE
+  /* Dirty pages stay in the cache, so have them written first.  */
+  sync_file_range (fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE
+		   | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (fd, offset, size, POSIX_FADV_DONTNEED);
+#else
+  (void) fd;
+  (void) offset;
+  (void) size;
+#endif
+}
 
-  grub_util_info ("reading %s", path);
+int
+grub_util_data_extents (int fd, off_t size,
+			void (*fn) (void *data, off_t offset, off_t len),
+			void *data)
+{
+#if defined (SEEK_DATA) && defined (SEEK_HOLE)
+  struct stat st;
+  off_t start, end;
+
+  /* Only sparse files are worth walking.  */
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode)
+      || (off_t) st.st_blocks * 512 >= size)
+    return -1;
+
+  for (end = 0; end < size; )
+    {
+      start = lseek (fd, end, SEEK_DATA);
+      if (start < 0 && errno == ENXIO)
+	break;
+      if (start < 0)
+	return -1;
+      if (start >= size)
+	break;
+      end = lseek (fd, start, SEEK_HOLE);
+      if (end < 0)
+	return -1;
+      if (end > size)
+	end = size;
+      fn (data, start, end - start);
+    }
+
+  return 0;
+#else
+  (void) fd;
+  (void) size;
+  (void) fn;
+  (void) data;
+  return -1;
+#endif
+}
+
+struct read_extent_ctx
+{
+  const char *path;
+  int fd;
+  char *buf;
+  off_t done;
+};
+
+/* Read the extent at OFFSET, zeroing the hole before it.  */
+static void
+read_extent (void *data, off_t offset, off_t len)
+{
+  struct read_extent_ctx *ctx = data;
+  ssize_t n;
+
+  memset (ctx->buf + ctx->done, 0, offset - ctx->done);
+  ctx->done = offset + len;
+  if (lseek (ctx->fd, offset, SEEK_SET) < 0)
+    grub_util_error (_("cannot seek `%s': %s"), ctx->path, strerror (errno));
+  while (len > 0)
+    {
+      n = read (ctx->fd, ctx->buf + offset, len);
+      if (n < 0)
+	grub_util_error (_("cannot read `%s': %s"), ctx->path,
+			 strerror (errno));
+      if (n == 0)
+	grub_util_error (_("premature end of file %s"), ctx->path);
+      offset += n;
+      len -= n;
+    }
+}
 
-  size = grub_util_get_image_size (path);
+/* Read the SIZE bytes of the file at PATH into BUF.  */
+static void
+read_file (const char *path, char *buf, size_t size)
+{
+  struct read_extent_ctx ctx;
+  FILE *fp;
 
   fp = grub_util_fopen (path, "rb");
   if (! fp)
     grub_util_error (_("cannot open `%s': %s"), path,
 		     strerror (errno));
 
+  /* Of a sparse file, only the data is read: the holes are zeroed.  */
+  ctx.path = path;
+  ctx.fd = fileno (fp);
+  ctx.buf = buf;
+  ctx.done = 0;
+  if (grub_util_data_extents (ctx.fd, size, read_extent, &ctx) == 0)
+    {
+      memset (buf + ctx.done, 0, size - ctx.done);
+      if (size >= GRUB_UTIL_LARGE_FILE_SIZE)
+	grub_util_drop_cache (ctx.fd, 0, size);
+      fclose (fp);
+      return;
+    }
+  if (fseeko (fp, 0, SEEK_SET) < 0)
+    grub_util_error (_("cannot seek `%s': %s"), path, strerror (errno));
+
+#ifdef HAVE_POSIX_FADVISE
+  if (size >= GRUB_UTIL_LARGE_FILE_SIZE)
+    posix_fadvise (fileno (fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
   if (fread (buf, 1, size, fp) != size)
     grub_util_error (_("cannot read `%s': %s"), path,
 		     strerror (errno));
 
+  if (size >= GRUB_UTIL_LARGE_FILE_SIZE)
+    grub_util_drop_cache (fileno (fp), 0, size);
   fclose (fp);
 }
+
+void
+grub_util_load_image (const char *path, char *buf)
+{
+  grub_util_info ("reading %s", path);
+
+  if (grub_util_cache_files)
+    {
+      struct cached_file *c = get_cached_file (path);
+
+      if (c)
+	{
+	  memcpy (buf, c->data, c->size);
+	  put_cached_file (c);
+	  return;
+	}
+    }
+
+  read_file (path, buf, grub_util_get_image_size (path));
+}
@@ -0,0 +1,269 @@
+/* sha256.c - SHA-256 message digest */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/lib/sha256.h>
+#include <grub/misc.h>
+
+/* The SHA extensions do a whole round pair per instruction, which is several
+   times faster than the portable code.  They are used when the CPU has
+   them.  */
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define SHA256_SHANI	1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const grub_uint32_t k[64] __attribute__ ((aligned (16))) =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_blocks_generic (grub_uint32_t *state, const grub_uint8_t *data,
+		       grub_size_t nblocks)
+{
+  grub_uint32_t w[64];
+  grub_uint32_t a, b, c, d, e, f, g, h, t1, t2;
+  unsigned i;
+
+  for (; nblocks; nblocks--, data += GRUB_SHA256_BLOCK_SIZE)
+    {
+      for (i = 0; i < 16; i++)
+	w[i] = ((grub_uint32_t) data[4 * i] << 24)
+	  | ((grub_uint32_t) data[4 * i + 1] << 16)
+	  | ((grub_uint32_t) data[4 * i + 2] << 8)
+	  | data[4 * i + 3];
+      for (; i < 64; i++)
+	w[i] = w[i - 16] + w[i - 7]
+	  + (ROR (w[i - 15], 7) ^ ROR (w[i - 15], 18) ^ (w[i - 15] >> 3))
+	  + (ROR (w[i - 2], 17) ^ ROR (w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+      a = state[0];
+      b = state[1];
+      c = state[2];
+      d = state[3];
+      e = state[4];
+      f = state[5];
+      g = state[6];
+      h = state[7];
+
+      for (i = 0; i < 64; i++)
+	{
+	  t1 = h + (ROR (e, 6) ^ ROR (e, 11) ^ ROR (e, 25))
+	    + ((e & f) ^ (~e & g)) + k[i] + w[i];
+	  t2 = (ROR (a, 2) ^ ROR (a, 13) ^ ROR (a, 22))
+	    + ((a & b) ^ (a & c) ^ (b & c));
+	  h = g;
+	  g = f;
+	  f = e;
+	  e = d + t1;
+	  d = c;
+	  c = b;
+	  b = a;
+	  a = t1 + t2;
+	}
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+    }
+}
+
+#ifdef SHA256_SHANI
+/* The state is kept as the ABEF and CDGH halves sha256rnds2 works on.
+   Each iteration of the inner loop does four rounds, and from the fifth
+   one on computes the next four message words from the previous
+   sixteen.  */
+static void __attribute__ ((target ("sha,sse4.1")))
+sha256_blocks_shani (grub_uint32_t *state, const grub_uint8_t *data,
+		     grub_size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+  __m128i abef, cdgh, abef_save, cdgh_save, msg[4], tmp;
+  unsigned i;
+
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[0]), 0xb1);
+  cdgh = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[4]), 0x1b);
+  abef = _mm_alignr_epi8 (tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16 (cdgh, tmp, 0xf0);
+
+  for (; nblocks; nblocks--, data += GRUB_SHA256_BLOCK_SIZE)
+    {
+      abef_save = abef;
+      cdgh_save = cdgh;
+
+      for (i = 0; i < 16; i++)
+	{
+	  if (i < 4)
+	    msg[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)
+							(data + 16 * i)),
+				       bswap);
+	  else
+	    msg[i & 3]
+	      = _mm_sha256msg2_epu32 (_mm_add_epi32 (_mm_sha256msg1_epu32 (msg[i & 3],
+									   msg[(i + 1) & 3]),
+						     _mm_alignr_epi8 (msg[(i + 3) & 3],
+								      msg[(i + 2) & 3], 4)),
+				      msg[(i + 3) & 3]);
+
+	  tmp = _mm_add_epi32 (msg[i & 3],
+			       _mm_load_si128 ((const __m128i *) &k[4 * i]));
+	  cdgh = _mm_sha256rnds2_epu32 (cdgh, abef, tmp);
+	  abef = _mm_sha256rnds2_epu32 (abef, cdgh, _mm_shuffle_epi32 (tmp, 0x0e));
+	}
+
+      abef = _mm_add_epi32 (abef, abef_save);
+      cdgh = _mm_add_epi32 (cdgh, cdgh_save);
+    }
+
+  tmp = _mm_shuffle_epi32 (abef, 0x1b);
+  cdgh = _mm_shuffle_epi32 (cdgh, 0xb1);
+  _mm_storeu_si128 ((__m128i *) &state[0], _mm_blend_epi16 (tmp, cdgh, 0xf0));
+  _mm_storeu_si128 ((__m128i *) &state[4], _mm_alignr_epi8 (cdgh, tmp, 8));
+}
+
+static int
+have_shani (void)
+{
+  unsigned eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return 0;
+  if (!__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return !!(ebx & bit_SHA);
+}
+#endif
+
+static void (*sha256_blocks) (grub_uint32_t *state, const grub_uint8_t *data,
+			      grub_size_t nblocks);
+
+void
+grub_sha256_init (struct grub_sha256_ctx *ctx)
+{
+  if (!sha256_blocks)
+    {
+#ifdef SHA256_SHANI
+      if (have_shani ())
+	sha256_blocks = sha256_blocks_shani;
+      else
+#endif
+	sha256_blocks = sha256_blocks_generic;
+    }
+
+  ctx->state[0] = 0x6a09e667;
+  ctx->state[1] = 0xbb67ae85;
+  ctx->state[2] = 0x3c6ef372;
+  ctx->state[3] = 0xa54ff53a;
+  ctx->state[4] = 0x510e527f;
+  ctx->state[5] = 0x9b05688c;
+  ctx->state[6] = 0x1f83d9ab;
+  ctx->state[7] = 0x5be0cd19;
+  ctx->count = 0;
+  ctx->buflen = 0;
+}
+
+void
+grub_sha256_update (struct grub_sha256_ctx *ctx, const void *data,
+		    grub_size_t len)
+{
+  const grub_uint8_t *p = data;
+  grub_size_t n;
+
+  ctx->count += len;
+
+  if (ctx->buflen)
+    {
+      n = GRUB_SHA256_BLOCK_SIZE - ctx->buflen;
+      if (n > len)
+	n = len;
+      grub_memcpy (ctx->buf + ctx->buflen, p, n);
+      ctx->buflen += n;
+      p += n;
+      len -= n;
+      if (ctx->buflen < GRUB_SHA256_BLOCK_SIZE)
+	return;
+      sha256_blocks (ctx->state, ctx->buf, 1);
+      ctx->buflen = 0;
+    }
+
+  n = len / GRUB_SHA256_BLOCK_SIZE;
+  if (n)
+    {
+      sha256_blocks (ctx->state, p, n);
+      p += n * GRUB_SHA256_BLOCK_SIZE;
+      len -= n * GRUB_SHA256_BLOCK_SIZE;
+    }
+
+  grub_memcpy (ctx->buf, p, len);
+  ctx->buflen = len;
+}
+
+void
+grub_sha256_final (struct grub_sha256_ctx *ctx,
+		   grub_uint8_t digest[GRUB_SHA256_DIGEST_SIZE])
+{
+  grub_uint64_t bits = ctx->count << 3;
+  unsigned i;
+
+  ctx->buf[ctx->buflen++] = 0x80;
+  if (ctx->buflen > GRUB_SHA256_BLOCK_SIZE - 8)
+    {
+      grub_memset (ctx->buf + ctx->buflen, 0,
+		   GRUB_SHA256_BLOCK_SIZE - ctx->buflen);
+      sha256_blocks (ctx->state, ctx->buf, 1);
+      ctx->buflen = 0;
+    }
+  grub_memset (ctx->buf + ctx->buflen, 0,
+	       GRUB_SHA256_BLOCK_SIZE - 8 - ctx->buflen);
+  for (i = 0; i < 8; i++)
+    ctx->buf[GRUB_SHA256_BLOCK_SIZE - 1 - i] = bits >> (8 * i);
+  sha256_blocks (ctx->state, ctx->buf, 1);
+
+  for (i = 0; i < 8; i++)
+    {
+      digest[4 * i] = ctx->state[i] >> 24;
+      digest[4 * i + 1] = ctx->state[i] >> 16;
+      digest[4 * i + 2] = ctx->state[i] >> 8;
+      digest[4 * i + 3] = ctx->state[i];
+    }
+}
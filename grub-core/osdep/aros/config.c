@@ -67,3 +67,9 @@ grub_util_file_sync (FILE *f)
     return 0;
   return fsync (fileno (f));
 }
+
+int
+grub_util_rename (const char *from, const char *to)
+{
+  return rename (from, to);
+}
@@ -0,0 +1,43 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <config-util.h>
+
+#include <grub/util/misc.h>
+
+/* The host has no batched I/O: the callers read and write through
+   stdio.  */
+
+int
+grub_util_batch_load (grub_size_t n __attribute__ ((unused)),
+		      char *const *paths __attribute__ ((unused)),
+		      char *const *bufs __attribute__ ((unused)))
+{
+  return -1;
+}
+
+int
+grub_util_batch_write (int fd __attribute__ ((unused)),
+		       const char *img __attribute__ ((unused)),
+		       size_t size __attribute__ ((unused)),
+		       off_t offset __attribute__ ((unused)),
+		       const char *name __attribute__ ((unused)))
+{
+  return -1;
+}
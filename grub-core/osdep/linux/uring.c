@@ -0,0 +1,406 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <config-util.h>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <grub/util/misc.h>
+#include <grub/i18n.h>
+
+/* The number of requests in flight at once.  */
+#define RING_ENTRIES 64
+/* Files are read and written in pieces of this size, so that a large
+   file is transferred by several requests at once.  */
+#define RING_CHUNK_SIZE (1 << 20)
+
+struct ring
+{
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+/* A read or write of LEN bytes of BUF at OFF in FD, which is the file
+   NAME.  */
+struct ring_xfer
+{
+  int fd;
+  const char *name;
+  char *buf;
+  size_t len;
+  off_t off;
+};
+
+static void
+ring_fini (struct ring *ring)
+{
+  if (ring->sqes != MAP_FAILED)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map != MAP_FAILED)
+    munmap (ring->sq_map, ring->sq_map_size);
+  close (ring->fd);
+}
+
+/* Set up RING and check that the kernel knows the NOPS operations in
+   OPS.  Return -1 if it cannot be used.  */
+static int
+ring_init (struct ring *ring, const grub_uint8_t *ops, size_t nops)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t i;
+  int ok;
+
+  memset (&p, 0, sizeof (p));
+  ring->fd = syscall (__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (ring->fd < 0)
+    return -1;
+
+  ring->entries = p.sq_entries;
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_map_size = p.cq_off.cqes
+    + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP)
+      && ring->cq_map_size > ring->sq_map_size)
+    ring->sq_map_size = ring->cq_map_size;
+
+  ring->sq_map = mmap (0, ring->sq_map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP))
+    ring->cq_map = ring->sq_map;
+  else
+    ring->cq_map = mmap (0, ring->cq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+  ring->sqes = mmap (0, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED
+      || ring->sqes == MAP_FAILED)
+    {
+      ring_fini (ring);
+      return -1;
+    }
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_map + p.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_map + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_map + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_map + p.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_map + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_map + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_map + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map + p.cq_off.cqes);
+
+  probe = xcalloc (1, sizeof (*probe) + 256 * sizeof (probe->ops[0]));
+  ok = syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+		probe, 256) == 0;
+  for (i = 0; ok && i < nops; i++)
+    ok = ops[i] <= probe->last_op
+      && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free (probe);
+  if (!ok)
+    {
+      ring_fini (ring);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Submit the N requests in OPS, keeping the ring full, and store the
+   result of each in RES.  */
+static void
+ring_run (struct ring *ring, const struct io_uring_sqe *ops, size_t n,
+	  int *res)
+{
+  size_t next = 0, done = 0;
+  unsigned inflight = 0, tail = *ring->sq_tail, head;
+
+  while (done < n)
+    {
+      unsigned pending;
+
+      while (next < n && inflight < ring->entries)
+	{
+	  unsigned idx = tail & *ring->sq_mask;
+
+	  ring->sqes[idx] = ops[next];
+	  ring->sqes[idx].user_data = next;
+	  ring->sq_array[idx] = idx;
+	  tail++;
+	  next++;
+	  inflight++;
+	}
+      __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+      pending = tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      if (syscall (__NR_io_uring_enter, ring->fd, pending, 1,
+		   IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+	grub_util_error (_("cannot submit I/O requests: %s"), strerror (errno));
+
+      head = *ring->cq_head;
+      while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+	  res[cqe->user_data] = cqe->res;
+	  head++;
+	  inflight--;
+	  done++;
+	}
+      __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Carry out the N transfers in XFERS with OPCODE, resubmitting what is
+   left of the short ones.  */
+static void
+ring_transfer (struct ring *ring, struct ring_xfer *xfers, size_t n,
+	       grub_uint8_t opcode)
+{
+  struct io_uring_sqe *ops = xcalloc (n ? : 1, sizeof (ops[0]));
+  size_t *which = xcalloc (n ? : 1, sizeof (which[0]));
+  int *res = xcalloc (n ? : 1, sizeof (res[0]));
+  int writing = opcode != IORING_OP_READ;
+  size_t i, nops;
+
+  do
+    {
+      nops = 0;
+      for (i = 0; i < n; i++)
+	{
+	  if (!xfers[i].len)
+	    continue;
+	  memset (&ops[nops], 0, sizeof (ops[0]));
+	  ops[nops].opcode = opcode;
+	  ops[nops].fd = xfers[i].fd;
+	  ops[nops].addr = (unsigned long) xfers[i].buf;
+	  ops[nops].len = xfers[i].len;
+	  ops[nops].off = xfers[i].off;
+	  which[nops++] = i;
+	}
+
+      ring_run (ring, ops, nops, res);
+
+      for (i = 0; i < nops; i++)
+	{
+	  struct ring_xfer *x = &xfers[which[i]];
+
+	  if (res[i] <= 0 && writing)
+	    grub_util_error (_("cannot write to `%s': %s"), x->name,
+			     strerror (res[i] ? -res[i] : EIO));
+	  if (res[i] <= 0)
+	    grub_util_error (_("cannot read `%s': %s"), x->name,
+			     strerror (res[i] ? -res[i] : EIO));
+	  x->buf += res[i];
+	  x->off += res[i];
+	  x->len -= res[i];
+	}
+    }
+  while (nops);
+
+  free (ops);
+  free (which);
+  free (res);
+}
+
+/* Split LEN bytes of BUF at OFF in FD into pieces in *XFERS.  */
+static void
+add_chunks (struct ring_xfer **xfers, size_t *n, size_t *max, int fd,
+	    const char *name, char *buf, size_t len, off_t off)
+{
+  size_t pos;
+
+  for (pos = 0; pos < len; pos += RING_CHUNK_SIZE)
+    {
+      if (*n == *max)
+	{
+	  *max = *max ? 2 * *max : 64;
+	  *xfers = xrealloc (*xfers, *max * sizeof ((*xfers)[0]));
+	}
+      (*xfers)[*n].fd = fd;
+      (*xfers)[*n].name = name;
+      (*xfers)[*n].buf = buf + pos;
+      (*xfers)[*n].len = len - pos < RING_CHUNK_SIZE ? len - pos
+	: RING_CHUNK_SIZE;
+      (*xfers)[*n].off = off + pos;
+      (*n)++;
+    }
+}
+
+struct sparse_ctx
+{
+  struct ring_xfer **xfers;
+  size_t *n, *max;
+  int fd;
+  const char *name;
+  char *buf;
+  off_t done;
+};
+
+/* Queue the extent at OFFSET, zeroing the hole before it.  */
+static void
+add_extent (void *data, off_t offset, off_t len)
+{
+  struct sparse_ctx *ctx = data;
+
+  memset (ctx->buf + ctx->done, 0, offset - ctx->done);
+  ctx->done = offset + len;
+  add_chunks (ctx->xfers, ctx->n, ctx->max, ctx->fd, ctx->name,
+	      ctx->buf + offset, len, offset);
+}
+
+int
+grub_util_batch_load (grub_size_t n, char *const *paths, char *const *bufs)
+{
+  static const grub_uint8_t need[] = { IORING_OP_OPENAT, IORING_OP_STATX,
+				       IORING_OP_READ, IORING_OP_CLOSE };
+  struct ring ring;
+  struct io_uring_sqe *ops;
+  struct statx *stx;
+  struct ring_xfer *xfers = NULL;
+  size_t nxfers = 0, max = 0, i;
+  int *res, *fds;
+
+  if (!n)
+    return 0;
+  if (ring_init (&ring, need, ARRAY_SIZE (need)) < 0)
+    return -1;
+
+  /* Open and size all the files at once...  */
+  ops = xcalloc (2 * n, sizeof (ops[0]));
+  res = xcalloc (2 * n, sizeof (res[0]));
+  stx = xcalloc (n, sizeof (stx[0]));
+  fds = xcalloc (n, sizeof (fds[0]));
+  for (i = 0; i < n; i++)
+    {
+      grub_util_info ("reading %s", paths[i]);
+      ops[2 * i].opcode = IORING_OP_OPENAT;
+      ops[2 * i].fd = AT_FDCWD;
+      ops[2 * i].addr = (unsigned long) paths[i];
+      ops[2 * i].open_flags = O_RDONLY | O_CLOEXEC;
+      ops[2 * i + 1].opcode = IORING_OP_STATX;
+      ops[2 * i + 1].fd = AT_FDCWD;
+      ops[2 * i + 1].addr = (unsigned long) paths[i];
+      ops[2 * i + 1].len = STATX_SIZE | STATX_BLOCKS;
+      ops[2 * i + 1].off = (unsigned long) &stx[i];
+    }
+  ring_run (&ring, ops, 2 * n, res);
+
+  for (i = 0; i < n; i++)
+    {
+      if (res[2 * i] < 0 || res[2 * i + 1] < 0)
+	grub_util_error (_("cannot open `%s': %s"), paths[i],
+			 strerror (res[2 * i] < 0 ? -res[2 * i]
+				   : -res[2 * i + 1]));
+      if (stx[i].stx_size != (size_t) stx[i].stx_size)
+	grub_util_error (_("file `%s' is too big"), paths[i]);
+      fds[i] = res[2 * i];
+
+      /* Only the data of a sparse file is read.  */
+      if (stx[i].stx_blocks * 512 < stx[i].stx_size)
+	{
+	  struct sparse_ctx ctx = { &xfers, &nxfers, &max, fds[i], paths[i],
+				    bufs[i], 0 };
+	  size_t first = nxfers;
+
+	  if (grub_util_data_extents (fds[i], stx[i].stx_size, add_extent,
+				      &ctx) == 0)
+	    {
+	      memset (bufs[i] + ctx.done, 0, stx[i].stx_size - ctx.done);
+	      continue;
+	    }
+	  nxfers = first;
+	}
+      add_chunks (&xfers, &nxfers, &max, fds[i], paths[i], bufs[i],
+		  stx[i].stx_size, 0);
+    }
+
+  /* ... then read them all at once, and close them.  */
+  ring_transfer (&ring, xfers, nxfers, IORING_OP_READ);
+
+  memset (ops, 0, n * sizeof (ops[0]));
+  for (i = 0; i < n; i++)
+    {
+      if (stx[i].stx_size >= GRUB_UTIL_LARGE_FILE_SIZE)
+	grub_util_drop_cache (fds[i], 0, stx[i].stx_size);
+      ops[i].opcode = IORING_OP_CLOSE;
+      ops[i].fd = fds[i];
+    }
+  ring_run (&ring, ops, n, res);
+
+  free (xfers);
+  free (fds);
+  free (stx);
+  free (res);
+  free (ops);
+  ring_fini (&ring);
+  return 0;
+}
+
+int
+grub_util_batch_write (int fd, const char *img, size_t size, off_t offset,
+		       const char *name)
+{
+  static const grub_uint8_t need[] = { IORING_OP_WRITE,
+				       IORING_OP_WRITE_FIXED };
+  struct ring ring;
+  struct ring_xfer *xfers = NULL;
+  size_t nxfers = 0, max = 0;
+  struct iovec iov;
+  int fixed;
+
+  if (ring_init (&ring, need, ARRAY_SIZE (need)) < 0)
+    return -1;
+
+  /* Registering the image saves mapping it for every piece, but needs
+     it to be locked in memory, which the limits may not allow.  */
+  iov.iov_base = (void *) img;
+  iov.iov_len = size;
+  fixed = size <= (1U << 30)
+    && syscall (__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+		&iov, 1) == 0;
+  grub_util_info ("writing 0x%" GRUB_HOST_PRIxLONG_LONG " bytes%s",
+		  (unsigned long long) size,
+		  fixed ? " from a registered buffer" : "");
+
+  add_chunks (&xfers, &nxfers, &max, fd, name, (char *) img, size, offset);
+  ring_transfer (&ring, xfers, nxfers,
+		 fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE);
+
+  free (xfers);
+  ring_fini (&ring);
+  return 0;
+}
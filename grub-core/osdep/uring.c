@@ -0,0 +1,5 @@
+#if defined (__linux__) && defined (HAVE_IO_URING)
+#include "linux/uring.c"
+#else
+#include "basic/uring.c"
+#endif
@@ -210,6 +210,24 @@ grub_util_file_sync (FILE *f)
   return 0;
 }
 
+int
+grub_util_rename (const char *from, const char *to)
+{
+  LPTSTR windows_from, windows_to;
+  int ret;
+
+  /* Unlike rename, this replaces TO when it exists.  */
+  windows_from = grub_util_get_windows_path (from);
+  windows_to = grub_util_get_windows_path (to);
+  ret = MoveFileEx (windows_from, windows_to, MOVEFILE_REPLACE_EXISTING)
+    ? 0 : -1;
+  if (ret < 0)
+    grub_util_info ("move err %x", (int) GetLastError ());
+  free (windows_to);
+  free (windows_from);
+  return ret;
+}
+
 #else
 
 void
@@ -227,4 +245,10 @@ grub_util_fopen (const char *path, const char *mode)
   return fopen (path, mode);
 }
 
+int
+grub_util_rename (const char *from, const char *to)
+{
+  return rename (from, to);
+}
+
 #endif
@@ -54,4 +54,7 @@ grub_util_fopen (const char *path, const char *mode);
 
 int grub_util_file_sync (FILE *f);
 
+/* Rename FROM to TO, replacing TO if it exists.  */
+int grub_util_rename (const char *from, const char *to);
+
 #endif /* GRUB_EMU_MISC_H */
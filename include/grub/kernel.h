@@ -27,6 +27,11 @@
 #define OBJ_TYPE_CONFIG  0x02
 #define OBJ_TYPE_PREFIX  0x03
 #define OBJ_TYPE_FONT    0x04
+/* A module linked by mkimage, to be used in place.  Its sections have
+   their offsets in the module as addresses and only need the base
+   relocations of the image applied.  */
+#define OBJ_TYPE_ELF_PRELINKED 0x05
+#define OBJ_TYPE_SYMHASH 0x06
 
 /* The module header.  */
 struct grub_module_header
@@ -39,6 +44,36 @@ struct grub_module_header
   grub_uint32_t size;
 } GRUB_PACKED;
 
+/* The kernel symbols, as embedded by mkimage: an open-addressed hash table
+   of NBUCKETS entries, a power of two, probed linearly from the slot of
+   the FNV-1a hash of the name.  The names follow the entries; an entry
+   with its name at the offset 0 is empty.  */
+struct grub_module_symhash_entry
+{
+  grub_uint32_t hash;
+  /* The offset of the name from the start of the table.  */
+  grub_uint32_t name;
+  /* The address of the symbol relative to the image base.  */
+  grub_uint32_t rva;
+};
+
+struct grub_module_symhash
+{
+  grub_uint32_t nbuckets;
+  grub_uint32_t nsymbols;
+  struct grub_module_symhash_entry entries[0];
+};
+
+static inline grub_uint32_t
+grub_symhash (const char *name)
+{
+  grub_uint32_t hash = 0x811c9dc5;
+
+  while (*name)
+    hash = (hash ^ (grub_uint8_t) *name++) * 0x01000193;
+  return hash;
+}
+
 /* "gmim" (GRUB Module Info Magic).  */
 #define GRUB_MODULE_MAGIC 0x676d696d
 
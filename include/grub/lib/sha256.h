@@ -0,0 +1,42 @@
+/* sha256.h - SHA-256 message digest */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRUB_LIB_SHA256_HEADER
+#define GRUB_LIB_SHA256_HEADER	1
+
+#include <grub/types.h>
+
+#define GRUB_SHA256_BLOCK_SIZE	64
+#define GRUB_SHA256_DIGEST_SIZE	32
+
+struct grub_sha256_ctx
+{
+  grub_uint32_t state[8];
+  grub_uint64_t count;
+  grub_uint8_t buf[GRUB_SHA256_BLOCK_SIZE];
+  unsigned buflen;
+};
+
+void grub_sha256_init (struct grub_sha256_ctx *ctx);
+void grub_sha256_update (struct grub_sha256_ctx *ctx, const void *data,
+			 grub_size_t len);
+void grub_sha256_final (struct grub_sha256_ctx *ctx,
+			grub_uint8_t digest[GRUB_SHA256_DIGEST_SIZE]);
+
+#endif /* ! GRUB_LIB_SHA256_HEADER */
@@ -31,6 +31,30 @@ typedef enum {
 
 struct grub_install_image_target_desc;
 
+/* The optional features of an image.  Zero means the feature is off; a
+   NULL path means the file is not read or written.  */
+struct grub_install_image_options
+{
+  int gc_sections;
+  int fold_sections;
+  const char *section_order;
+  const char *stats_path;
+  int virtual_bss;
+  const char *authenticode_path;
+  size_t cert_reserve;
+  int pe_checksum;
+  int align_modules;
+  int memdisk_section;
+  int prelink;
+  int symbol_hash;
+  int resolve_deps;
+  const char *deps_cache;
+  int strip_modules;
+  const char *symbol_map_path;
+  const char *size_budget_path;
+  const char *gc_roots_path;
+};
+
 void
 grub_install_generate_image (const char *dir, const char *prefix,
 			     FILE *out,
@@ -39,7 +63,8 @@ grub_install_generate_image (const char *dir, const char *prefix,
 			     char *config_path,
 			     const struct grub_install_image_target_desc *image_target,
 			     grub_compression_t comp,
-			     const char *font_path, int pe32);
+			     const char *font_path, int pe32,
+			     const struct grub_install_image_options *options);
 
 const struct grub_install_image_target_desc *
 grub_install_get_image_target (const char *arg);
@@ -34,10 +34,55 @@ char *grub_util_get_path (const char *dir, const char *file);
 size_t grub_util_get_image_size (const char *path);
 char *grub_util_read_image (const char *path);
 void grub_util_load_image (const char *path, char *buf);
+extern int grub_util_cache_files;
+
+/* Files of at least this size are dropped from the host's page cache
+   once they are read or written, so that images with a large memdisk
+   do not evict everything else.  */
+#define GRUB_UTIL_LARGE_FILE_SIZE (32 << 20)
+void grub_util_drop_cache (int fd, off_t offset, off_t size);
+
+/* Call FN (DATA, OFFSET, LEN) for every extent holding data in the first
+   SIZE bytes of FD, in order; the rest are holes.  Return -1 if FD is not
+   sparse or its holes cannot be found.  This moves the offset of FD.  */
+int grub_util_data_extents (int fd, off_t size,
+			    void (*fn) (void *data, off_t offset, off_t len),
+			    void *data);
 void grub_util_write_image (const char *img, size_t size, FILE *out,
 			    const char *name);
 void grub_util_write_image_at (const void *img, size_t size, off_t offset,
 			       FILE *out, const char *name);
+/* Read the N files at PATHS into BUFS, which are large enough for them,
+   all at once.  */
+void grub_util_load_images (grub_size_t n, char *const *paths,
+			    char *const *bufs);
+
+/* Read or write through the host's batched I/O, if it has any.  These
+   return -1, having done nothing, if it cannot be used.  */
+int grub_util_batch_load (grub_size_t n, char *const *paths,
+			  char *const *bufs);
+int grub_util_batch_write (int fd, const char *img, size_t size,
+			   off_t offset, const char *name);
+
+/* Return the next blank-separated word of *P, or NULL if there is none,
+   and move *P past it.  Unlike strtok, this can be used by several
+   threads at once.  */
+char *grub_util_next_word (char **p);
+
+extern int grub_util_jobs;
+unsigned grub_util_get_jobs (void);
+/* Call FN (DATA, I) for every I below N, using up to grub_util_get_jobs ()
+   threads.  Tasks may run in any order and concurrently.  */
+void grub_util_run_tasks (grub_size_t n,
+			  void (*fn) (void *data, grub_size_t i),
+			  void *data);
+
+/* Call FN (DATA) in the background, if there is a thread to spare, and
+   return a handle for grub_util_finish_job, which waits for it.  */
+struct grub_util_job;
+struct grub_util_job *grub_util_start_job (void (*fn) (void *data),
+					   void *data);
+void grub_util_finish_job (struct grub_util_job *job);
 
 char *grub_canonicalize_file_name (const char *path);
 
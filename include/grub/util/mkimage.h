@@ -19,6 +19,78 @@
 #ifndef GRUB_UTIL_MKIMAGE_HEADER
 #define GRUB_UTIL_MKIMAGE_HEADER	1
 
+struct grub_mkimage_reloc_count
+{
+  grub_uint32_t type;
+  grub_size_t count;
+};
+
+/* Relocations applied to one kernel section.  */
+struct grub_mkimage_section_stats
+{
+  char *name;
+  struct grub_mkimage_reloc_count *relocs;
+  grub_size_t nrelocs;
+};
+
+struct grub_mkimage_stats
+{
+  struct grub_mkimage_section_stats *sections;
+  grub_size_t nsections;
+  /* Entries in the .reloc section or in the raw relocation list.  */
+  grub_size_t nfixups;
+  /* Padding between fixup blocks and at the end of .reloc.  */
+  grub_size_t reloc_padding;
+  /* Padding inserted to align sections.  */
+  grub_size_t section_padding;
+  grub_size_t tramp_size;
+  grub_size_t got_size;
+  /* BSS bytes written out as zeros.  */
+  grub_size_t bss_size;
+  /* Sections removed by --gc-sections, and their size.  */
+  grub_size_t gc_sections;
+  grub_uint64_t gc_size;
+};
+
+/* A PE base relocation of TYPE at the address ADDR.  */
+struct grub_mkimage_fixup
+{
+  grub_uint32_t addr;
+  grub_uint16_t type;
+};
+
+/* A global symbol and its address.  */
+struct grub_mkimage_symbol
+{
+  char *name;
+  grub_uint64_t addr;
+};
+
+/* An entry of the symbol map: a symbol of the kernel or a module, at
+   ADDR in the image and SIZE bytes long.  TYPE is in the style of nm.  */
+struct grub_mkimage_map_symbol
+{
+  char *name;
+  grub_uint64_t addr;
+  grub_uint64_t size;
+  char type;
+};
+
+/* A module as seen by the pre-linker.  Its sections are used in place,
+   those without contents going after the file, which makes it SIZE bytes
+   long.  DEFS are relative to the start of the module.  */
+struct grub_mkimage_prelink_info
+{
+  size_t size;
+  struct grub_mkimage_symbol *defs;
+  size_t ndefs;
+  char **undefs;
+  size_t nundefs;
+};
+
+/* Pre-linked modules start on this boundary.  */
+#define GRUB_MKIMAGE_MODULE_ALIGN	4096
+
 struct grub_mkimage_layout
 {
   size_t exec_size;
@@ -35,6 +107,21 @@ struct grub_mkimage_layout
   unsigned ia64jmpnum;
   grub_uint32_t bss_start;
   grub_uint32_t end;
+  /* .bss, from BSS_START to END, is left out of the file and described
+     by a section of its own rather than written out as zeros.  */
+  int virtual_bss;
+  /* If kept, the base relocations of the kernel, to which those of
+     pre-linked modules are added, and its global symbols sorted by
+     name.  */
+  struct grub_mkimage_fixup *fixups;
+  size_t nfixups;
+  struct grub_mkimage_symbol *symbols;
+  size_t nsymbols;
+  /* If asked for, every named symbol of the kernel for the symbol
+     map.  */
+  struct grub_mkimage_map_symbol *map_symbols;
+  size_t nmap_symbols;
+  struct grub_mkimage_stats stats;
 };
 
 /* Private header. Use only in mkimage-related sources.  */
@@ -42,11 +129,13 @@ char *
 grub_mkimage_load_image32 (const char *kernel_path,
 			   size_t total_module_size,
 			   struct grub_mkimage_layout *layout,
+			   const struct grub_install_image_options *options,
 			   const struct grub_install_image_target_desc *image_target);
 char *
 grub_mkimage_load_image64 (const char *kernel_path,
 			   size_t total_module_size,
 			   struct grub_mkimage_layout *layout,
+			   const struct grub_install_image_options *options,
 			   const struct grub_install_image_target_desc *image_target);
 void
 grub_mkimage_generate_elf32 (const struct grub_install_image_target_desc *image_target,
@@ -58,6 +147,55 @@ grub_mkimage_generate_elf64 (const struct grub_install_image_target_desc *image_
 			     char **core_img, size_t *core_size,
 			     Elf64_Addr target_addr,
 			     struct grub_mkimage_layout *layout);
+int
+grub_mkimage_prelink_scan32 (char *mod_img, size_t mod_size,
+			     const char *name,
+			     struct grub_mkimage_prelink_info *info,
+			     const struct grub_install_image_target_desc *image_target);
+int
+grub_mkimage_prelink_scan64 (char *mod_img, size_t mod_size,
+			     const char *name,
+			     struct grub_mkimage_prelink_info *info,
+			     const struct grub_install_image_target_desc *image_target);
+int
+grub_mkimage_module_symbols32 (char *mod_img, size_t mod_size,
+			       struct grub_mkimage_prelink_info *info,
+			       const struct grub_install_image_target_desc *image_target);
+int
+grub_mkimage_module_symbols64 (char *mod_img, size_t mod_size,
+			       struct grub_mkimage_prelink_info *info,
+			       const struct grub_install_image_target_desc *image_target);
+char *
+grub_mkimage_strip_module32 (const char *mod_img, size_t mod_size,
+			     size_t *stripped_size,
+			     const struct grub_install_image_target_desc *image_target);
+char *
+grub_mkimage_strip_module64 (const char *mod_img, size_t mod_size,
+			     size_t *stripped_size,
+			     const struct grub_install_image_target_desc *image_target);
+void
+grub_mkimage_prelink32 (char *mod_img, size_t mod_size, grub_uint64_t base,
+			const struct grub_mkimage_symbol *symbols,
+			size_t nsymbols, struct grub_mkimage_layout *layout,
+			const struct grub_install_image_target_desc *image_target);
+void
+grub_mkimage_prelink64 (char *mod_img, size_t mod_size, grub_uint64_t base,
+			const struct grub_mkimage_symbol *symbols,
+			size_t nsymbols, struct grub_mkimage_layout *layout,
+			const struct grub_install_image_target_desc *image_target);
+void
+grub_mkimage_make_pe_relocs32 (struct grub_mkimage_layout *layout,
+			       const struct grub_install_image_target_desc *image_target);
+void
+grub_mkimage_make_pe_relocs64 (struct grub_mkimage_layout *layout,
+			       const struct grub_install_image_target_desc *image_target);
+
+void
+grub_mkimage_sort_symbols (struct grub_mkimage_symbol *symbols,
+			   size_t nsymbols);
+const struct grub_mkimage_symbol *
+grub_mkimage_find_symbol (const struct grub_mkimage_symbol *symbols,
+			  size_t nsymbols, const char *name);
 
 struct grub_install_image_target_desc
 {
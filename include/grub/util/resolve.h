@@ -0,0 +1,37 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRUB_UTIL_RESOLVE_HEADER
+#define GRUB_UTIL_RESOLVE_HEADER	1
+
+struct grub_install_image_target_desc;
+
+/* Return MODULES and the modules in DIR they depend on, each one after
+   those it needs, as a NULL-terminated list of file names in DIR.  The
+   dependencies come from moddep.lst in DIR or, failing that, from the
+   symbols of the modules.  If CACHE_PATH is not NULL, the dependency
+   graph is kept there for the next run.  */
+char **
+grub_util_resolve_dependencies (const char *dir, char *modules[],
+				const char *cache_path,
+				const struct grub_install_image_target_desc *image_target);
+
+void
+grub_util_free_module_list (char **list);
+
+#endif /* ! GRUB_UTIL_RESOLVE_HEADER */
@@ -28,6 +28,9 @@
 #include <grub/misc.h>
 #include <grub/offsets.h>
 #include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
 #include <multiboot.h>
 
 #include <stdio.h>
@@ -53,17 +56,81 @@
 
 
 
+enum
+  {
+    OPTION_GC_SECTIONS = 0x100,
+    OPTION_FOLD_SECTIONS,
+    OPTION_SECTION_ORDER,
+    OPTION_STATS,
+    OPTION_VIRTUAL_BSS,
+    OPTION_AUTHENTICODE,
+    OPTION_RESERVE_CERT,
+    OPTION_PE_CHECKSUM,
+    OPTION_ALIGN_MODULES,
+    OPTION_MEMDISK_SECTION,
+    OPTION_PRELINK,
+    OPTION_SYMBOL_HASH,
+    OPTION_RESOLVE_DEPS,
+    OPTION_DEPS_CACHE,
+    OPTION_STRIP_MODULES,
+    OPTION_SYMBOL_MAP,
+    OPTION_SIZE_BUDGET,
+    OPTION_MANIFEST,
+    OPTION_GC_ROOTS,
+  };
+
 static struct argp_option options[] = {
   {"directory",  'd', N_("DIR"), 0,
    N_("use images and modules under DIR [default=%s/<platform>]"), 0},
   {"prefix",  'p', N_("DIR"), 0, N_("set prefix directory"), 0},
   {"memdisk",  'm', N_("FILE"), 0, N_("embed FILE as a memdisk image"), 0},
+  {"memdisk-section", OPTION_MEMDISK_SECTION, 0, 0,
+   N_("put the memdisk into a read-only PE section of its own"), 0},
   {"config",   'c', N_("FILE"), 0, N_("embed FILE as an early config"), 0},
   {"font", 'f', N_("FILE"), 0, N_("embed FILE as a font"), 0},
   {"output",  'o', N_("FILE"), 0, N_("output a generated image to FILE [default=stdout]"), 0},
   {"format",  'O', N_("FORMAT"), 0, 0, 0},
   {"compression",  'C', "(none|auto)", 0, N_("choose the compression to use for core image"), 0},
   {"pe32", 'E', 0, 0, N_("Use pe32 optional header"), 0},
+  {"align-modules", OPTION_ALIGN_MODULES, 0, 0,
+   N_("start every module on a 4 KiB boundary of the module area"), 0},
+  {"prelink", OPTION_PRELINK, 0, 0,
+   N_("link modules against the kernel and each other in place"), 0},
+  {"symbol-hash", OPTION_SYMBOL_HASH, 0, 0,
+   N_("embed a hash table of the kernel symbols for the module loader"), 0},
+  {"resolve-deps", OPTION_RESOLVE_DEPS, 0, 0,
+   N_("also embed the modules the given ones depend on, in load order"), 0},
+  {"deps-cache", OPTION_DEPS_CACHE, N_("FILE"), 0,
+   N_("keep the module dependencies in FILE between runs (implies --resolve-deps)"), 0},
+  {"strip-modules", OPTION_STRIP_MODULES, 0, 0,
+   N_("drop the sections and symbols the module loader does not use"), 0},
+  {"virtual-bss", OPTION_VIRTUAL_BSS, 0, 0,
+   N_("leave .bss out of EFI images instead of writing it out as zeros"), 0},
+  {"authenticode", OPTION_AUTHENTICODE, N_("FILE"), 0,
+   N_("write the Authenticode SHA-256 digest of the image to FILE"), 0},
+  {"reserve-cert", OPTION_RESERVE_CERT, N_("SIZE"), 0,
+   N_("reserve SIZE bytes at the end of EFI images for the certificate table; "
+      "a signer must fill them in before the image is used"), 0},
+  {"pe-checksum", OPTION_PE_CHECKSUM, 0, 0,
+   N_("fill in the checksum of the PE optional header"), 0},
+  {"stats", OPTION_STATS, N_("FILE"), 0,
+   N_("write relocation and layout statistics to FILE as JSON"), 0},
+  {"symbol-map", OPTION_SYMBOL_MAP, N_("FILE"), 0,
+   N_("write the addresses and sizes of the kernel symbols and modules to FILE"), 0},
+  {"size-budget", OPTION_SIZE_BUDGET, N_("FILE"), 0,
+   N_("fail if a part of the image is larger than its budget in FILE"), 0},
+  {"jobs", 'j', N_("N"), 0, N_("use N worker threads [default=number of CPUs]"), 0},
+  {"manifest", OPTION_MANIFEST, N_("FILE"), 0,
+   N_("build the images listed in FILE, one command line per line, in parallel; "
+      "-j and -v apply to all of them"), 0},
+  {"gc-sections", OPTION_GC_SECTIONS, 0, 0,
+   N_("remove kernel sections unreachable from the entry point or exported symbols"), 0},
+  {"gc-roots", OPTION_GC_ROOTS, N_("FILE"), 0,
+   N_("also keep the kernel symbols listed in FILE (implies --gc-sections)"), 0},
+  {"fold-sections", OPTION_FOLD_SECTIONS, 0, 0,
+   N_("fold identical read-only kernel sections and merge their strings"), 0},
+  {"section-order", OPTION_SECTION_ORDER, N_("FILE"), 0,
+   N_("lay out the kernel sections or symbols listed in FILE first"), 0},
   {"verbose",     'v', 0,      0, N_("print verbose messages."), 0},
   { 0, 0, 0, 0, 0, 0 }
 };
@@ -103,7 +170,29 @@ struct arguments
   char *memdisk;
   char *font;
   char *config;
+  char *section_order;
+  char *stats;
+  char *authenticode;
   int pe32;
+  int gc_sections;
+  int fold_sections;
+  int virtual_bss;
+  size_t reserve_cert;
+  int pe_checksum;
+  int align_modules;
+  int memdisk_section;
+  int prelink;
+  int symbol_hash;
+  int resolve_deps;
+  char *deps_cache;
+  int strip_modules;
+  char *symbol_map;
+  char *size_budget;
+  char *gc_roots;
+  char *manifest;
+  /* Set for the lines of a manifest, which cannot change the options
+     shared by all its images.  */
+  int in_manifest;
   const struct grub_install_image_target_desc *image_target;
   grub_compression_t comp;
 };
@@ -184,7 +273,138 @@ argp_parser (int key, char *arg, struct argp_state *state)
       arguments->pe32 = 1;
       break;
 
+    case OPTION_VIRTUAL_BSS:
+      arguments->virtual_bss = 1;
+      break;
+
+    case OPTION_GC_SECTIONS:
+      arguments->gc_sections = 1;
+      break;
+
+    case OPTION_GC_ROOTS:
+      if (arguments->gc_roots)
+	free (arguments->gc_roots);
+
+      arguments->gc_roots = xstrdup (arg);
+      break;
+
+    case OPTION_FOLD_SECTIONS:
+      arguments->fold_sections = 1;
+      break;
+
+    case OPTION_SECTION_ORDER:
+      if (arguments->section_order)
+	free (arguments->section_order);
+
+      arguments->section_order = xstrdup (arg);
+      break;
+
+    case OPTION_STATS:
+      if (arguments->stats)
+	free (arguments->stats);
+
+      arguments->stats = xstrdup (arg);
+      break;
+
+    case OPTION_AUTHENTICODE:
+      if (arguments->authenticode)
+	free (arguments->authenticode);
+
+      arguments->authenticode = xstrdup (arg);
+      break;
+
+    case OPTION_MEMDISK_SECTION:
+      arguments->memdisk_section = 1;
+      break;
+
+    case OPTION_PRELINK:
+      arguments->prelink = 1;
+      break;
+
+    case OPTION_SYMBOL_HASH:
+      arguments->symbol_hash = 1;
+      break;
+
+    case OPTION_RESOLVE_DEPS:
+      arguments->resolve_deps = 1;
+      break;
+
+    case OPTION_MANIFEST:
+      if (arguments->manifest)
+	free (arguments->manifest);
+
+      arguments->manifest = xstrdup (arg);
+      break;
+
+    case OPTION_SIZE_BUDGET:
+      if (arguments->size_budget)
+	free (arguments->size_budget);
+
+      arguments->size_budget = xstrdup (arg);
+      break;
+
+    case OPTION_SYMBOL_MAP:
+      if (arguments->symbol_map)
+	free (arguments->symbol_map);
+
+      arguments->symbol_map = xstrdup (arg);
+      break;
+
+    case OPTION_STRIP_MODULES:
+      arguments->strip_modules = 1;
+      break;
+
+    case OPTION_DEPS_CACHE:
+      if (arguments->deps_cache)
+	free (arguments->deps_cache);
+
+      arguments->deps_cache = xstrdup (arg);
+      break;
+
+    case OPTION_ALIGN_MODULES:
+      arguments->align_modules = 1;
+      break;
+
+    case OPTION_PE_CHECKSUM:
+      arguments->pe_checksum = 1;
+      break;
+
+    case OPTION_RESERVE_CERT:
+      {
+	char *end;
+	unsigned long long n = strtoull (arg, &end, 0);
+
+	if (*arg == '\0' || *arg == '-' || *end != '\0' || n > GRUB_INT_MAX)
+	  grub_util_error (_("invalid certificate table size `%s'"), arg);
+	arguments->reserve_cert = n;
+	break;
+      }
+
+    case 'j':
+      {
+	char *end;
+	long n;
+
+	if (arguments->in_manifest)
+	  {
+	    argp_error (state, _("-j applies to the whole manifest"));
+	    return EINVAL;
+	  }
+
+	n = strtol (arg, &end, 10);
+
+	if (*arg == '\0' || *end != '\0' || n <= 0)
+	  grub_util_error (_("invalid number of jobs `%s'"), arg);
+	grub_util_jobs = n;
+	break;
+      }
+
     case 'v':
+      if (arguments->in_manifest)
+	{
+	  argp_error (state, _("-v applies to the whole manifest"));
+	  return EINVAL;
+	}
       verbosity++;
       break;
     case ARGP_KEY_ARG:
@@ -204,82 +424,267 @@ static struct argp argp = {
   NULL, help_filter, NULL
 };
 
-int
-main (int argc, char *argv[])
+static void
+init_arguments (struct arguments *arguments, int argc)
 {
-  FILE *fp = stdout;
-  struct arguments arguments;
-  unsigned i;
-
-  grub_util_host_init (&argc, &argv);
-
-  memset (&arguments, 0, sizeof (struct arguments));
-  arguments.comp = GRUB_COMPRESSION_AUTO;
-  arguments.modules_max = argc + 1;
-  arguments.modules = xmalloc ((arguments.modules_max + 1)
-			     * sizeof (arguments.modules[0]));
-  memset (arguments.modules, 0, (arguments.modules_max + 1)
-	  * sizeof (arguments.modules[0]));
+  memset (arguments, 0, sizeof (*arguments));
+  arguments->comp = GRUB_COMPRESSION_AUTO;
+  arguments->modules_max = argc + 1;
+  arguments->modules = xcalloc (arguments->modules_max + 1,
+				sizeof (arguments->modules[0]));
+}
 
-  if (argp_parse (&argp, argc, argv, 0, 0, &arguments) != 0)
-    {
-      fprintf (stderr, "%s", _("Error in parsing command line arguments\n"));
-      exit(1);
-    }
+static void
+free_arguments (struct arguments *arguments)
+{
+  size_t i;
+
+  for (i = 0; i < arguments->nmodules; i++)
+    free (arguments->modules[i]);
+
+  free (arguments->dir);
+  free (arguments->prefix);
+  free (arguments->modules);
+  free (arguments->font);
+  free (arguments->config);
+  free (arguments->memdisk);
+  free (arguments->section_order);
+  free (arguments->stats);
+  free (arguments->authenticode);
+  free (arguments->deps_cache);
+  free (arguments->symbol_map);
+  free (arguments->size_budget);
+  free (arguments->gc_roots);
+  free (arguments->manifest);
+  free (arguments->output);
+}
 
-  if (!arguments.image_target)
-    {
-      char *program = xstrdup(program_name);
-      printf ("%s\n", _("Target format not specified (use the -O option)."));
-      argp_help (&argp, stderr, ARGP_HELP_STD_USAGE, program);
-      free (program);
-      exit(1);
-    }
+/* Build the image ARGUMENTS describe.  */
+static void
+build_image (struct arguments *arguments)
+{
+  FILE *fp = stdout;
+  struct grub_install_image_options image_options;
 
-  if (arguments.output)
+  if (arguments->output)
     {
-      fp = grub_util_fopen (arguments.output, "wb");
+      fp = grub_util_fopen (arguments->output, "wb");
       if (! fp)
-	grub_util_error (_("cannot open `%s': %s"), arguments.output,
+	grub_util_error (_("cannot open `%s': %s"), arguments->output,
 			 strerror (errno));
     }
 
-  if (!arguments.dir)
+  if (!arguments->dir)
     {
-      const char *dn = grub_util_get_target_dirname (arguments.image_target);
+      const char *dn = grub_util_get_target_dirname (arguments->image_target);
       const char *pkglibdir = grub_util_get_pkglibdir ();
       char *ptr;
-      arguments.dir = xmalloc (grub_strlen (pkglibdir) + grub_strlen (dn) + 2);
-      ptr = grub_stpcpy (arguments.dir, pkglibdir);
+      arguments->dir = xmalloc (grub_strlen (pkglibdir) + grub_strlen (dn) + 2);
+      ptr = grub_stpcpy (arguments->dir, pkglibdir);
       *ptr++ = '/';
       strcpy (ptr, dn);
     }
 
-  grub_install_generate_image (arguments.dir, arguments.prefix, fp,
-                    arguments.output, arguments.modules,
-                    arguments.memdisk, arguments.config,
-                    arguments.image_target, arguments.comp,
-                    arguments.font, arguments.pe32);
+  image_options.gc_sections = arguments->gc_sections;
+  image_options.fold_sections = arguments->fold_sections;
+  image_options.section_order = arguments->section_order;
+  image_options.stats_path = arguments->stats;
+  image_options.virtual_bss = arguments->virtual_bss;
+  image_options.authenticode_path = arguments->authenticode;
+  image_options.cert_reserve = arguments->reserve_cert;
+  image_options.pe_checksum = arguments->pe_checksum;
+  image_options.align_modules = arguments->align_modules;
+  image_options.memdisk_section = arguments->memdisk_section;
+  image_options.prelink = arguments->prelink;
+  image_options.symbol_hash = arguments->symbol_hash;
+  image_options.resolve_deps = arguments->resolve_deps;
+  image_options.deps_cache = arguments->deps_cache;
+  image_options.strip_modules = arguments->strip_modules;
+  image_options.symbol_map_path = arguments->symbol_map;
+  image_options.size_budget_path = arguments->size_budget;
+  image_options.gc_roots_path = arguments->gc_roots;
+
+  grub_install_generate_image (arguments->dir, arguments->prefix, fp,
+                    arguments->output, arguments->modules,
+                    arguments->memdisk, arguments->config,
+                    arguments->image_target, arguments->comp,
+                    arguments->font, arguments->pe32, &image_options);
 
   if (grub_util_file_sync (fp) < 0)
-    grub_util_error (_("cannot sync `%s': %s"), arguments.output ? : "stdout",
+    grub_util_error (_("cannot sync `%s': %s"), arguments->output ? : "stdout",
 		     strerror (errno));
   if (fclose (fp) == EOF)
-    grub_util_error (_("cannot close `%s': %s"), arguments.output ? : "stdout",
+    grub_util_error (_("cannot close `%s': %s"), arguments->output ? : "stdout",
 		     strerror (errno));
+}
+
+struct manifest
+{
+  struct arguments *images;
+  size_t nimages;
+  size_t done;
+};
+
+/* Read the images to build from the manifest at PATH: every line holds
+   the options and modules of one image, as on the command line, split at
+   blanks.  '#' starts a comment.  */
+static void
+read_manifest (const char *path, struct manifest *manifest)
+{
+  size_t size, max = 0;
+  unsigned line = 0;
+  char *buf, *p, *next;
+
+  size = grub_util_get_image_size (path);
+  buf = xmalloc (size + 1);
+  grub_util_load_image (path, buf);
+  buf[size] = '\0';
+
+  manifest->images = NULL;
+  manifest->nimages = 0;
+  manifest->done = 0;
+
+  for (p = buf; *p; p = next)
+    {
+      struct arguments *arguments;
+      char **argv, *end, *word;
+      int argc = 1;
+
+      line++;
+      next = strchr (p, '\n');
+      if (next)
+	*next++ = '\0';
+      else
+	next = p + strlen (p);
+
+      end = strchr (p, '#');
+      if (end)
+	*end = '\0';
+
+      /* Every word of the line is an argument at most.  */
+      argv = xcalloc (strlen (p) / 2 + 3, sizeof (argv[0]));
+      argv[0] = (char *) program_name;
+      while ((word = grub_util_next_word (&p)))
+	argv[argc++] = word;
+      if (argc == 1)
+	{
+	  free (argv);
+	  continue;
+	}
+
+      if (manifest->nimages == max)
+	{
+	  max = max ? 2 * max : 64;
+	  manifest->images = xrealloc (manifest->images,
+				       max * sizeof (manifest->images[0]));
+	}
+      arguments = &manifest->images[manifest->nimages++];
+      init_arguments (arguments, argc);
+      arguments->in_manifest = 1;
+
+      if (argp_parse (&argp, argc, argv, ARGP_NO_EXIT, 0, arguments) != 0)
+	grub_util_error (_("invalid line %u in `%s'"), line, path);
+      if (!arguments->image_target)
+	grub_util_error (_("no target format on line %u of `%s'"), line, path);
+      if (!arguments->output)
+	grub_util_error (_("no output file on line %u of `%s'"), line, path);
+      if (arguments->manifest)
+	grub_util_error (_("nested manifest on line %u of `%s'"), line, path);
+      free (argv);
+    }
+
+  free (buf);
+}
+
+static double
+now (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static void
+build_manifest_image (void *data, grub_size_t i)
+{
+  struct manifest *manifest = data;
+  struct arguments *arguments = &manifest->images[i];
+  double start = now ();
+  size_t done;
 
-  for (i = 0; i < arguments.nmodules; i++)
-    free (arguments.modules[i]);
+  build_image (arguments);
 
-  free (arguments.dir);
-  free (arguments.prefix);
-  free (arguments.modules);
-  free (arguments.font);
-  free (arguments.config);
-  free (arguments.memdisk);
+  done = __atomic_add_fetch (&manifest->done, 1, __ATOMIC_RELAXED);
+  fprintf (stderr, "%s: [%" PRIuGRUB_SIZE "/%" PRIuGRUB_SIZE "] %s (%.3f s)\n",
+	   program_name, (grub_size_t) done, (grub_size_t) manifest->nimages,
+	   arguments->output, now () - start);
+}
+
+/* Build the images in the manifest at PATH on the worker threads.  The
+   small files they read are cached, so that most are read only once.  */
+static void
+build_manifest (const char *path)
+{
+  struct manifest manifest;
+  double start = now ();
+  size_t i;
+
+  read_manifest (path, &manifest);
+
+  grub_util_cache_files = 1;
+  grub_util_run_tasks (manifest.nimages, build_manifest_image, &manifest);
+
+  fprintf (stderr, "%s: built %" PRIuGRUB_SIZE " images in %.3f s\n",
+	   program_name, (grub_size_t) manifest.nimages, now () - start);
+
+  for (i = 0; i < manifest.nimages; i++)
+    free_arguments (&manifest.images[i]);
+  free (manifest.images);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct arguments arguments;
+
+  grub_util_host_init (&argc, &argv);
+
+  init_arguments (&arguments, argc);
+
+  if (argp_parse (&argp, argc, argv, 0, 0, &arguments) != 0)
+    {
+      fprintf (stderr, "%s", _("Error in parsing command line arguments\n"));
+      exit(1);
+    }
+
+  if (arguments.manifest)
+    {
+      if (arguments.image_target || arguments.output || arguments.nmodules)
+	grub_util_error ("%s", _("images are described in the manifest, not on the command line"));
+      build_manifest (arguments.manifest);
+      free_arguments (&arguments);
+      return 0;
+    }
+
+  if (!arguments.image_target)
+    {
+      char *program = xstrdup(program_name);
+      printf ("%s\n", _("Target format not specified (use the -O option)."));
+      argp_help (&argp, stderr, ARGP_HELP_STD_USAGE, program);
+      free (program);
+      exit(1);
+    }
 
-  if (arguments.output)
-    free (arguments.output);
+  build_image (&arguments);
+  free_arguments (&arguments);
 
   return 0;
 }
@@ -16,7 +16,10 @@
 # define Elf_Section    Elf32_Section
 # define ELF_R_SYM(val)		ELF32_R_SYM(val)
 # define ELF_R_TYPE(val)		ELF32_R_TYPE(val)
+# define ELF_R_INFO(sym, type)	ELF32_R_INFO(sym, type)
 # define ELF_ST_TYPE(val)		ELF32_ST_TYPE(val)
+# define ELF_ST_BIND(val)		ELF32_ST_BIND(val)
+# define ELF_ST_VISIBILITY(val)	ELF32_ST_VISIBILITY(val)
 
 #define XEN_NOTE_SIZE		132
 #define XEN_PVH_NOTE_SIZE	20
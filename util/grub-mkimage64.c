@@ -16,7 +16,10 @@
 # define Elf_Section    Elf64_Section
 # define ELF_R_SYM(val)		ELF64_R_SYM(val)
 # define ELF_R_TYPE(val)		ELF64_R_TYPE(val)
+# define ELF_R_INFO(sym, type)	ELF64_R_INFO(sym, type)
 # define ELF_ST_TYPE(val)		ELF64_ST_TYPE(val)
+# define ELF_ST_BIND(val)		ELF64_ST_BIND(val)
+# define ELF_ST_VISIBILITY(val)	ELF64_ST_VISIBILITY(val)
 
 #define XEN_NOTE_SIZE		120
 #define XEN_PVH_NOTE_SIZE	24
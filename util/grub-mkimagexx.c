@@ -52,14 +52,41 @@
 #endif
 #endif
 
-struct fixup_block_list
+#define ALIGN_ADDR(x) (ALIGN_UP((x), image_target->voidp_sizeof))
+
+/* Trampolines and GOT entries are shared by all relocations referring to
+   the same symbol with the same addend.  */
+enum reloc_slot_kind
+  {
+    RELOC_SLOT_NONE,
+    /* 8-byte Thumb to ARM trampoline.  */
+    RELOC_SLOT_TRAMP_THM,
+    /* 16-byte ARM to Thumb trampoline.  */
+    RELOC_SLOT_TRAMP_ARM,
+    /* 8-byte GOT entry.  */
+    RELOC_SLOT_GOT,
+  };
+
+struct reloc_slot
 {
-  struct fixup_block_list *next;
-  int state;
-  struct grub_pe32_fixup_block b;
+  Elf_Word sym;
+  Elf_Addr addend;
+  enum reloc_slot_kind kind;
+  /* Offset from the start of the trampolines or of the GOT.  */
+  Elf_Addr offset;
 };
 
-#define ALIGN_ADDR(x) (ALIGN_UP((x), image_target->voidp_sizeof))
+struct reloc_slots
+{
+  /* Slots in allocation order.  */
+  struct reloc_slot *slots;
+  grub_size_t nslots, slots_max;
+  /* Open-addressed index into SLOTS, holding the slot number plus one.  */
+  grub_size_t *hash;
+  grub_size_t hash_size;
+  /* Total size of the trampolines and of the GOT.  */
+  Elf_Addr tramp_size, got_size;
+};
 
 struct section_metadata
 {
@@ -70,8 +97,137 @@ struct section_metadata
   Elf_Half section_entsize;
   Elf_Shdr *symtab;
   const char *strtab;
+  struct reloc_slots *slots;
+  /* Section indices in the order they are laid out, or NULL for the
+     order of the section headers.  */
+  Elf_Half *order;
+  /* Replacement contents for sections, or NULL.  */
+  char **contents;
+  /* Relocations applied to each section.  */
+  struct grub_mkimage_section_stats *reloc_stats;
+  struct grub_mkimage_stats *stats;
 };
 
+static void
+count_reloc (struct grub_mkimage_section_stats *st, grub_uint32_t type)
+{
+  grub_size_t i;
+
+  for (i = 0; i < st->nrelocs; i++)
+    if (st->relocs[i].type == type)
+      {
+	st->relocs[i].count++;
+	return;
+      }
+
+  st->relocs = xrealloc (st->relocs, (st->nrelocs + 1) * sizeof (st->relocs[0]));
+  st->relocs[st->nrelocs].type = type;
+  st->relocs[st->nrelocs++].count = 1;
+}
+
+static grub_size_t
+reloc_slot_hash (Elf_Word sym, Elf_Addr addend, enum reloc_slot_kind kind,
+		 grub_size_t hash_size)
+{
+  grub_uint64_t h;
+
+  h = ((grub_uint64_t) sym << 2 | kind) * 0x9e3779b97f4a7c15ULL;
+  h ^= (grub_uint64_t) addend * 0xc2b2ae3d27d4eb4fULL;
+  h ^= h >> 29;
+  return h & (hash_size - 1);
+}
+
+/* Return the slot for SYM, ADDEND and KIND, or NULL if there is none.  */
+static struct reloc_slot *
+reloc_slot_find (struct reloc_slots *rs, Elf_Word sym, Elf_Addr addend,
+		 enum reloc_slot_kind kind)
+{
+  grub_size_t h;
+
+  if (!rs->hash_size)
+    return NULL;
+
+  for (h = reloc_slot_hash (sym, addend, kind, rs->hash_size); rs->hash[h];
+       h = (h + 1) & (rs->hash_size - 1))
+    {
+      struct reloc_slot *slot = &rs->slots[rs->hash[h] - 1];
+
+      if (slot->sym == sym && slot->addend == addend && slot->kind == kind)
+	return slot;
+    }
+
+  return NULL;
+}
+
+/* Allocate a slot for SYM, ADDEND and KIND unless there is one already.  */
+static void
+reloc_slot_add (struct reloc_slots *rs, Elf_Word sym, Elf_Addr addend,
+		enum reloc_slot_kind kind)
+{
+  struct reloc_slot *slot;
+  grub_size_t h, i;
+
+  if (reloc_slot_find (rs, sym, addend, kind))
+    return;
+
+  if (rs->nslots == rs->slots_max)
+    {
+      rs->slots_max = rs->slots_max ? 2 * rs->slots_max : 64;
+      rs->slots = xrealloc (rs->slots, rs->slots_max * sizeof (rs->slots[0]));
+    }
+
+  slot = &rs->slots[rs->nslots++];
+  slot->sym = sym;
+  slot->addend = addend;
+  slot->kind = kind;
+  switch (kind)
+    {
+    case RELOC_SLOT_TRAMP_THM:
+      slot->offset = rs->tramp_size;
+      rs->tramp_size += 8;
+      break;
+    case RELOC_SLOT_TRAMP_ARM:
+      slot->offset = rs->tramp_size;
+      rs->tramp_size += 16;
+      break;
+    case RELOC_SLOT_GOT:
+      slot->offset = rs->got_size;
+      rs->got_size += 8;
+      break;
+    default:
+      break;
+    }
+
+  /* Keep the index at most half full.  */
+  if (2 * rs->nslots > rs->hash_size)
+    {
+      free (rs->hash);
+      rs->hash_size = rs->hash_size ? 2 * rs->hash_size : 128;
+      rs->hash = xcalloc (rs->hash_size, sizeof (rs->hash[0]));
+      for (i = 0; i < rs->nslots; i++)
+	{
+	  for (h = reloc_slot_hash (rs->slots[i].sym, rs->slots[i].addend,
+				    rs->slots[i].kind, rs->hash_size);
+	       rs->hash[h]; h = (h + 1) & (rs->hash_size - 1));
+	  rs->hash[h] = i + 1;
+	}
+    }
+  else
+    {
+      for (h = reloc_slot_hash (sym, addend, kind, rs->hash_size); rs->hash[h];
+	   h = (h + 1) & (rs->hash_size - 1));
+      rs->hash[h] = rs->nslots;
+    }
+}
+
+static void
+reloc_slots_free (struct reloc_slots *rs)
+{
+  free (rs->hash);
+  free (rs->slots);
+  free (rs);
+}
+
 static int
 is_relocatable (const struct grub_install_image_target_desc *image_target)
 {
@@ -81,16 +237,20 @@ is_relocatable (const struct grub_install_image_target_desc *image_target)
 
 #ifdef MKIMAGE_ELF32
 
+/* The ARM relocators below run in the relocation tasks, so they return
+   the error message, or NULL on success, rather than setting grub_errno.  */
+
 /*
  * R_ARM_THM_CALL/THM_JUMP24
  *
  * Relocate Thumb (T32) instruction set relative branches:
  *   B.W, BL and BLX
  */
-static grub_err_t
+static const char *
 grub_arm_reloc_thm_call (grub_uint16_t *target, Elf32_Addr sym_addr)
 {
   grub_int32_t offset;
+  int is_blx;
 
   offset = grub_arm_thm_call_get_offset (target);
 
@@ -105,13 +265,19 @@ grub_arm_reloc_thm_call (grub_uint16_t *target, Elf32_Addr sym_addr)
      is bigger than 2M  (currently under 150K) then we probably have a problem
      somewhere else.  */
   if (offset < -0x200000 || offset >= 0x200000)
-    return grub_error (GRUB_ERR_BAD_MODULE,
-		       "THM_CALL Relocation out of range.");
+    return "THM_CALL Relocation out of range.";
+
+  /* grub_arm_thm_call_set_offset would report this through grub_error.  */
+  is_blx = ((grub_le_to_cpu16 (target[1]) >> 12) & 0xd) == 0xc;
+  if (!is_blx && !(offset & 1))
+    return "bl/b.w targettting ARM";
 
   grub_dprintf ("dl", "    relative destination = %p",
 		(char *) target + offset);
 
-  return grub_arm_thm_call_set_offset (target, offset);
+  grub_arm_thm_call_set_offset (target, offset);
+
+  return NULL;
 }
 
 /*
@@ -119,14 +285,13 @@ grub_arm_reloc_thm_call (grub_uint16_t *target, Elf32_Addr sym_addr)
  *
  * Relocate conditional Thumb (T32) B<c>.W
  */
-static grub_err_t
+static const char *
 grub_arm_reloc_thm_jump19 (grub_uint16_t *target, Elf32_Addr sym_addr)
 {
   grub_int32_t offset;
 
   if (!(sym_addr & 1))
-    return grub_error (GRUB_ERR_BAD_MODULE,
-		       "Relocation targeting wrong execution state");
+    return "Relocation targeting wrong execution state";
 
   offset = grub_arm_thm_jump19_get_offset (target);
 
@@ -134,12 +299,11 @@ grub_arm_reloc_thm_jump19 (grub_uint16_t *target, Elf32_Addr sym_addr)
   offset += sym_addr;
 
   if (!grub_arm_thm_jump19_check_offset (offset))
-    return grub_error (GRUB_ERR_BAD_MODULE,
-		       "THM_JUMP19 Relocation out of range.");
+    return "THM_JUMP19 Relocation out of range.";
 
   grub_arm_thm_jump19_set_offset (target, offset);
 
-  return GRUB_ERR_NONE;
+  return NULL;
 }
 
 /*
@@ -147,26 +311,24 @@ grub_arm_reloc_thm_jump19 (grub_uint16_t *target, Elf32_Addr sym_addr)
  *
  * Relocate ARM (A32) B
  */
-static grub_err_t
+static const char *
 grub_arm_reloc_jump24 (grub_uint32_t *target, Elf32_Addr sym_addr)
 {
   grub_int32_t offset;
 
   if (sym_addr & 1)
-    return grub_error (GRUB_ERR_BAD_MODULE,
-		       "Relocation targeting wrong execution state");
+    return "Relocation targeting wrong execution state";
 
   offset = grub_arm_jump24_get_offset (target);
   offset += sym_addr;
 
   if (!grub_arm_jump24_check_offset (offset))
-    return grub_error (GRUB_ERR_BAD_MODULE,
-		       "JUMP24 Relocation out of range.");
+    return "JUMP24 Relocation out of range.";
 
 
   grub_arm_jump24_set_offset (target, offset);
 
-  return GRUB_ERR_NONE;
+  return NULL;
 }
 
 #endif
@@ -321,8 +483,14 @@ SUFFIX (grub_mkimage_generate_elf) (const struct grub_install_image_target_desc
   *core_size = program_size + header_size + footer_size;
 }
 
-/* Relocate symbols; note that this function overwrites the symbol table.
-   Return the address of a start symbol.  */
+/* The address of SYM once relocate_symbols has run.  It stores the
+   addresses of the symbols it relocates in host byte order, so they are
+   not converted again.  */
+#define RELOCATED_SYMBOL_ADDR(sym) ((Elf_Addr) (sym)->st_value)
+
+/* Relocate symbols; note that this function overwrites the symbol table
+   with addresses in host byte order.  Return the address of a start
+   symbol.  */
 static Elf_Addr
 SUFFIX (relocate_symbols) (Elf_Ehdr *e, struct section_metadata *smd,
 			   void *jumpers, Elf_Addr jumpers_addr,
@@ -413,7 +581,7 @@ SUFFIX (get_symbol_address) (Elf_Ehdr *e, Elf_Shdr *s, Elf_Word i,
   sym = (Elf_Sym *) ((char *) e
 		       + grub_target_to_host (s->sh_offset)
 		       + i * grub_target_to_host (s->sh_entsize));
-  return sym->st_value;
+  return RELOCATED_SYMBOL_ADDR (sym);
 }
 
 /* Return the address of a modified value.  */
@@ -453,36 +621,75 @@ SUFFIX (count_funcs) (Elf_Ehdr *e, Elf_Shdr *symtab_section,
 #endif
 
 #ifdef MKIMAGE_ELF32
-/* Deal with relocation information. This function relocates addresses
-   within the virtual address space starting from 0. So only relative
-   addresses can be fully resolved. Absolute addresses must be relocated
-   again by a PE32 relocator when loaded.  */
-static grub_size_t
-arm_get_trampoline_size (Elf_Ehdr *e,
-			 Elf_Shdr *sections,
-			 Elf_Half section_entsize,
-			 Elf_Half num_sections,
-			 const struct grub_install_image_target_desc *image_target)
+/* Return the kind of trampoline an ARM branch relocation of type INFO to
+   SYM_ADDR goes through, if any.  */
+static enum reloc_slot_kind
+arm_get_tramp_kind (Elf_Addr info, Elf_Sym *sym, Elf_Addr sym_addr)
+{
+  switch (ELF_R_TYPE (info))
+    {
+    case R_ARM_THM_CALL:
+    case R_ARM_THM_JUMP24:
+    case R_ARM_THM_JUMP19:
+      if (ELF_ST_TYPE (sym->st_info) != STT_FUNC)
+	sym_addr |= 1;
+      if (!(sym_addr & 1))
+	return RELOC_SLOT_TRAMP_THM;
+      break;
+
+    case R_ARM_CALL:
+    case R_ARM_JUMP24:
+      if (sym_addr & 1)
+	return RELOC_SLOT_TRAMP_ARM;
+      break;
+    }
+
+  return RELOC_SLOT_NONE;
+}
+#endif
+
+static int
+SUFFIX (is_kept_section) (Elf_Shdr *s, const struct grub_install_image_target_desc *image_target);
+static int
+SUFFIX (is_kept_reloc_section) (Elf_Shdr *s, const struct grub_install_image_target_desc *image_target,
+				struct section_metadata *smd);
+
+/* Allocate the ARM trampolines and the arm64 GOT entries needed by the
+   kept relocation sections, one per distinct symbol and addend.  */
+static void
+SUFFIX (allocate_reloc_slots) (Elf_Ehdr *e, struct section_metadata *smd,
+			       const struct grub_install_image_target_desc *image_target)
 {
   Elf_Half i;
   Elf_Shdr *s;
-  grub_size_t ret = 0;
 
-  for (i = 0, s = sections;
-       i < num_sections;
-       i++, s = (Elf_Shdr *) ((char *) s + section_entsize))
+  if (image_target->elf_target != EM_ARM
+      && image_target->elf_target != EM_AARCH64)
+    return;
+
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
     if ((s->sh_type == grub_host_to_target32 (SHT_REL)) ||
         (s->sh_type == grub_host_to_target32 (SHT_RELA)))
       {
 	Elf_Rela *r;
 	Elf_Word rtab_size, r_size, num_rs;
 	Elf_Off rtab_offset;
-	Elf_Shdr *symtab_section;
 	Elf_Word j;
+#ifdef MKIMAGE_ELF32
+	Elf_Shdr *symtab_section;
+#endif
 
-	symtab_section = (Elf_Shdr *) ((char *) sections
-					 + (grub_target_to_host32 (s->sh_link)
-					    * section_entsize));
+	if (!SUFFIX (is_kept_section) (s, image_target) &&
+	    !SUFFIX (is_kept_reloc_section) (s, image_target, smd))
+	  continue;
+
+#ifdef MKIMAGE_ELF32
+	symtab_section = (Elf_Shdr *) ((char *) smd->sections
+				       + (grub_target_to_host32 (s->sh_link)
+					  * smd->section_entsize));
+#endif
 
 	rtab_size = grub_target_to_host (s->sh_size);
 	r_size = grub_target_to_host (s->sh_entsize);
@@ -493,75 +700,138 @@ arm_get_trampoline_size (Elf_Ehdr *e,
 	     j < num_rs;
 	     j++, r = (Elf_Rela *) ((char *) r + r_size))
 	  {
-            Elf_Addr info;
-	    Elf_Addr sym_addr;
+	    Elf_Addr info;
+	    Elf_Addr addend;
 
 	    info = grub_target_to_host (r->r_info);
-	    sym_addr = SUFFIX (get_symbol_address) (e, symtab_section,
-						    ELF_R_SYM (info), image_target);
-
-            sym_addr += (s->sh_type == grub_target_to_host32 (SHT_RELA)) ?
+	    addend = (s->sh_type == grub_target_to_host32 (SHT_RELA)) ?
 	      grub_target_to_host (r->r_addend) : 0;
 
-	    switch (ELF_R_TYPE (info))
-	      {
-	      case R_ARM_ABS32:
-	      case R_ARM_V4BX:
-		break;
-	      case R_ARM_THM_CALL:
-	      case R_ARM_THM_JUMP24:
-	      case R_ARM_THM_JUMP19:
-		if (!(sym_addr & 1))
-		  ret += 8;
-		break;
-
-	      case R_ARM_CALL:
-	      case R_ARM_JUMP24:
-		if (sym_addr & 1)
-		  ret += 16;
-		break;
-
-	      default:
-		grub_util_error (_("relocation 0x%x is not implemented yet"),
-				 (unsigned int) ELF_R_TYPE (info));
-		break;
-	      }
+#ifdef MKIMAGE_ELF64
+	    if (ELF_R_TYPE (info) == R_AARCH64_ADR_GOT_PAGE)
+	      reloc_slot_add (smd->slots, ELF_R_SYM (info), addend,
+			      RELOC_SLOT_GOT);
+#else
+	    {
+	      enum reloc_slot_kind kind;
+	      Elf_Sym *sym;
+
+	      sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (symtab_section->sh_offset)
+				 + ELF_R_SYM (info) * grub_target_to_host (symtab_section->sh_entsize));
+	      kind = arm_get_tramp_kind (info, sym,
+					 grub_target_to_host (sym->st_value)
+					 + addend);
+	      if (kind != RELOC_SLOT_NONE)
+		reloc_slot_add (smd->slots, ELF_R_SYM (info), addend, kind);
+	    }
+#endif
 	  }
       }
-  return ret;
 }
+
+/* Write out the trampolines and GOT entries.  This must be called after
+   the symbols have been relocated.  */
+static void
+SUFFIX (fill_reloc_slots) (Elf_Ehdr *e, struct section_metadata *smd,
+			   char *pe_target,
+			   Elf_Addr tramp_off __attribute__ ((unused)),
+			   Elf_Addr got_off __attribute__ ((unused)),
+			   const struct grub_install_image_target_desc *image_target)
+{
+  grub_size_t i;
+
+  for (i = 0; i < smd->slots->nslots; i++)
+    {
+      struct reloc_slot *slot = &smd->slots->slots[i];
+      Elf_Addr sym_addr;
+
+      sym_addr = SUFFIX (get_symbol_address) (e, smd->symtab, slot->sym,
+					      image_target) + slot->addend;
+
+      switch (slot->kind)
+	{
+#ifdef MKIMAGE_ELF64
+	case RELOC_SLOT_GOT:
+	  {
+	    grub_uint64_t *gpptr = (void *) (pe_target + got_off + slot->offset);
+
+	    *gpptr = grub_host_to_target64 (sym_addr);
+	  }
+	  break;
+#else
+	case RELOC_SLOT_TRAMP_THM:
+	  {
+	    grub_uint32_t *tr = (void *) (pe_target + tramp_off + slot->offset);
+	    grub_int32_t new_offset;
+
+	    sym_addr -= image_target->vaddr_offset;
+	    new_offset = sym_addr - (tramp_off + slot->offset) - 12;
+
+	    if (!grub_arm_jump24_check_offset (new_offset))
+	      grub_util_error ("jump24 relocation out of range");
+
+	    tr[0] = grub_host_to_target32 (0x46c04778); /* bx pc; nop  */
+	    tr[1] = grub_host_to_target32 (((new_offset >> 2) & 0xffffff) | 0xea000000); /* b new_offset */
+	  }
+	  break;
+	case RELOC_SLOT_TRAMP_ARM:
+	  {
+	    grub_uint32_t *tr = (void *) (pe_target + tramp_off + slot->offset);
+	    grub_int32_t new_offset;
+
+	    sym_addr -= image_target->vaddr_offset;
+	    new_offset = sym_addr - (tramp_off + slot->offset) - 12;
+
+	    /* There is no immediate version of bx, only register one...  */
+	    tr[0] = grub_host_to_target32 (0xe59fc004); /* ldr	ip, [pc, #4] */
+	    tr[1] = grub_host_to_target32 (0xe08cc00f); /* add	ip, ip, pc */
+	    tr[2] = grub_host_to_target32 (0xe12fff1c); /* bx	ip */
+	    tr[3] = grub_host_to_target32 (new_offset | 1);
+	  }
+	  break;
 #endif
+	default:
+	  break;
+	}
+    }
+}
 
-static int
-SUFFIX (is_kept_section) (Elf_Shdr *s, const struct grub_install_image_target_desc *image_target);
-static int
-SUFFIX (is_kept_reloc_section) (Elf_Shdr *s, const struct grub_install_image_target_desc *image_target,
-				struct section_metadata *smd);
+struct relocate_context
+{
+  Elf_Ehdr *e;
+  struct section_metadata *smd;
+  /* For each relocation section, the number of the task handling it
+     plus one, or 0 if it is omitted.  */
+  grub_size_t *task_of;
+  Elf_Addr tramp_off;
+  Elf_Addr got_off;
+  const struct grub_install_image_target_desc *image_target;
+};
 
 /* Deal with relocation information. This function relocates addresses
    within the virtual address space starting from 0. So only relative
    addresses can be fully resolved. Absolute addresses must be relocated
-   again by a PE32 relocator when loaded.  */
+   again by a PE32 relocator when loaded.  Task N handles the relocation
+   sections whose TASK_OF entry is N + 1.  */
 static void
-SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
-			     char *pe_target, Elf_Addr tramp_off, Elf_Addr got_off,
-			     const struct grub_install_image_target_desc *image_target)
+SUFFIX (relocate_addrs_task) (void *data, grub_size_t n)
 {
+  struct relocate_context *ctx = data;
+  Elf_Ehdr *e = ctx->e;
+  struct section_metadata *smd = ctx->smd;
+  const struct grub_install_image_target_desc *image_target = ctx->image_target;
   Elf_Half i;
   Elf_Shdr *s;
 #ifdef MKIMAGE_ELF64
-  grub_uint64_t *gpptr = (void *) (pe_target + got_off);
   unsigned unmatched_adr_got_page = 0;
 #define MASK19 ((1 << 19) - 1)
-#else
-  grub_uint32_t *tr = (void *) (pe_target + tramp_off);
 #endif
 
   for (i = 0, s = smd->sections;
        i < smd->num_sections;
        i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
-    if ((s->sh_type == grub_host_to_target32 (SHT_REL)) ||
-        (s->sh_type == grub_host_to_target32 (SHT_RELA)))
+    if (ctx->task_of[i] == n + 1)
       {
 	Elf_Rela *r;
 	Elf_Word rtab_size, r_size, num_rs;
@@ -571,14 +841,6 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 	Elf_Shdr *target_section;
 	Elf_Word j;
 
-	if (!SUFFIX (is_kept_section) (s, image_target) &&
-	    !SUFFIX (is_kept_reloc_section) (s, image_target, smd))
-	  {
-	    grub_util_info ("not translating relocations for omitted section %s",
-			smd->strtab + grub_le_to_cpu32 (s->sh_name));
-	    continue;
-	  }
-
 	target_section_index = grub_target_to_host32 (s->sh_info);
 	target_section_addr = smd->addrs[target_section_index];
 	target_section = (Elf_Shdr *) ((char *) smd->sections
@@ -614,6 +876,8 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
             addend = (s->sh_type == grub_target_to_host32 (SHT_RELA)) ?
 	      grub_target_to_host (r->r_addend) : 0;
 
+	    count_reloc (&smd->reloc_stats[target_section_index], ELF_R_TYPE (info));
+
 	   switch (image_target->elf_target)
 	     {
 	     case EM_386:
@@ -760,16 +1024,24 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 		   case R_AARCH64_ADR_GOT_PAGE:
 		     {
 		       Elf64_Rela *rel2;
-		       grub_int64_t gpoffset = (((char *) gpptr - (char *) pe_target + image_target->vaddr_offset) & ~0xfffULL)
-			 - ((offset + target_section_addr + image_target->vaddr_offset) & ~0xfffULL);
+		       struct reloc_slot *slot;
+		       Elf_Addr gp_addr;
+		       grub_int64_t gpoffset;
 		       unsigned k;
-		       *gpptr = grub_host_to_target64 (sym_addr);
+
+		       slot = reloc_slot_find (smd->slots, ELF_R_SYM (info), addend,
+					       RELOC_SLOT_GOT);
+		       if (!slot)
+			 grub_util_error ("ADR_GOT_PAGE without a GOT entry");
+		       gp_addr = ctx->got_off + slot->offset + image_target->vaddr_offset;
+		       gpoffset = (gp_addr & ~0xfffULL)
+			 - ((offset + target_section_addr + image_target->vaddr_offset) & ~0xfffULL);
 		       unmatched_adr_got_page++;
 		       if (!grub_arm64_check_hi21_signed (gpoffset))
 			 grub_util_error ("HI21 out of range");
 		       grub_arm64_set_hi21((grub_uint32_t *)target,
 					   gpoffset);
-		       for (k = 0, rel2 = (Elf_Rela *) ((char *) r + r_size);
+		       for (k = j + 1, rel2 = (Elf_Rela *) ((char *) r + r_size);
 			    k < num_rs;
 			    k++, rel2 = (Elf_Rela *) ((char *) rel2 + r_size))
 			 if (ELF_R_SYM (rel2->r_info)
@@ -779,12 +1051,11 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 			   {
 			     grub_arm64_set_abs_lo12_ldst64 ((grub_uint32_t *) SUFFIX (get_target_address) (e, target_section,
 													    grub_target_to_host (rel2->r_offset), image_target),
-							     ((char *) gpptr - (char *) pe_target + image_target->vaddr_offset));
+							     gp_addr);
 			     break;
 			   }
 		       if (k >= num_rs)
 			 grub_util_error ("ADR_GOT_PAGE without matching LD64_GOT_LO12_NC");
-		       gpptr++;
 	             }
 		     break;
 		   case R_AARCH64_LD64_GOT_LO12_NC:
@@ -837,7 +1108,7 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 		   case R_ARM_THM_JUMP24:
 		   case R_ARM_THM_JUMP19:
 		     {
-		       grub_err_t err;
+		       const char *err;
 		       Elf_Sym *sym;
 		       grub_util_info ("  THM_JUMP24:\ttarget=0x%08lx\toffset=(0x%08x)",
 				       (unsigned long) ((char *) target
@@ -846,24 +1117,18 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 		       sym = (Elf_Sym *) ((char *) e
 					  + grub_target_to_host (smd->symtab->sh_offset)
 					  + ELF_R_SYM (info) * grub_target_to_host (smd->symtab->sh_entsize));
-		       if (ELF_ST_TYPE (sym->st_info) != STT_FUNC)
-			 sym_addr |= 1;
-		       if (!(sym_addr & 1))
+		       if (arm_get_tramp_kind (info, sym, sym_addr) == RELOC_SLOT_TRAMP_THM)
 			 {
-			   grub_uint32_t tr_addr;
-			   grub_int32_t new_offset;
-			   tr_addr = (char *) tr - (char *) pe_target
-			     - target_section_addr;
-			   new_offset = sym_addr - tr_addr - 12;
-
-			   if (!grub_arm_jump24_check_offset (new_offset))
-			     return grub_util_error ("jump24 relocation out of range");
-
-			   tr[0] = grub_host_to_target32 (0x46c04778); /* bx pc; nop  */
-			   tr[1] = grub_host_to_target32 (((new_offset >> 2) & 0xffffff) | 0xea000000); /* b new_offset */
-			   tr += 2;
-			   sym_addr = tr_addr | 1;
+			   struct reloc_slot *slot;
+
+			   slot = reloc_slot_find (smd->slots, ELF_R_SYM (info), addend,
+						   RELOC_SLOT_TRAMP_THM);
+			   if (!slot)
+			     grub_util_error ("THM_CALL without a trampoline");
+			   sym_addr = (ctx->tramp_off + slot->offset - target_section_addr) | 1;
 			 }
+		       else if (ELF_ST_TYPE (sym->st_info) != STT_FUNC)
+			 sym_addr |= 1;
 		       sym_addr -= offset;
 		       /* Thumb instructions can be 16-bit aligned */
 		       if (ELF_R_TYPE (info) == R_ARM_THM_JUMP19)
@@ -872,36 +1137,30 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
 			 err = grub_arm_reloc_thm_call ((grub_uint16_t *) target,
 							sym_addr);
 		       if (err)
-			 grub_util_error ("%s", grub_errmsg);
+			 grub_util_error ("%s", err);
 		     }
 		     break;
 
 		   case R_ARM_CALL:
 		   case R_ARM_JUMP24:
 		     {
-		       grub_err_t err;
+		       const char *err;
 		       grub_util_info ("  JUMP24:\ttarget=0x%08lx\toffset=(0x%08x)",  (unsigned long) ((char *) target - (char *) e), sym_addr);
 		       if (sym_addr & 1)
 			 {
-			   grub_uint32_t tr_addr;
-			   grub_int32_t new_offset;
-			   tr_addr = (char *) tr - (char *) pe_target
-			     - target_section_addr;
-			   new_offset = sym_addr - tr_addr - 12;
-
-			   /* There is no immediate version of bx, only register one...  */
-			   tr[0] = grub_host_to_target32 (0xe59fc004); /* ldr	ip, [pc, #4] */
-			   tr[1] = grub_host_to_target32 (0xe08cc00f); /* add	ip, ip, pc */
-			   tr[2] = grub_host_to_target32 (0xe12fff1c); /* bx	ip */
-			   tr[3] = grub_host_to_target32 (new_offset | 1);
-			   tr += 4;
-			   sym_addr = tr_addr;
+			   struct reloc_slot *slot;
+
+			   slot = reloc_slot_find (smd->slots, ELF_R_SYM (info), addend,
+						   RELOC_SLOT_TRAMP_ARM);
+			   if (!slot)
+			     grub_util_error ("JUMP24 without a trampoline");
+			   sym_addr = ctx->tramp_off + slot->offset - target_section_addr;
 			 }
 		       sym_addr -= offset;
 		       err = grub_arm_reloc_jump24 (target,
 						    sym_addr);
 		       if (err)
-			 grub_util_error ("%s", grub_errmsg);
+			 grub_util_error ("%s", err);
 		     }
 		     break;
 
@@ -1111,99 +1370,62 @@ SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
       }
 }
 
-/* Add a PE32's fixup entry for a relocation. Return the resulting address
-   after having written to the file OUT.  */
-static Elf_Addr
-add_fixup_entry (struct fixup_block_list **cblock, grub_uint16_t type,
-		 Elf_Addr addr, int flush, Elf_Addr current_address,
-		 const struct grub_install_image_target_desc *image_target)
+/* Resolve all relocations.  Relocation sections for different target
+   sections write to disjoint parts of the image, so each group runs as
+   a separate task.  Trampolines and GOT entries are shared, so they are
+   written beforehand and only looked up by the tasks.  */
+static void
+SUFFIX (relocate_addrs) (Elf_Ehdr *e, struct section_metadata *smd,
+			     char *pe_target, Elf_Addr tramp_off, Elf_Addr got_off,
+			     const struct grub_install_image_target_desc *image_target)
 {
-  struct grub_pe32_fixup_block *b;
-
-  b = &((*cblock)->b);
-
-  /* First, check if it is necessary to write out the current block.  */
-  if ((*cblock)->state)
-    {
-      if (flush || addr < b->page_rva || b->page_rva + 0x1000 <= addr)
-	{
-	  grub_uint32_t size;
+  struct relocate_context ctx;
+  grub_size_t *target_task;
+  grub_size_t ntasks = 0;
+  Elf_Half i;
+  Elf_Shdr *s;
 
-	  if (flush)
-	    {
-	      /* Add as much padding as necessary to align the address
-		 with a section boundary.  */
-	      Elf_Addr next_address;
-	      unsigned padding_size;
-              size_t cur_index;
-
-	      next_address = current_address + b->block_size;
-	      padding_size = ((ALIGN_UP (next_address, image_target->section_align)
-			       - next_address)
-			      >> 1);
-              cur_index = ((b->block_size - sizeof (*b)) >> 1);
-              grub_util_info ("adding %d padding fixup entries", padding_size);
-	      while (padding_size--)
-		{
-		  b->entries[cur_index++] = 0;
-		  b->block_size += 2;
-		}
-	    }
-          else while (b->block_size & (8 - 1))
-            {
-	      /* If not aligned with a 32-bit boundary, add
-		 a padding entry.  */
-              size_t cur_index;
-
-              grub_util_info ("adding a padding fixup entry");
-              cur_index = ((b->block_size - sizeof (*b)) >> 1);
-              b->entries[cur_index] = 0;
-              b->block_size += 2;
-            }
-
-          /* Flush it.  */
-          grub_util_info ("writing %d bytes of a fixup block starting at 0x%x",
-                          b->block_size, b->page_rva);
-          size = b->block_size;
-	  current_address += size;
-	  b->page_rva = grub_host_to_target32 (b->page_rva);
-	  b->block_size = grub_host_to_target32 (b->block_size);
-	  (*cblock)->next = xmalloc (sizeof (**cblock) + 2 * 0x1000);
-	  memset ((*cblock)->next, 0, sizeof (**cblock) + 2 * 0x1000);
-	  *cblock = (*cblock)->next;
-	}
-    }
+  ctx.e = e;
+  ctx.smd = smd;
+  ctx.image_target = image_target;
+  ctx.tramp_off = tramp_off;
+  ctx.got_off = got_off;
+  ctx.task_of = xcalloc (smd->num_sections, sizeof (ctx.task_of[0]));
+  /* Task number plus one for each modified section, 0 meaning none yet.  */
+  target_task = xcalloc (smd->num_sections, sizeof (target_task[0]));
 
-  b = &((*cblock)->b);
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if ((s->sh_type == grub_host_to_target32 (SHT_REL)) ||
+        (s->sh_type == grub_host_to_target32 (SHT_RELA)))
+      {
+	Elf_Word target_section_index;
 
-  if (! flush)
-    {
-      grub_uint16_t entry;
-      size_t cur_index;
+	if (!SUFFIX (is_kept_section) (s, image_target) &&
+	    !SUFFIX (is_kept_reloc_section) (s, image_target, smd))
+	  {
+	    grub_util_info ("not translating relocations for omitted section %s",
+			smd->strtab + grub_le_to_cpu32 (s->sh_name));
+	    continue;
+	  }
 
-      /* If not allocated yet, allocate a block with enough entries.  */
-      if (! (*cblock)->state)
-	{
-	  (*cblock)->state = 1;
+	target_section_index = grub_target_to_host32 (s->sh_info);
+	if (target_section_index >= smd->num_sections)
+	  grub_util_error ("section %d does not exist", target_section_index);
 
-	  /* The spec does not mention the requirement of a Page RVA.
-	     Here, align the address with a 4K boundary for safety.  */
-	  b->page_rva = (addr & ~(0x1000 - 1));
-	  b->block_size = sizeof (*b);
-	}
+	if (!target_task[target_section_index])
+	  target_task[target_section_index] = ++ntasks;
+	ctx.task_of[i] = target_task[target_section_index];
+      }
 
-      /* Sanity check.  */
-      if (b->block_size >= sizeof (*b) + 2 * 0x1000)
-	grub_util_error ("too many fixup entries");
+  SUFFIX (fill_reloc_slots) (e, smd, pe_target, tramp_off, got_off,
+			     image_target);
 
-      /* Add a new entry.  */
-      cur_index = ((b->block_size - sizeof (*b)) >> 1);
-      entry = GRUB_PE32_FIXUP_ENTRY (type, addr - b->page_rva);
-      b->entries[cur_index] = grub_host_to_target16 (entry);
-      b->block_size += 2;
-    }
+  grub_util_run_tasks (ntasks, SUFFIX (relocate_addrs_task), &ctx);
 
-  return current_address;
+  free (target_task);
+  free (ctx.task_of);
 }
 
 struct raw_reloc
@@ -1220,24 +1442,80 @@ struct raw_reloc
 struct translate_context
 {
   /* PE */
-  struct fixup_block_list *lst, *lst0;
-  Elf_Addr current_address;
+  struct grub_mkimage_fixup *fixups;
+  size_t nfixups, fixups_max;
 
   /* Raw */
   struct raw_reloc *raw_relocs;
 };
 
+/* Record a PE32's fixup entry for a relocation. Entries are collected
+   in any order and turned into fixup blocks at the end.  */
 static void
-translate_reloc_start (struct translate_context *ctx,
-		       const struct grub_install_image_target_desc *image_target)
+add_fixup_entry (struct translate_context *ctx, grub_uint16_t type,
+		 Elf_Addr addr)
 {
-  grub_memset (ctx, 0, sizeof (*ctx));
-  if (image_target->id == IMAGE_EFI)
+  if (ctx->nfixups == ctx->fixups_max)
+    {
+      ctx->fixups_max = ctx->fixups_max ? 2 * ctx->fixups_max : 1024;
+      ctx->fixups = xrealloc (ctx->fixups,
+			      ctx->fixups_max * sizeof (ctx->fixups[0]));
+    }
+  ctx->fixups[ctx->nfixups].addr = addr;
+  ctx->fixups[ctx->nfixups].type = type;
+  ctx->nfixups++;
+}
+
+/* Sort fixup entries by address.  This is a stable LSD radix sort, so
+   entries for the same address keep their relative order.  */
+static void
+sort_fixup_entries (struct grub_mkimage_fixup *fixups, size_t n)
+{
+  struct grub_mkimage_fixup *tmp, *src = fixups, *dst;
+  unsigned shift;
+  size_t i;
+
+  if (n < 2)
+    return;
+
+  tmp = xmalloc (n * sizeof (*tmp));
+  dst = tmp;
+
+  for (shift = 0; shift < 32; shift += 8)
     {
-      ctx->lst = ctx->lst0 = xmalloc (sizeof (*ctx->lst) + 2 * 0x1000);
-      memset (ctx->lst, 0, sizeof (*ctx->lst) + 2 * 0x1000);
-      ctx->current_address = 0;
+      size_t count[256], pos;
+      unsigned k;
+
+      memset (count, 0, sizeof (count));
+      for (i = 0; i < n; i++)
+	count[(src[i].addr >> shift) & 0xff]++;
+
+      /* All keys share this byte, nothing to do.  */
+      if (count[(src[0].addr >> shift) & 0xff] == n)
+	continue;
+
+      for (k = 0, pos = 0; k < 256; k++)
+	{
+	  size_t c = count[k];
+	  count[k] = pos;
+	  pos += c;
+	}
+      for (i = 0; i < n; i++)
+	dst[count[(src[i].addr >> shift) & 0xff]++] = src[i];
+
+      dst = src;
+      src = (src == fixups) ? tmp : fixups;
     }
+
+  if (src != fixups)
+    memcpy (fixups, src, n * sizeof (*fixups));
+  free (tmp);
+}
+
+static void
+translate_reloc_start (struct translate_context *ctx)
+{
+  grub_memset (ctx, 0, sizeof (*ctx));
 }
 
 static void
@@ -1255,11 +1533,7 @@ translate_relocation_pe (struct translate_context *ctx,
 	  grub_util_info ("adding a relocation entry for 0x%"
 			  GRUB_HOST_PRIxLONG_LONG,
 			  (unsigned long long) addr);
-	  ctx->current_address
-	    = add_fixup_entry (&ctx->lst,
-			       GRUB_PE32_REL_BASED_HIGHLOW,
-			       addr, 0, ctx->current_address,
-			       image_target);
+	  add_fixup_entry (ctx, GRUB_PE32_REL_BASED_HIGHLOW, addr);
 	}
       break;
     case EM_X86_64:
@@ -1273,12 +1547,7 @@ translate_relocation_pe (struct translate_context *ctx,
 	  grub_util_info ("adding a relocation entry for 0x%"
 			  GRUB_HOST_PRIxLONG_LONG,
 			  (unsigned long long) addr);
-	  ctx->current_address
-	    = add_fixup_entry (&ctx->lst,
-			       GRUB_PE32_REL_BASED_DIR64,
-			       addr,
-			       0, ctx->current_address,
-			       image_target);
+	  add_fixup_entry (ctx, GRUB_PE32_REL_BASED_DIR64, addr);
 	}
       break;
     case EM_IA_64:
@@ -1302,12 +1571,7 @@ translate_relocation_pe (struct translate_context *ctx,
 	    grub_util_info ("adding a relocation entry for 0x%"
 			    GRUB_HOST_PRIxLONG_LONG,
 			    (unsigned long long) addr);
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_DIR64,
-				 addr,
-				 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_DIR64, addr);
 	  }
 #endif
 	  break;
@@ -1322,11 +1586,7 @@ translate_relocation_pe (struct translate_context *ctx,
 	{
 	case R_AARCH64_ABS64:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_DIR64,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_DIR64, addr);
 	  }
 	  break;
 	  /* Relative relocations do not require fixup entries. */
@@ -1367,17 +1627,13 @@ translate_relocation_pe (struct translate_context *ctx,
 	case R_ARM_THM_JUMP24:
 	case R_ARM_CALL:
 	  {
-	    grub_util_info ("  %s:  not adding fixup: 0x%08x : 0x%08x", __FUNCTION__, (unsigned int) addr, (unsigned int) ctx->current_address);
+	    grub_util_info ("  %s:  not adding fixup: 0x%08x : 0x%08x", __FUNCTION__, (unsigned int) addr, (unsigned int) ctx->nfixups);
 	  }
 	  break;
 	  /* Create fixup entry for PE/COFF loader */
 	case R_ARM_ABS32:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_HIGHLOW,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_HIGHLOW, addr);
 	  }
 	  break;
 	default:
@@ -1392,20 +1648,12 @@ translate_relocation_pe (struct translate_context *ctx,
 	{
 	case R_RISCV_32:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_HIGHLOW,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_HIGHLOW, addr);
 	  }
 	  break;
 	case R_RISCV_64:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_DIR64,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_DIR64, addr);
 	  }
 	  break;
 	  /* Relative relocations do not require fixup entries. */
@@ -1419,33 +1667,21 @@ translate_relocation_pe (struct translate_context *ctx,
 	case R_RISCV_RVC_JUMP:
 	case R_RISCV_ADD32:
 	case R_RISCV_SUB32:
-	  grub_util_info ("  %s:  not adding fixup: 0x%08x : 0x%08x", __FUNCTION__, (unsigned int) addr, (unsigned int) ctx->current_address);
+	  grub_util_info ("  %s:  not adding fixup: 0x%08x : 0x%08x", __FUNCTION__, (unsigned int) addr, (unsigned int) ctx->nfixups);
 	  break;
 	case R_RISCV_HI20:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_RISCV_HI20,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_RISCV_HI20, addr);
 	  }
 	  break;
 	case R_RISCV_LO12_I:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_RISCV_LOW12I,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_RISCV_LOW12I, addr);
 	  }
 	  break;
 	case R_RISCV_LO12_S:
 	  {
-	    ctx->current_address
-	      = add_fixup_entry (&ctx->lst,
-				 GRUB_PE32_REL_BASED_RISCV_LOW12S,
-				 addr, 0, ctx->current_address,
-				 image_target);
+	    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_RISCV_LOW12S, addr);
 	  }
 	  break;
 	case R_RISCV_RELAX:
@@ -1524,29 +1760,68 @@ static void
 finish_reloc_translation_pe (struct translate_context *ctx, struct grub_mkimage_layout *layout,
 			     const struct grub_install_image_target_desc *image_target)
 {
-  ctx->current_address = add_fixup_entry (&ctx->lst, 0, 0, 1, ctx->current_address, image_target);
+  struct grub_pe32_fixup_block *b;
+  grub_uint8_t *ptr;
+  size_t i, j, size = 0, nblocks = 0;
 
-  {
-    grub_uint8_t *ptr;
-    layout->reloc_section = ptr = xmalloc (ctx->current_address);
-    for (ctx->lst = ctx->lst0; ctx->lst; ctx->lst = ctx->lst->next)
-      if (ctx->lst->state)
-	{
-	  memcpy (ptr, &ctx->lst->b, grub_target_to_host32 (ctx->lst->b.block_size));
-	  ptr += grub_target_to_host32 (ctx->lst->b.block_size);
-	}
-    assert ((ctx->current_address + (grub_uint8_t *) layout->reloc_section) == ptr);
-  }
+  sort_fixup_entries (ctx->fixups, ctx->nfixups);
+
+  /* Size every block, each one covering a single 4K page.  */
+  for (i = 0; i < ctx->nfixups; i = j)
+    {
+      grub_uint32_t page_rva = ctx->fixups[i].addr & ~(0x1000 - 1);
+
+      for (j = i; j < ctx->nfixups
+	     && (ctx->fixups[j].addr & ~(0x1000 - 1)) == page_rva; j++);
 
-  for (ctx->lst = ctx->lst0; ctx->lst; )
+      size += sizeof (*b) + 2 * (j - i);
+      nblocks++;
+      /* If not aligned with a 32-bit boundary, add padding entries;
+	 the last block is padded up to a section boundary instead.  */
+      if (j < ctx->nfixups)
+	size = ALIGN_UP (size, 8);
+    }
+  if (size)
+    size = ALIGN_UP (size, image_target->section_align);
+
+  layout->reloc_section = ptr = xcalloc (1, size ? : 1);
+
+  for (i = 0; i < ctx->nfixups; i = j)
     {
-      struct fixup_block_list *next;
-      next = ctx->lst->next;
-      free (ctx->lst);
-      ctx->lst = next;
+      grub_uint32_t page_rva = ctx->fixups[i].addr & ~(0x1000 - 1);
+      grub_uint32_t block_size;
+
+      b = (struct grub_pe32_fixup_block *) ptr;
+      for (j = i; j < ctx->nfixups
+	     && (ctx->fixups[j].addr & ~(0x1000 - 1)) == page_rva; j++)
+	b->entries[j - i]
+	  = grub_host_to_target16 (GRUB_PE32_FIXUP_ENTRY (ctx->fixups[j].type,
+							  ctx->fixups[j].addr
+							  - page_rva));
+
+      block_size = sizeof (*b) + 2 * (j - i);
+      if (j < ctx->nfixups)
+	block_size = ALIGN_UP (block_size, 8);
+      else
+	block_size = size - (ptr - (grub_uint8_t *) layout->reloc_section);
+
+      grub_util_info ("writing %d bytes of a fixup block starting at 0x%x",
+		      block_size, page_rva);
+      b->page_rva = grub_host_to_target32 (page_rva);
+      b->block_size = grub_host_to_target32 (block_size);
+      ptr += block_size;
     }
+  assert ((size + (grub_uint8_t *) layout->reloc_section) == ptr);
+
+  layout->stats.nfixups = ctx->nfixups;
+  layout->stats.reloc_padding = size - nblocks * sizeof (*b) - 2 * ctx->nfixups;
 
-  layout->reloc_size = ctx->current_address;
+  /* Kept for pre-linking, which adds the fixups of the modules.  */
+  layout->fixups = ctx->fixups;
+  layout->nfixups = ctx->nfixups;
+  ctx->fixups = NULL;
+
+  layout->reloc_size = size;
   if (image_target->elf_target == EM_ARM && layout->reloc_size > GRUB_KERNEL_ARM_STACK_SIZE)
     grub_util_error ("Reloc section (%d) is bigger than stack size (%d). "
 		     "This breaks assembly assumptions. Please increase stack size",
@@ -1611,6 +1886,7 @@ finish_reloc_translation_raw (struct translate_context *ctx, struct grub_mkimage
     }
   *--p = RAW_END_MARKER;
   layout->reloc_size = sz;
+  layout->stats.nfixups = count;
 }
 
 static void
@@ -1632,11 +1908,7 @@ create_u64_fixups (struct translate_context *ctx,
   unsigned i;
   assert (image_target->id == IMAGE_EFI);
   for (i = 0; i < njumpers; i++)
-    ctx->current_address = add_fixup_entry (&ctx->lst,
-					    GRUB_PE32_REL_BASED_DIR64,
-					    jumpers + 8 * i,
-					    0, ctx->current_address,
-					    image_target);
+    add_fixup_entry (ctx, GRUB_PE32_REL_BASED_DIR64, jumpers + 8 * i);
 }
 
 /* Make a .reloc section.  */
@@ -1649,7 +1921,7 @@ make_reloc_section (Elf_Ehdr *e, struct grub_mkimage_layout *layout,
   Elf_Shdr *s;
   struct translate_context ctx;
 
-  translate_reloc_start (&ctx, image_target);
+  translate_reloc_start (&ctx);
 
   for (i = 0, s = smd->sections; i < smd->num_sections;
        i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
@@ -1766,32 +2038,973 @@ SUFFIX (is_kept_section) (Elf_Shdr *s, const struct grub_install_image_target_de
   return 0;
 }
 
+/* Determine if the relocations in S apply to a section we keep.  The
+   section is looked up through sh_info rather than by name, since section
+   names need not be unique.  */
 static int
 SUFFIX (is_kept_reloc_section) (Elf_Shdr *s, const struct grub_install_image_target_desc *image_target,
 				struct section_metadata *smd)
 {
-  int i;
-  int r = 0;
-  const char *name = smd->strtab + grub_host_to_target32 (s->sh_name);
+  Elf_Word target_section_index = grub_target_to_host32 (s->sh_info);
 
-  if (!strncmp (name, ".rela.", 6))
-    name += 5;
-  else if (!strncmp (name, ".rel.", 5))
-    name += 4;
-  else
+  /* Let the caller complain about a bogus index.  */
+  if (target_section_index >= smd->num_sections)
     return 1;
 
-  for (i = 0, s = smd->sections; i < smd->num_sections;
-       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
-    {
-      const char *sname = smd->strtab + grub_host_to_target32 (s->sh_name);
-      if (strcmp (sname, name))
+  s = (Elf_Shdr *) ((char *) smd->sections
+		    + target_section_index * smd->section_entsize);
+  return SUFFIX (is_kept_section) (s, image_target);
+}
+
+static void
+gc_mark_section (grub_uint8_t *live, Elf_Half *stack, grub_size_t *nstack,
+		 Elf_Half i)
+{
+  if (live[i])
+    return;
+  live[i] = 1;
+  stack[(*nstack)++] = i;
+}
+
+static int
+gc_root_cmp (const void *a, const void *b)
+{
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+/* Read the names of the symbols listed in the file at PATH, one per line,
+   '#' starting a comment, into ROOTS sorted by name.  Return their number
+   and the buffer the names point into in BUF.  */
+static grub_size_t
+read_gc_roots (const char *path, char ***roots, char **buf)
+{
+  grub_size_t size, n = 0, max = 0;
+  char *p, *next;
+
+  size = grub_util_get_image_size (path);
+  *buf = xmalloc (size + 1);
+  grub_util_load_image (path, *buf);
+  (*buf)[size] = '\0';
+  *roots = NULL;
+
+  for (p = *buf; *p; p = next)
+    {
+      char *end, *name;
+
+      next = strchr (p, '\n');
+      if (next)
+	*next++ = '\0';
+      else
+	next = p + strlen (p);
+
+      end = strchr (p, '#');
+      if (end)
+	*end = '\0';
+
+      name = grub_util_next_word (&p);
+      if (!name)
+	continue;
+
+      if (n == max)
+	{
+	  max = max ? 2 * max : 256;
+	  *roots = xrealloc (*roots, max * sizeof (**roots));
+	}
+      (*roots)[n++] = name;
+    }
+
+  if (n)
+    qsort (*roots, n, sizeof (**roots), gc_root_cmp);
+  return n;
+}
+
+/* Drop the sections which cannot be reached by following relocations from
+   the roots: the entry point, the exported symbol list, the symbols listed
+   in the file at ROOTS_PATH if any, and the sections the linker would keep
+   anyway.  The exported symbols are those grub_register_exported_symbols
+   registers, which its table references.  A dropped section loses
+   SHF_ALLOC, so that it is neither laid out nor copied, and its
+   relocations are skipped.  */
+static void
+SUFFIX (gc_sections) (Elf_Ehdr *e, struct section_metadata *smd,
+		      struct grub_mkimage_layout *layout,
+		      const char *roots_path,
+		      const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Half *first_rel, *next_rel, *first_dep, *next_dep, *stack;
+  grub_uint8_t *live;
+  grub_size_t nstack = 0;
+  Elf_Word symtab_size, sym_size, num_syms;
+  Elf_Shdr *strtab_section;
+  const char *symtab;
+  Elf_Sym *sym;
+  Elf_Word j;
+  Elf_Half i;
+  Elf_Shdr *s;
+  unsigned removed = 0;
+  grub_uint64_t removed_size = 0;
+  char **roots = NULL, *roots_buf = NULL;
+  grub_uint8_t *root_found = NULL;
+  grub_size_t nroots = 0, k;
+
+  if (roots_path)
+    {
+      nroots = read_gc_roots (roots_path, &roots, &roots_buf);
+      root_found = xcalloc (nroots ? : 1, sizeof (root_found[0]));
+    }
+
+  live = xcalloc (smd->num_sections, sizeof (live[0]));
+  stack = xcalloc (smd->num_sections, sizeof (stack[0]));
+  /* Relocation sections chained by the section they modify, and
+     SHF_LINK_ORDER sections by the section they are attached to.  */
+  first_rel = xcalloc (smd->num_sections, sizeof (first_rel[0]));
+  next_rel = xcalloc (smd->num_sections, sizeof (next_rel[0]));
+  first_dep = xcalloc (smd->num_sections, sizeof (first_dep[0]));
+  next_dep = xcalloc (smd->num_sections, sizeof (next_dep[0]));
+
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    {
+      Elf_Word type = grub_target_to_host32 (s->sh_type);
+      Elf_Word link = grub_target_to_host32 (s->sh_link);
+      Elf_Word info = grub_target_to_host32 (s->sh_info);
+
+      if (type == SHT_REL || type == SHT_RELA)
+	{
+	  if (info < smd->num_sections
+	      && link == (Elf_Word) (((char *) smd->symtab
+				     - (char *) smd->sections)
+				     / smd->section_entsize))
+	    {
+	      next_rel[i] = first_rel[info];
+	      first_rel[info] = i;
+	    }
+	  continue;
+	}
+
+      if (!SUFFIX (is_kept_section) (s, image_target))
+	continue;
+
+      if ((grub_target_to_host (s->sh_flags) & SHF_LINK_ORDER)
+	  && link && link < smd->num_sections)
+	{
+	  next_dep[i] = first_dep[link];
+	  first_dep[link] = i;
+	}
+
+      /* Keep what a linker would keep regardless of references.  */
+      if (type == SHT_INIT_ARRAY || type == SHT_FINI_ARRAY
+	  || type == SHT_PREINIT_ARRAY || type == SHT_NOTE)
+	gc_mark_section (live, stack, &nstack, i);
+    }
+
+  /* The entry point, the exported symbol list and the listed symbols are
+     roots.  Being global does not make a symbol one: most of the kernel
+     is.  */
+  strtab_section = (Elf_Shdr *) ((char *) smd->sections
+				 + grub_target_to_host32 (smd->symtab->sh_link)
+				 * smd->section_entsize);
+  symtab = (char *) e + grub_target_to_host (strtab_section->sh_offset);
+  symtab_size = grub_target_to_host (smd->symtab->sh_size);
+  sym_size = grub_target_to_host (smd->symtab->sh_entsize);
+  num_syms = symtab_size / sym_size;
+
+  for (j = 0, sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (smd->symtab->sh_offset));
+       j < num_syms;
+       j++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+      const char *name = symtab + grub_target_to_host32 (sym->st_name);
+
+      if (cur_index == STN_UNDEF || cur_index >= smd->num_sections)
+	continue;
+
+      if (strcmp (name, "_start") == 0 || strcmp (name, "start") == 0
+	  || strcmp (name, "grub_register_exported_symbols") == 0)
+	gc_mark_section (live, stack, &nstack, cur_index);
+      else if (nroots && *name)
+	{
+	  char **root = bsearch (&name, roots, nroots, sizeof (roots[0]),
+				 gc_root_cmp);
+
+	  if (root)
+	    {
+	      root_found[root - roots] = 1;
+	      gc_mark_section (live, stack, &nstack, cur_index);
+	    }
+	}
+    }
+
+  for (k = 0; k < nroots; k++)
+    if (!root_found[k])
+      grub_util_warn (_("symbol `%s' listed in `%s' is not defined"),
+		      roots[k], roots_path);
+
+  /* Everything referenced by a live section is live as well.  */
+  while (nstack)
+    {
+      Elf_Half cur = stack[--nstack];
+      Elf_Half r;
+
+      for (r = first_rel[cur]; r; r = next_rel[r])
+	{
+	  Elf_Rela *rel;
+	  Elf_Word rtab_size, r_size, num_rs;
+
+	  s = (Elf_Shdr *) ((char *) smd->sections + r * smd->section_entsize);
+	  rtab_size = grub_target_to_host (s->sh_size);
+	  r_size = grub_target_to_host (s->sh_entsize);
+	  num_rs = rtab_size / r_size;
+
+	  for (j = 0, rel = (Elf_Rela *) ((char *) e
+					  + grub_target_to_host (s->sh_offset));
+	       j < num_rs;
+	       j++, rel = (Elf_Rela *) ((char *) rel + r_size))
+	    {
+	      Elf_Word sym_index = ELF_R_SYM (grub_target_to_host (rel->r_info));
+	      Elf_Section target_index;
+
+	      if (sym_index >= num_syms)
+		grub_util_error ("symbol %u does not exist", (unsigned) sym_index);
+
+	      sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (smd->symtab->sh_offset)
+				 + sym_index * sym_size);
+	      target_index = grub_target_to_host16 (sym->st_shndx);
+	      if (target_index != STN_UNDEF && target_index < smd->num_sections)
+		gc_mark_section (live, stack, &nstack, target_index);
+	    }
+	}
+
+      for (r = first_dep[cur]; r; r = next_dep[r])
+	gc_mark_section (live, stack, &nstack, r);
+    }
+
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if (!live[i] && SUFFIX (is_kept_section) (s, image_target))
+      {
+	grub_util_info ("removing unreachable section %s (0x%"
+			GRUB_HOST_PRIxLONG_LONG " bytes)",
+			smd->strtab + grub_target_to_host32 (s->sh_name),
+			(unsigned long long) grub_target_to_host (s->sh_size));
+	removed++;
+	removed_size += grub_target_to_host (s->sh_size);
+	s->sh_flags = grub_host_to_target_addr (grub_target_to_host (s->sh_flags)
+						& ~SHF_ALLOC);
+      }
+
+  grub_util_info ("section garbage collection removed %u sections, 0x%"
+		  GRUB_HOST_PRIxLONG_LONG " bytes",
+		  removed, (unsigned long long) removed_size);
+  layout->stats.gc_sections = removed;
+  layout->stats.gc_size = removed_size;
+
+  free (root_found);
+  free (roots);
+  free (roots_buf);
+  free (next_dep);
+  free (first_dep);
+  free (next_rel);
+  free (first_rel);
+  free (stack);
+  free (live);
+}
+
+struct order_entry
+{
+  const char *name;
+  unsigned long long count;
+  int cold;
+  grub_size_t seq;
+};
+
+struct order_name
+{
+  const char *name;
+  Elf_Half section;
+};
+
+struct order_rank
+{
+  grub_size_t rank;
+  Elf_Half section;
+};
+
+/* Hot entries come first, the most frequently hit ones before the others;
+   entries are otherwise kept in file order.  */
+static int
+order_entry_cmp (const void *a, const void *b)
+{
+  const struct order_entry *ea = a, *eb = b;
+
+  if (ea->cold != eb->cold)
+    return ea->cold - eb->cold;
+  if (!ea->cold && ea->count != eb->count)
+    return ea->count < eb->count ? 1 : -1;
+  return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int
+order_name_cmp (const void *a, const void *b)
+{
+  const struct order_name *na = a, *nb = b;
+  int r = strcmp (na->name, nb->name);
+
+  if (r)
+    return r;
+  return (int) na->section - (int) nb->section;
+}
+
+static int
+order_rank_cmp (const void *a, const void *b)
+{
+  const struct order_rank *ra = a, *rb = b;
+
+  if (ra->rank != rb->rank)
+    return ra->rank < rb->rank ? -1 : 1;
+  return (int) ra->section - (int) rb->section;
+}
+
+/* Return the index of the first element of NAMES called NAME, or N.  */
+static grub_size_t
+order_name_find (struct order_name *names, grub_size_t n, const char *name)
+{
+  grub_size_t lo = 0, hi = n;
+
+  while (lo < hi)
+    {
+      grub_size_t mid = lo + (hi - lo) / 2;
+
+      if (strcmp (names[mid].name, name) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo < n && strcmp (names[lo].name, name) == 0)
+    return lo;
+  return n;
+}
+
+/* Parse the section order file at PATH into ENTRIES.  Every line names a
+   section or a symbol, optionally preceded by a hit count as found in a
+   symbol-hit list; '#' starts a comment.  A line consisting of '*' stands
+   for every section not listed: entries before it are placed first and
+   entries after it last.  Return the number of entries and the buffer
+   the names point into in BUF.  */
+static grub_size_t
+read_section_order (const char *path, struct order_entry **entries,
+		    char **buf)
+{
+  grub_size_t size, n = 0, max = 0;
+  char *p, *next;
+  int cold = 0;
+
+  size = grub_util_get_image_size (path);
+  *buf = xmalloc (size + 1);
+  grub_util_load_image (path, *buf);
+  (*buf)[size] = '\0';
+  *entries = NULL;
+
+  for (p = *buf; *p; p = next)
+    {
+      char *end, *name;
+      unsigned long long count = 0;
+
+      next = strchr (p, '\n');
+      if (next)
+	*next++ = '\0';
+      else
+	next = p + strlen (p);
+
+      end = strchr (p, '#');
+      if (end)
+	*end = '\0';
+
+      name = grub_util_next_word (&p);
+      if (!name)
+	continue;
+      if (grub_isdigit (*name))
+	{
+	  count = strtoull (name, &end, 0);
+	  if (*end)
+	    grub_util_error (_("invalid hit count `%s' in `%s'"), name, path);
+	  name = grub_util_next_word (&p);
+	  if (!name)
+	    continue;
+	}
+
+      if (strcmp (name, "*") == 0)
+	{
+	  cold = 1;
+	  continue;
+	}
+
+      if (n == max)
+	{
+	  max = max ? 2 * max : 256;
+	  *entries = xrealloc (*entries, max * sizeof (**entries));
+	}
+      (*entries)[n].name = name;
+      (*entries)[n].count = count;
+      (*entries)[n].cold = cold;
+      (*entries)[n].seq = n;
+      n++;
+    }
+
+  return n;
+}
+
+/* Compute the order in which locate_sections places the sections, as
+   requested by the section order file at PATH.  Sections not mentioned
+   keep the order of the section headers.  */
+static void
+SUFFIX (order_sections) (Elf_Ehdr *e, struct section_metadata *smd,
+			 const char *path,
+			 const struct grub_install_image_target_desc *image_target)
+{
+  struct order_entry *entries;
+  struct order_name *sections, *symbols;
+  struct order_rank *ranks;
+  grub_size_t nentries, nsections = 0, nsymbols = 0, nhot = 0;
+  grub_size_t k;
+  char *buf;
+  Elf_Word symtab_size, sym_size, num_syms;
+  Elf_Shdr *strtab_section;
+  const char *symtab;
+  Elf_Sym *sym;
+  Elf_Word j;
+  Elf_Half i;
+  Elf_Shdr *s;
+
+  nentries = read_section_order (path, &entries, &buf);
+  qsort (entries, nentries, sizeof (entries[0]), order_entry_cmp);
+
+  sections = xcalloc (smd->num_sections, sizeof (sections[0]));
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if (SUFFIX (is_kept_section) (s, image_target))
+      {
+	sections[nsections].name = smd->strtab + grub_target_to_host32 (s->sh_name);
+	sections[nsections++].section = i;
+      }
+  qsort (sections, nsections, sizeof (sections[0]), order_name_cmp);
+
+  strtab_section = (Elf_Shdr *) ((char *) smd->sections
+				 + grub_target_to_host32 (smd->symtab->sh_link)
+				 * smd->section_entsize);
+  symtab = (char *) e + grub_target_to_host (strtab_section->sh_offset);
+  symtab_size = grub_target_to_host (smd->symtab->sh_size);
+  sym_size = grub_target_to_host (smd->symtab->sh_entsize);
+  num_syms = symtab_size / sym_size;
+
+  symbols = xcalloc (num_syms ? : 1, sizeof (symbols[0]));
+  for (j = 0, sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (smd->symtab->sh_offset));
+       j < num_syms;
+       j++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+
+      if (!sym->st_name || cur_index == STN_UNDEF
+	  || cur_index >= smd->num_sections)
+	continue;
+      symbols[nsymbols].name = symtab + grub_target_to_host32 (sym->st_name);
+      symbols[nsymbols++].section = cur_index;
+    }
+  qsort (symbols, nsymbols, sizeof (symbols[0]), order_name_cmp);
+
+  /* Unlisted sections rank between the hot and the cold entries.  */
+  for (k = 0; k < nentries && !entries[k].cold; k++)
+    nhot++;
+
+  ranks = xcalloc (smd->num_sections, sizeof (ranks[0]));
+  for (i = 0; i < smd->num_sections; i++)
+    {
+      ranks[i].rank = (grub_size_t) -1;
+      ranks[i].section = i;
+    }
+
+  for (k = 0; k < nentries; k++)
+    {
+      grub_size_t rank = entries[k].cold ? k + 1 : k;
+      grub_size_t m;
+      int found = 0;
+
+      for (m = order_name_find (sections, nsections, entries[k].name);
+	   m < nsections && strcmp (sections[m].name, entries[k].name) == 0;
+	   m++, found = 1)
+	if (ranks[sections[m].section].rank == (grub_size_t) -1)
+	  ranks[sections[m].section].rank = rank;
+
+      if (found)
+	continue;
+
+      for (m = order_name_find (symbols, nsymbols, entries[k].name);
+	   m < nsymbols && strcmp (symbols[m].name, entries[k].name) == 0;
+	   m++, found = 1)
+	if (ranks[symbols[m].section].rank == (grub_size_t) -1)
+	  ranks[symbols[m].section].rank = rank;
+
+      if (!found)
+	grub_util_info ("section order entry %s matches nothing",
+			entries[k].name);
+    }
+
+  for (i = 0; i < smd->num_sections; i++)
+    if (ranks[i].rank == (grub_size_t) -1)
+      ranks[i].rank = nhot;
+    else
+      grub_util_info ("placing the section %s %s",
+		      smd->strtab
+		      + grub_target_to_host32 (((Elf_Shdr *) ((char *) smd->sections
+							      + i * smd->section_entsize))->sh_name),
+		      ranks[i].rank < nhot ? "first" : "last");
+
+  qsort (ranks, smd->num_sections, sizeof (ranks[0]), order_rank_cmp);
+
+  smd->order = xcalloc (smd->num_sections, sizeof (smd->order[0]));
+  for (i = 0; i < smd->num_sections; i++)
+    smd->order[i] = ranks[i].section;
+
+  free (ranks);
+  free (symbols);
+  free (sections);
+  free (entries);
+  free (buf);
+}
+
+/* Return 1 if a relocation of type INFO refers to exactly its symbol plus
+   addend, so that the addend can be moved along with the data it points
+   to.  */
+static int
+SUFFIX (is_exact_reloc) (Elf_Addr info, int rela,
+			 const struct grub_install_image_target_desc *image_target)
+{
+  switch (image_target->elf_target)
+    {
+    case EM_386:
+      return ELF_R_TYPE (info) == R_386_32;
+    case EM_ARM:
+      return ELF_R_TYPE (info) == R_ARM_ABS32;
+    case EM_X86_64:
+      return rela && (ELF_R_TYPE (info) == R_X86_64_64
+		      || ELF_R_TYPE (info) == R_X86_64_32
+		      || ELF_R_TYPE (info) == R_X86_64_32S);
+    case EM_AARCH64:
+      return rela && (ELF_R_TYPE (info) == R_AARCH64_ABS64
+		      || ELF_R_TYPE (info) == R_AARCH64_ADR_PREL_PG_HI21
+		      || ELF_R_TYPE (info) == R_AARCH64_ADD_ABS_LO12_NC);
+    case EM_RISCV:
+      return rela && (ELF_R_TYPE (info) == R_RISCV_32
+		      || ELF_R_TYPE (info) == R_RISCV_64);
+    }
+  return 0;
+}
+
+struct merge_string
+{
+  const char *str;
+  grub_size_t len;
+  grub_size_t out;
+};
+
+struct merge_member
+{
+  Elf_Half section;
+  /* The strings of the section, in section order.  */
+  struct merge_string *strings;
+  grub_size_t nstrings;
+};
+
+/* Sort strings by their reversed contents, longest first among strings
+   sharing a suffix, so that every string directly follows one it may be
+   a tail of.  */
+static int
+merge_string_cmp (const void *a, const void *b)
+{
+  const struct merge_string *sa = *(struct merge_string * const *) a;
+  const struct merge_string *sb = *(struct merge_string * const *) b;
+  grub_size_t la = sa->len, lb = sb->len;
+
+  while (la && lb)
+    {
+      unsigned char ca = sa->str[--la], cb = sb->str[--lb];
+
+      if (ca != cb)
+	return ca < cb ? 1 : -1;
+    }
+  if (la != lb)
+    return la < lb ? 1 : -1;
+  return 0;
+}
+
+/* Return where the byte at OFFSET of the merged section M ended up.  */
+static grub_size_t
+merge_map (struct merge_member *m, grub_size_t offset)
+{
+  grub_size_t lo = 0, hi = m->nstrings;
+
+  /* Find the last string starting at or before OFFSET.  */
+  while (hi - lo > 1)
+    {
+      grub_size_t mid = lo + (hi - lo) / 2;
+
+      if ((grub_size_t) (m->strings[mid].str - m->strings[0].str) <= offset)
+	lo = mid;
+      else
+	hi = mid;
+    }
+
+  return m->strings[lo].out + offset
+    - (grub_size_t) (m->strings[lo].str - m->strings[0].str);
+}
+
+/* The section may be folded into an identical one.  */
+#define FOLD_CANDIDATE	1
+/* All references to the section through its section symbol can be
+   adjusted, so its contents may be moved around.  */
+#define FOLD_ADJUSTABLE	2
+
+struct fold_section
+{
+  grub_uint64_t hash;
+  Elf_Half section;
+};
+
+static int
+fold_section_cmp (const void *a, const void *b)
+{
+  const struct fold_section *fa = a, *fb = b;
+
+  if (fa->hash != fb->hash)
+    return fa->hash < fb->hash ? -1 : 1;
+  return (int) fa->section - (int) fb->section;
+}
+
+/* Fold read-only sections with identical contents, and merge the
+   SHF_MERGE|SHF_STRINGS sections into a single one in which strings are
+   stored once and may share their tails.  Symbols are moved to the
+   surviving section and relocations against section symbols get their
+   addends adjusted; the sections folded away lose SHF_ALLOC.  Sections
+   which are relocated themselves, which define exported symbols or which
+   are referred to in ways that cannot be adjusted are left alone.  */
+static void
+SUFFIX (fold_sections) (Elf_Ehdr *e, struct section_metadata *smd,
+			const struct grub_install_image_target_desc *image_target)
+{
+  grub_uint8_t *candidate;
+  Elf_Half *fold_to;
+  struct merge_member **member;
+  struct merge_member *members;
+  struct merge_string **sorted;
+  struct fold_section *folds;
+  grub_size_t nmembers = 0, nstrings = 0, nfolds = 0, merged_size = 0;
+  grub_size_t k, m;
+  grub_uint64_t before = 0;
+  Elf_Word symtab_size, sym_size, num_syms;
+  Elf_Sym *syms, *sym;
+  Elf_Word j;
+  Elf_Half i, merged = 0;
+  Elf_Shdr *s;
+  char *pool;
+
+  candidate = xcalloc (smd->num_sections, sizeof (candidate[0]));
+  fold_to = xcalloc (smd->num_sections, sizeof (fold_to[0]));
+  member = xcalloc (smd->num_sections, sizeof (member[0]));
+
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if (SUFFIX (is_data_section) (s, image_target)
+	&& !(grub_target_to_host (s->sh_flags) & SHF_WRITE)
+	&& grub_target_to_host32 (s->sh_type) == SHT_PROGBITS)
+      candidate[i] = FOLD_CANDIDATE | FOLD_ADJUSTABLE;
+
+  syms = (Elf_Sym *) ((char *) e + grub_target_to_host (smd->symtab->sh_offset));
+  symtab_size = grub_target_to_host (smd->symtab->sh_size);
+  sym_size = grub_target_to_host (smd->symtab->sh_entsize);
+  num_syms = symtab_size / sym_size;
+
+  /* Exported symbols may have their address compared by anyone.  */
+  for (j = 0, sym = syms; j < num_syms;
+       j++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+
+      if (cur_index == STN_UNDEF || cur_index >= smd->num_sections)
 	continue;
+      if (ELF_ST_BIND (sym->st_info) != STB_LOCAL
+	  && ELF_ST_VISIBILITY (sym->st_other) == STV_DEFAULT)
+	candidate[cur_index] = 0;
+      else if (grub_target_to_host (sym->st_value)
+	       >= grub_target_to_host (((Elf_Shdr *) ((char *) smd->sections
+						      + cur_index * smd->section_entsize))->sh_size))
+	candidate[cur_index] &= ~FOLD_ADJUSTABLE;
+    }
+
+  /* Sections which are relocated would need their relocations compared.
+     Merging strings moves them around, so only references through section
+     symbols with adjustable addends are allowed to those.  */
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if ((s->sh_type == grub_host_to_target32 (SHT_REL)) ||
+        (s->sh_type == grub_host_to_target32 (SHT_RELA)))
+      {
+	Elf_Word target_section_index = grub_target_to_host32 (s->sh_info);
+	int rela = (s->sh_type == grub_host_to_target32 (SHT_RELA));
+	Elf_Word rtab_size, r_size, num_rs;
+	Elf_Rela *r;
+
+	if (!SUFFIX (is_kept_reloc_section) (s, image_target, smd))
+	  continue;
+	if (target_section_index < smd->num_sections)
+	  candidate[target_section_index] = 0;
+
+	rtab_size = grub_target_to_host (s->sh_size);
+	r_size = grub_target_to_host (s->sh_entsize);
+	num_rs = rtab_size / r_size;
+
+	for (j = 0, r = (Elf_Rela *) ((char *) e + grub_target_to_host (s->sh_offset));
+	     j < num_rs;
+	     j++, r = (Elf_Rela *) ((char *) r + r_size))
+	  {
+	    Elf_Addr info = grub_target_to_host (r->r_info);
+	    Elf_Section cur_index;
+
+	    if (ELF_R_SYM (info) >= num_syms)
+	      continue;
+	    sym = (Elf_Sym *) ((char *) syms + ELF_R_SYM (info) * sym_size);
+	    cur_index = grub_target_to_host16 (sym->st_shndx);
+	    if (ELF_ST_TYPE (sym->st_info) != STT_SECTION
+		|| cur_index >= smd->num_sections || !candidate[cur_index])
+	      continue;
+	    if (!SUFFIX (is_exact_reloc) (info, rela, image_target)
+		|| (rela
+		    && grub_target_to_host (r->r_addend)
+		    >= grub_target_to_host (((Elf_Shdr *) ((char *) smd->sections
+							   + cur_index * smd->section_entsize))->sh_size)))
+	      candidate[cur_index] &= ~FOLD_ADJUSTABLE;
+	  }
+      }
+
+  /* Split the string sections into their strings.  */
+  members = xcalloc (smd->num_sections, sizeof (members[0]));
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    {
+      const char *data = (char *) e + grub_target_to_host (s->sh_offset);
+      grub_size_t size = grub_target_to_host (s->sh_size);
+      grub_size_t off, n = 0;
+      struct merge_string *str;
+
+      if (candidate[i] != (FOLD_CANDIDATE | FOLD_ADJUSTABLE)
+	  || (grub_target_to_host (s->sh_flags) & (SHF_MERGE | SHF_STRINGS))
+	  != (SHF_MERGE | SHF_STRINGS)
+	  || grub_target_to_host (s->sh_entsize) != 1
+	  || grub_target_to_host (s->sh_addralign) > 1
+	  || size == 0 || data[size - 1] != '\0')
+	continue;
+
+      for (off = 0; off < size; off++)
+	if (data[off] == '\0')
+	  n++;
+
+      member[i] = &members[nmembers++];
+      member[i]->section = i;
+      member[i]->strings = xcalloc (n, sizeof (member[i]->strings[0]));
+      for (off = 0; off < size; off += str->len + 1)
+	{
+	  str = &member[i]->strings[member[i]->nstrings++];
+	  str->str = data + off;
+	  str->len = strlen (data + off);
+	}
+      nstrings += n;
+      before += size;
+    }
+
+  /* Lay the strings out once each, sharing tails where possible.  */
+  if (nmembers > 0)
+    {
+      sorted = xcalloc (nstrings, sizeof (sorted[0]));
+      for (m = 0, k = 0; m < nmembers; m++)
+	for (j = 0; j < members[m].nstrings; j++)
+	  sorted[k++] = &members[m].strings[j];
+      qsort (sorted, nstrings, sizeof (sorted[0]), merge_string_cmp);
+
+      for (k = 0; k < nstrings; k++)
+	{
+	  struct merge_string *prev = k ? sorted[k - 1] : NULL;
+
+	  if (prev && prev->len >= sorted[k]->len
+	      && memcmp (prev->str + prev->len - sorted[k]->len, sorted[k]->str,
+			 sorted[k]->len) == 0)
+	    sorted[k]->out = prev->out + prev->len - sorted[k]->len;
+	  else
+	    {
+	      sorted[k]->out = merged_size;
+	      merged_size += sorted[k]->len + 1;
+	    }
+	}
+
+      pool = xmalloc (merged_size);
+      for (k = 0; k < nstrings; k++)
+	memcpy (pool + sorted[k]->out, sorted[k]->str, sorted[k]->len + 1);
+      free (sorted);
+
+      /* The first string section becomes the merged one.  */
+      merged = members[0].section;
+      s = (Elf_Shdr *) ((char *) smd->sections + merged * smd->section_entsize);
+      s->sh_size = grub_host_to_target_addr (merged_size);
+      smd->contents[merged] = pool;
+
+      grub_util_info ("merged %u string sections into %s:"
+		      " 0x%" GRUB_HOST_PRIxLONG_LONG " -> 0x%" GRUB_HOST_PRIxLONG_LONG
+		      " bytes",
+		      (unsigned) nmembers,
+		      smd->strtab + grub_target_to_host32 (s->sh_name),
+		      (unsigned long long) before, (unsigned long long) merged_size);
+    }
+
+  /* Fold the remaining candidates with identical contents.  */
+  folds = xcalloc (smd->num_sections, sizeof (folds[0]));
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    {
+      const unsigned char *data = (unsigned char *) e + grub_target_to_host (s->sh_offset);
+      grub_size_t size = grub_target_to_host (s->sh_size);
+      grub_uint64_t h = 0xcbf29ce484222325ULL;
+      grub_size_t off;
+
+      if (!(candidate[i] & FOLD_CANDIDATE) || member[i] || size == 0)
+	continue;
+
+      /* FNV-1a.  */
+      for (off = 0; off < size; off++)
+	h = (h ^ data[off]) * 0x100000001b3ULL;
+      folds[nfolds].hash = h ^ size;
+      folds[nfolds++].section = i;
+    }
+  qsort (folds, nfolds, sizeof (folds[0]), fold_section_cmp);
+
+  for (k = 0; k < nfolds; k++)
+    for (m = k + 1; m < nfolds && folds[m].hash == folds[k].hash; m++)
+      {
+	Elf_Shdr *sk, *sm;
+
+	if (fold_to[folds[k].section] || fold_to[folds[m].section])
+	  continue;
+	sk = (Elf_Shdr *) ((char *) smd->sections + folds[k].section * smd->section_entsize);
+	sm = (Elf_Shdr *) ((char *) smd->sections + folds[m].section * smd->section_entsize);
+	if (sk->sh_size != sm->sh_size
+	    || grub_target_to_host (sm->sh_addralign) > grub_target_to_host (sk->sh_addralign)
+	    || memcmp ((char *) e + grub_target_to_host (sk->sh_offset),
+		       (char *) e + grub_target_to_host (sm->sh_offset),
+		       grub_target_to_host (sk->sh_size)) != 0)
+	  continue;
+
+	grub_util_info ("folding the section %s into %s (0x%"
+			GRUB_HOST_PRIxLONG_LONG " bytes)",
+			smd->strtab + grub_target_to_host32 (sm->sh_name),
+			smd->strtab + grub_target_to_host32 (sk->sh_name),
+			(unsigned long long) grub_target_to_host (sm->sh_size));
+	fold_to[folds[m].section] = folds[k].section;
+      }
+
+  /* Point the relocations against section symbols at the survivors.  */
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections && nmembers > 0;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if ((s->sh_type == grub_host_to_target32 (SHT_REL)) ||
+        (s->sh_type == grub_host_to_target32 (SHT_RELA)))
+      {
+	int rela = (s->sh_type == grub_host_to_target32 (SHT_RELA));
+	Elf_Word rtab_size, r_size, num_rs;
+	Elf_Shdr *target_section;
+	Elf_Rela *r;
+
+	if (!SUFFIX (is_kept_reloc_section) (s, image_target, smd))
+	  continue;
+
+	target_section = (Elf_Shdr *) ((char *) smd->sections
+				       + grub_target_to_host32 (s->sh_info)
+				       * smd->section_entsize);
+	rtab_size = grub_target_to_host (s->sh_size);
+	r_size = grub_target_to_host (s->sh_entsize);
+	num_rs = rtab_size / r_size;
+
+	for (j = 0, r = (Elf_Rela *) ((char *) e + grub_target_to_host (s->sh_offset));
+	     j < num_rs;
+	     j++, r = (Elf_Rela *) ((char *) r + r_size))
+	  {
+	    Elf_Addr info = grub_target_to_host (r->r_info);
+	    Elf_Section cur_index;
+
+	    if (ELF_R_SYM (info) >= num_syms)
+	      continue;
+	    sym = (Elf_Sym *) ((char *) syms + ELF_R_SYM (info) * sym_size);
+	    cur_index = grub_target_to_host16 (sym->st_shndx);
+	    if (ELF_ST_TYPE (sym->st_info) != STT_SECTION
+		|| cur_index >= smd->num_sections || !member[cur_index])
+	      continue;
+
+	    if (rela)
+	      r->r_addend = grub_host_to_target_addr (merge_map (member[cur_index],
+								  grub_target_to_host (r->r_addend)));
+	    else
+	      {
+		grub_uint32_t *target;
 
-      return SUFFIX (is_kept_section) (s, image_target);
+		target = (grub_uint32_t *) SUFFIX (get_target_address) (e, target_section,
+									grub_target_to_host (r->r_offset),
+									image_target);
+		*target = grub_host_to_target32 (merge_map (member[cur_index],
+							    grub_target_to_host32 (*target)));
+	      }
+	  }
+      }
+
+  /* Move the symbols, section symbols included.  */
+  for (j = 0, sym = syms; j < num_syms;
+       j++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+
+      if (cur_index == STN_UNDEF || cur_index >= smd->num_sections)
+	continue;
+      if (member[cur_index])
+	{
+	  if (ELF_ST_TYPE (sym->st_info) != STT_SECTION)
+	    sym->st_value = grub_host_to_target_addr (merge_map (member[cur_index],
+								 grub_target_to_host (sym->st_value)));
+	  sym->st_shndx = grub_host_to_target16 (merged);
+	}
+      else if (fold_to[cur_index])
+	sym->st_shndx = grub_host_to_target16 (fold_to[cur_index]);
     }
 
-  return r;
+  for (i = 0, s = smd->sections;
+       i < smd->num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
+    if ((member[i] && i != merged) || fold_to[i])
+      s->sh_flags = grub_host_to_target_addr (grub_target_to_host (s->sh_flags)
+					      & ~SHF_ALLOC);
+
+  for (m = 0; m < nmembers; m++)
+    free (members[m].strings);
+  free (members);
+  free (folds);
+  free (member);
+  free (fold_to);
+  free (candidate);
 }
 
 /* Return if the ELF header is valid.  */
@@ -1821,9 +3034,13 @@ SUFFIX (put_section) (Elf_Shdr *s, int i,
 	const char *name = smd->strtab + grub_host_to_target32 (s->sh_name);
 
 	if (align)
-	  current_address = ALIGN_UP (current_address + image_target->vaddr_offset,
-				      align)
-	    - image_target->vaddr_offset;
+	  {
+	    Elf_Addr aligned = ALIGN_UP (current_address + image_target->vaddr_offset,
+					 align) - image_target->vaddr_offset;
+
+	    smd->stats->section_padding += aligned - current_address;
+	    current_address = aligned;
+	  }
 
 	grub_util_info ("locating the section %s at 0x%"
 			GRUB_HOST_PRIxLONG_LONG,
@@ -1846,7 +3063,7 @@ SUFFIX (locate_sections) (Elf_Ehdr *e, const char *kernel_path,
 			  struct grub_mkimage_layout *layout,
 			  const struct grub_install_image_target_desc *image_target)
 {
-  int i;
+  int i, k;
   Elf_Shdr *s;
 
   layout->align = 1;
@@ -1864,38 +3081,37 @@ SUFFIX (locate_sections) (Elf_Ehdr *e, const char *kernel_path,
       layout->align = grub_host_to_target32 (s->sh_addralign);
 
   /* .text */
-  for (i = 0, s = smd->sections;
-       i < smd->num_sections;
-       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
-    if (SUFFIX (is_text_section) (s, image_target))
-      {
-	layout->kernel_size = SUFFIX (put_section) (s, i, layout->kernel_size,
-						smd, image_target);
-	if (!is_relocatable (image_target) &&
-	    grub_host_to_target_addr (s->sh_addr) != image_target->link_addr)
-	  {
-	    char *msg
-	      = grub_xasprintf (_("`%s' is miscompiled: its start address is 0x%llx"
-				  " instead of 0x%llx: ld.gold bug?"),
-				kernel_path,
-				(unsigned long long) grub_host_to_target_addr (s->sh_addr),
-				(unsigned long long) image_target->link_addr);
-	    grub_util_error ("%s", msg);
-	  }
-      }
+  for (k = 0; k < smd->num_sections; k++)
+    {
+      i = smd->order ? smd->order[k] : k;
+      s = (Elf_Shdr *) ((char *) smd->sections + i * smd->section_entsize);
+      if (!SUFFIX (is_text_section) (s, image_target))
+	continue;
+
+      layout->kernel_size = SUFFIX (put_section) (s, i, layout->kernel_size,
+						  smd, image_target);
+      if (!is_relocatable (image_target) &&
+	  grub_host_to_target_addr (s->sh_addr) != image_target->link_addr)
+	{
+	  char *msg
+	    = grub_xasprintf (_("`%s' is miscompiled: its start address is 0x%llx"
+				" instead of 0x%llx: ld.gold bug?"),
+			      kernel_path,
+			      (unsigned long long) grub_host_to_target_addr (s->sh_addr),
+			      (unsigned long long) image_target->link_addr);
+	  grub_util_error ("%s", msg);
+	}
+    }
 
 #ifdef MKIMAGE_ELF32
   if (image_target->elf_target == EM_ARM)
     {
-      grub_size_t tramp;
-
       layout->kernel_size = ALIGN_UP (layout->kernel_size, 16);
 
-      tramp = arm_get_trampoline_size (e, smd->sections, smd->section_entsize,
-				       smd->num_sections, image_target);
+      SUFFIX (allocate_reloc_slots) (e, smd, image_target);
 
       layout->tramp_off = layout->kernel_size;
-      layout->kernel_size += ALIGN_UP (tramp, 16);
+      layout->kernel_size += ALIGN_UP (smd->slots->tramp_size, 16);
     }
 #endif
 
@@ -1905,12 +3121,21 @@ SUFFIX (locate_sections) (Elf_Ehdr *e, const char *kernel_path,
   layout->exec_size = layout->kernel_size;
 
   /* .data */
-  for (i = 0, s = smd->sections;
-       i < smd->num_sections;
-       i++, s = (Elf_Shdr *) ((char *) s + smd->section_entsize))
-    if (SUFFIX (is_data_section) (s, image_target))
-      layout->kernel_size = SUFFIX (put_section) (s, i, layout->kernel_size, smd,
-						  image_target);
+  for (k = 0; k < smd->num_sections; k++)
+    {
+      i = smd->order ? smd->order[k] : k;
+      s = (Elf_Shdr *) ((char *) smd->sections + i * smd->section_entsize);
+      if (SUFFIX (is_data_section) (s, image_target))
+	layout->kernel_size = SUFFIX (put_section) (s, i, layout->kernel_size, smd,
+						    image_target);
+    }
+
+  /* A virtual-only .bss gets a PE section of its own, which has to start
+     on a section boundary.  */
+  if (layout->virtual_bss)
+    layout->kernel_size = ALIGN_UP (layout->kernel_size + image_target->vaddr_offset,
+				    image_target->section_align)
+      - image_target->vaddr_offset;
 
   layout->bss_start = layout->kernel_size;
   layout->end = layout->kernel_size;
@@ -1937,17 +3162,143 @@ SUFFIX (locate_sections) (Elf_Ehdr *e, const char *kernel_path,
      their binaries as we build with -Wl,-Ttext.
   */
   if (image_target->id == IMAGE_EFI || !is_relocatable (image_target))
-    layout->kernel_size = layout->end;
+    {
+      layout->kernel_size = layout->end;
+      if (!layout->virtual_bss)
+	layout->stats.bss_size = layout->end - layout->bss_start;
+    }
+}
+
+/* Collect the global symbols of the kernel, once relocated, for modules
+   to be pre-linked against and for the symbol hash table.  */
+static void
+SUFFIX (collect_symbols) (Elf_Ehdr *e, struct section_metadata *smd,
+			  struct grub_mkimage_layout *layout,
+			  const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Word symtab_size, sym_size, num_syms;
+  Elf_Shdr *strtab_section;
+  const char *strtab;
+  Elf_Sym *sym;
+  Elf_Word i;
+
+  strtab_section = (Elf_Shdr *) ((char *) smd->sections
+				 + grub_target_to_host32 (smd->symtab->sh_link)
+				   * smd->section_entsize);
+  strtab = (char *) e + grub_target_to_host (strtab_section->sh_offset);
+
+  symtab_size = grub_target_to_host (smd->symtab->sh_size);
+  sym_size = grub_target_to_host (smd->symtab->sh_entsize);
+  num_syms = symtab_size / sym_size;
+
+  layout->symbols = xcalloc (num_syms, sizeof (layout->symbols[0]));
+  layout->nsymbols = 0;
+
+  for (i = 0, sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (smd->symtab->sh_offset));
+       i < num_syms;
+       i++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+      struct grub_mkimage_symbol *ksym;
+
+      if ((ELF_ST_BIND (sym->st_info) != STB_GLOBAL
+	   && ELF_ST_BIND (sym->st_info) != STB_WEAK)
+	  || ELF_ST_VISIBILITY (sym->st_other) != STV_DEFAULT
+	  || cur_index == STN_UNDEF || cur_index >= smd->num_sections)
+	continue;
+
+      if (!SUFFIX (is_kept_section) ((Elf_Shdr *) ((char *) smd->sections
+						   + cur_index
+						   * smd->section_entsize),
+				     image_target))
+	continue;
+
+      ksym = &layout->symbols[layout->nsymbols++];
+      ksym->name = xstrdup (strtab + grub_target_to_host32 (sym->st_name));
+      ksym->addr = RELOCATED_SYMBOL_ADDR (sym);
+    }
+
+  grub_mkimage_sort_symbols (layout->symbols, layout->nsymbols);
+}
+
+/* Collect every named function and object of the kernel, once relocated,
+   for the symbol map.  */
+static void
+SUFFIX (collect_map_symbols) (Elf_Ehdr *e, struct section_metadata *smd,
+			      struct grub_mkimage_layout *layout,
+			      const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Word symtab_size, sym_size, num_syms;
+  Elf_Shdr *strtab_section;
+  const char *strtab;
+  Elf_Sym *sym;
+  Elf_Word i;
+
+  strtab_section = (Elf_Shdr *) ((char *) smd->sections
+				 + grub_target_to_host32 (smd->symtab->sh_link)
+				   * smd->section_entsize);
+  strtab = (char *) e + grub_target_to_host (strtab_section->sh_offset);
+
+  symtab_size = grub_target_to_host (smd->symtab->sh_size);
+  sym_size = grub_target_to_host (smd->symtab->sh_entsize);
+  num_syms = symtab_size / sym_size;
+
+  layout->map_symbols = xcalloc (num_syms, sizeof (layout->map_symbols[0]));
+  layout->nmap_symbols = 0;
+
+  for (i = 0, sym = (Elf_Sym *) ((char *) e
+				 + grub_target_to_host (smd->symtab->sh_offset));
+       i < num_syms;
+       i++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section cur_index = grub_target_to_host16 (sym->st_shndx);
+      struct grub_mkimage_map_symbol *msym;
+      Elf_Shdr *s;
+      char type;
+
+      if (!sym->st_name
+	  || (ELF_ST_TYPE (sym->st_info) != STT_FUNC
+	      && ELF_ST_TYPE (sym->st_info) != STT_OBJECT
+	      && ELF_ST_TYPE (sym->st_info) != STT_NOTYPE)
+	  || cur_index == STN_UNDEF || cur_index >= smd->num_sections)
+	continue;
+
+      s = (Elf_Shdr *) ((char *) smd->sections
+			+ cur_index * smd->section_entsize);
+      if (!SUFFIX (is_kept_section) (s, image_target))
+	continue;
+
+      if (SUFFIX (is_text_section) (s, image_target))
+	type = 'T';
+      else if (SUFFIX (is_bss_section) (s, image_target))
+	type = 'B';
+      else if (grub_target_to_host (s->sh_flags) & SHF_WRITE)
+	type = 'D';
+      else
+	type = 'R';
+      if (ELF_ST_BIND (sym->st_info) == STB_LOCAL)
+	type = grub_tolower (type);
+
+      msym = &layout->map_symbols[layout->nmap_symbols++];
+      msym->name = xstrdup (strtab + grub_target_to_host32 (sym->st_name));
+      msym->addr = RELOCATED_SYMBOL_ADDR (sym);
+      msym->size = grub_target_to_host (sym->st_size);
+      msym->type = type;
+    }
 }
 
 char *
 SUFFIX (grub_mkimage_load_image) (const char *kernel_path,
 				  size_t total_module_size,
 				  struct grub_mkimage_layout *layout,
+				  const struct grub_install_image_options *options,
 				  const struct grub_install_image_target_desc *image_target)
 {
   char *kernel_img, *out_img;
-  struct section_metadata smd = { 0, 0, 0, 0, 0, 0, 0 };
+  struct section_metadata smd = { 0 };
+  /* Prelinking and symbol hashing look up the kernel's symbols.  */
+  int keep_symbols = options->prelink || options->symbol_hash;
   Elf_Ehdr *e;
   int i;
   Elf_Shdr *s;
@@ -1981,8 +3332,47 @@ SUFFIX (grub_mkimage_load_image) (const char *kernel_path,
 		      + grub_host_to_target16 (e->e_shstrndx) * smd.section_entsize);
   smd.strtab = (char *) e + grub_host_to_target_addr (s->sh_offset);
 
-  smd.addrs = xcalloc (smd.num_sections, sizeof (*smd.addrs));
-  smd.vaddrs = xcalloc (smd.num_sections, sizeof (*smd.vaddrs));
+  smd.addrs = xcalloc (smd.num_sections, sizeof (*smd.addrs));
+  smd.vaddrs = xcalloc (smd.num_sections, sizeof (*smd.vaddrs));
+  smd.slots = xcalloc (1, sizeof (*smd.slots));
+  smd.contents = xcalloc (smd.num_sections, sizeof (*smd.contents));
+  smd.reloc_stats = xcalloc (smd.num_sections, sizeof (*smd.reloc_stats));
+  smd.stats = &layout->stats;
+
+  if (is_relocatable (image_target))
+    {
+      smd.symtab = NULL;
+      for (i = 0, s = smd.sections;
+	   i < smd.num_sections;
+	   i++, s = (Elf_Shdr *) ((char *) s + smd.section_entsize))
+	if (s->sh_type == grub_host_to_target32 (SHT_SYMTAB))
+	  {
+	    smd.symtab = s;
+	    break;
+	  }
+      if (! smd.symtab)
+	grub_util_error ("%s", _("no symbol table"));
+
+      if (options->gc_sections || options->gc_roots_path)
+	SUFFIX (gc_sections) (e, &smd, layout, options->gc_roots_path,
+			      image_target);
+      if (options->fold_sections)
+	SUFFIX (fold_sections) (e, &smd, image_target);
+    }
+  else if (options->gc_sections || options->gc_roots_path)
+    grub_util_warn ("%s", _("cannot collect unused sections of a non-relocatable kernel"));
+  else if (options->fold_sections)
+    grub_util_warn ("%s", _("cannot fold the sections of a non-relocatable kernel"));
+
+  if (options->section_order && is_relocatable (image_target))
+    SUFFIX (order_sections) (e, &smd, options->section_order, image_target);
+  else if (options->section_order)
+    grub_util_warn ("%s", _("cannot reorder the sections of a non-relocatable kernel"));
+
+  if (options->virtual_bss && image_target->id == IMAGE_EFI)
+    layout->virtual_bss = 1;
+  else if (options->virtual_bss)
+    grub_util_warn ("%s", _("virtual .bss is only supported for EFI images"));
 
   SUFFIX (locate_sections) (e, kernel_path, &smd, layout, image_target);
 
@@ -2028,25 +3418,13 @@ SUFFIX (grub_mkimage_load_image) (const char *kernel_path,
 
   if (is_relocatable (image_target))
     {
-      smd.symtab = NULL;
-      for (i = 0, s = smd.sections;
-	   i < smd.num_sections;
-	   i++, s = (Elf_Shdr *) ((char *) s + smd.section_entsize))
-	if (s->sh_type == grub_host_to_target32 (SHT_SYMTAB))
-	  {
-	    smd.symtab = s;
-	    break;
-	  }
-      if (! smd.symtab)
-	grub_util_error ("%s", _("no symbol table"));
 #ifdef MKIMAGE_ELF64
       if (image_target->elf_target == EM_AARCH64)
 	{
-	  grub_size_t tramp;
-
 	  layout->kernel_size = ALIGN_UP (layout->kernel_size, 16);
 
-	  grub_arm64_dl_get_tramp_got_size (e, &tramp, &layout->got_size);
+	  SUFFIX (allocate_reloc_slots) (e, &smd, image_target);
+	  layout->got_size = smd.slots->got_size;
 
 	  layout->got_off = layout->kernel_size;
 	  layout->kernel_size += ALIGN_UP (layout->got_size, 16);
@@ -2076,11 +3454,39 @@ SUFFIX (grub_mkimage_load_image) (const char *kernel_path,
       if (layout->start_address == (Elf_Addr) -1)
 	grub_util_error ("start symbol is not defined");
 
+      if (keep_symbols)
+	SUFFIX (collect_symbols) (e, &smd, layout, image_target);
+      if (options->symbol_map_path)
+	SUFFIX (collect_map_symbols) (e, &smd, layout, image_target);
+
       /* Resolve addrs in the virtual address space.  */
       SUFFIX (relocate_addrs) (e, &smd, out_img, layout->tramp_off,
 				   layout->got_off, image_target);
 
+      for (i = 0, s = smd.sections;
+	   i < smd.num_sections;
+	   i++, s = (Elf_Shdr *) ((char *) s + smd.section_entsize))
+	if (smd.reloc_stats[i].nrelocs)
+	  {
+	    struct grub_mkimage_section_stats *st;
+
+	    layout->stats.sections = xrealloc (layout->stats.sections,
+					       (layout->stats.nsections + 1)
+					       * sizeof (layout->stats.sections[0]));
+	    st = &layout->stats.sections[layout->stats.nsections++];
+	    *st = smd.reloc_stats[i];
+	    st->name = xstrdup (smd.strtab + grub_target_to_host32 (s->sh_name));
+	  }
+      layout->stats.tramp_size = smd.slots->tramp_size;
+      layout->stats.got_size = smd.slots->got_size;
+
       make_reloc_section (e, layout, &smd, image_target);
+      if (!keep_symbols)
+	{
+	  free (layout->fixups);
+	  layout->fixups = NULL;
+	  layout->nfixups = 0;
+	}
       if (image_target->id != IMAGE_EFI)
 	{
 	  out_img = xrealloc (out_img, layout->kernel_size + total_module_size
@@ -2102,15 +3508,879 @@ SUFFIX (grub_mkimage_load_image) (const char *kernel_path,
 		  grub_host_to_target_addr (s->sh_size));
 	else
 	  memcpy (out_img + smd.addrs[i],
-		  kernel_img + grub_host_to_target_addr (s->sh_offset),
+		  smd.contents[i] ? : kernel_img + grub_host_to_target_addr (s->sh_offset),
 		  grub_host_to_target_addr (s->sh_size));
       }
   free (kernel_img);
 
+  for (i = 0; i < smd.num_sections; i++)
+    free (smd.contents[i]);
+  free (smd.contents);
+  smd.contents = NULL;
+  free (smd.reloc_stats);
+  smd.reloc_stats = NULL;
+
   free (smd.vaddrs);
   smd.vaddrs = NULL;
   free (smd.addrs);
   smd.addrs = NULL;
+  reloc_slots_free (smd.slots);
+  smd.slots = NULL;
+  free (smd.order);
+  smd.order = NULL;
 
   return out_img;
 }
+
+/* How a relocation is pre-linked.  */
+enum prelink_kind
+  {
+    PRELINK_NONE,
+    PRELINK_ABS32,
+    PRELINK_ABS64,
+    PRELINK_PC32,
+    PRELINK_PC64,
+    PRELINK_UNSUPPORTED
+  };
+
+static enum prelink_kind
+SUFFIX (prelink_kind) (Elf_Addr info,
+		       const struct grub_install_image_target_desc *image_target)
+{
+  switch (image_target->elf_target)
+    {
+    case EM_386:
+      switch (ELF_R_TYPE (info))
+	{
+	case R_386_NONE:
+	  return PRELINK_NONE;
+	case R_386_32:
+	  return PRELINK_ABS32;
+	case R_386_PC32:
+	case R_386_PLT32:
+	  return PRELINK_PC32;
+	}
+      break;
+#ifdef MKIMAGE_ELF64
+    case EM_X86_64:
+      switch (ELF_R_TYPE (info))
+	{
+	case R_X86_64_NONE:
+	  return PRELINK_NONE;
+	case R_X86_64_64:
+	  return PRELINK_ABS64;
+	case R_X86_64_PC32:
+	case R_X86_64_PLT32:
+	  return PRELINK_PC32;
+	case R_X86_64_PC64:
+	  return PRELINK_PC64;
+	  /* R_X86_64_32(S) cannot be described by a PE fixup.  */
+	}
+      break;
+#endif
+    }
+
+  return PRELINK_UNSUPPORTED;
+}
+
+/* Return the section headers of the module E of SIZE bytes, or NULL if it
+   is not an object file the pre-linker knows about.  */
+static Elf_Shdr *
+SUFFIX (prelink_sections) (Elf_Ehdr *e, size_t size,
+			   const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Off section_offset;
+
+  if (!SUFFIX (check_elf_header) (e, size, image_target)
+      || grub_target_to_host16 (e->e_type) != ET_REL
+      || grub_target_to_host16 (e->e_machine) != image_target->elf_target
+      || grub_target_to_host16 (e->e_shentsize) < sizeof (Elf_Shdr))
+    return NULL;
+
+  section_offset = grub_target_to_host (e->e_shoff);
+  if (size < section_offset
+      || (size - section_offset) / grub_target_to_host16 (e->e_shentsize)
+	 < grub_target_to_host16 (e->e_shnum))
+    return NULL;
+
+  return (Elf_Shdr *) ((char *) e + section_offset);
+}
+
+/* Place the sections of the module E of SIZE bytes for it to be used in
+   place: those with contents stay where they are in the file, the others
+   go after it.  OFFS gets the offset of every section.  Return the size
+   of the module, or 0 if its sections cannot be used in place.  */
+static Elf_Addr
+SUFFIX (prelink_layout) (Elf_Ehdr *e, Elf_Shdr *sections, size_t size,
+			 Elf_Addr *offs,
+			 const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Half num_sections = grub_target_to_host16 (e->e_shnum);
+  Elf_Half entsize = grub_target_to_host16 (e->e_shentsize);
+  Elf_Addr end = size;
+  Elf_Shdr *s;
+  Elf_Half i;
+
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Addr align = grub_target_to_host (s->sh_addralign) ? : 1;
+      Elf_Addr sec_size = grub_target_to_host (s->sh_size);
+
+      offs[i] = 0;
+      if (!(grub_target_to_host (s->sh_flags) & SHF_ALLOC))
+	continue;
+      if (align > GRUB_MKIMAGE_MODULE_ALIGN || (align & (align - 1)))
+	return 0;
+
+      if (grub_target_to_host32 (s->sh_type) == SHT_NOBITS)
+	{
+	  end = ALIGN_UP (end, align);
+	  offs[i] = end;
+	  end += sec_size;
+	}
+      else
+	{
+	  offs[i] = grub_target_to_host (s->sh_offset);
+	  if (offs[i] & (align - 1) || offs[i] > size
+	      || sec_size > size - offs[i])
+	    return 0;
+	}
+    }
+
+  return end;
+}
+
+/* Return the symbol table of the module E, or NULL.  */
+static Elf_Shdr *
+SUFFIX (prelink_symtab) (Elf_Ehdr *e, Elf_Shdr *sections, size_t size,
+			 const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Half num_sections = grub_target_to_host16 (e->e_shnum);
+  Elf_Half entsize = grub_target_to_host16 (e->e_shentsize);
+  Elf_Shdr *s, *strtab;
+  Elf_Half i;
+
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    if (grub_target_to_host32 (s->sh_type) == SHT_SYMTAB)
+      break;
+  if (i == num_sections
+      || grub_target_to_host (s->sh_entsize) < sizeof (Elf_Sym)
+      || grub_target_to_host32 (s->sh_link) >= num_sections
+      || grub_target_to_host (s->sh_offset) > size
+      || grub_target_to_host (s->sh_size)
+	 > size - grub_target_to_host (s->sh_offset))
+    return NULL;
+
+  strtab = (Elf_Shdr *) ((char *) sections
+			 + grub_target_to_host32 (s->sh_link) * entsize);
+  if (grub_target_to_host (strtab->sh_offset) > size
+      || grub_target_to_host (strtab->sh_size)
+	 > size - grub_target_to_host (strtab->sh_offset))
+    return NULL;
+
+  return s;
+}
+
+/* Fill INFO with the symbols the module MOD_IMG defines, at the offsets
+   OFFS of their sections if not NULL and at 0 otherwise, and with those
+   it needs.  */
+static void
+SUFFIX (module_symbols) (char *mod_img, Elf_Shdr *sections, Elf_Shdr *symtab,
+			 const Elf_Addr *offs,
+			 struct grub_mkimage_prelink_info *info,
+			 const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Ehdr *e = (Elf_Ehdr *) mod_img;
+  Elf_Half num_sections = grub_target_to_host16 (e->e_shnum);
+  Elf_Half entsize = grub_target_to_host16 (e->e_shentsize);
+  Elf_Word num_syms, sym_size, j;
+  const char *strtab;
+  Elf_Sym *sym;
+
+  sym_size = grub_target_to_host (symtab->sh_entsize);
+  num_syms = grub_target_to_host (symtab->sh_size) / sym_size;
+  strtab = mod_img + grub_target_to_host (((Elf_Shdr *) ((char *) sections
+							  + grub_target_to_host32 (symtab->sh_link)
+							  * entsize))->sh_offset);
+
+  info->defs = xcalloc (num_syms ? : 1, sizeof (info->defs[0]));
+  info->undefs = xcalloc (num_syms ? : 1, sizeof (info->undefs[0]));
+
+  for (j = 0, sym = (Elf_Sym *) (mod_img + grub_target_to_host (symtab->sh_offset));
+       j < num_syms;
+       j++, sym = (Elf_Sym *) ((char *) sym + sym_size))
+    {
+      Elf_Section sym_index = grub_target_to_host16 (sym->st_shndx);
+      const char *sym_name = strtab + grub_target_to_host32 (sym->st_name);
+
+      if (!sym->st_name)
+	continue;
+
+      if (sym_index == STN_UNDEF)
+	info->undefs[info->nundefs++] = xstrdup (sym_name);
+      else if ((ELF_ST_BIND (sym->st_info) == STB_GLOBAL
+		|| ELF_ST_BIND (sym->st_info) == STB_WEAK)
+	       && sym_index < num_sections
+	       && (grub_target_to_host (((Elf_Shdr *) ((char *) sections
+						       + sym_index * entsize))->sh_flags)
+		   & SHF_ALLOC))
+	{
+	  info->defs[info->ndefs].name = xstrdup (sym_name);
+	  info->defs[info->ndefs].addr = offs ? offs[sym_index]
+	    + grub_target_to_host (sym->st_value) : 0;
+	  info->ndefs++;
+	}
+    }
+}
+
+/* Fill INFO with the symbols the module MOD_IMG of MOD_SIZE bytes defines
+   and those it needs.  Return 0 if it is not an object file for this
+   target.  */
+int
+SUFFIX (grub_mkimage_module_symbols) (char *mod_img, size_t mod_size,
+				      struct grub_mkimage_prelink_info *info,
+				      const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Ehdr *e = (Elf_Ehdr *) mod_img;
+  Elf_Shdr *sections, *symtab;
+
+  grub_memset (info, 0, sizeof (*info));
+
+  sections = SUFFIX (prelink_sections) (e, mod_size, image_target);
+  if (!sections)
+    return 0;
+  symtab = SUFFIX (prelink_symtab) (e, sections, mod_size, image_target);
+  if (symtab)
+    SUFFIX (module_symbols) (mod_img, sections, symtab, NULL, info,
+			     image_target);
+  return 1;
+}
+
+/* Find out whether the module MOD_IMG of MOD_SIZE bytes can be pre-linked
+   and, if so, fill INFO with its size and symbols.  */
+int
+SUFFIX (grub_mkimage_prelink_scan) (char *mod_img, size_t mod_size,
+				    const char *name,
+				    struct grub_mkimage_prelink_info *info,
+				    const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Ehdr *e = (Elf_Ehdr *) mod_img;
+  Elf_Shdr *sections, *symtab, *s;
+  Elf_Half num_sections, entsize, i;
+  Elf_Word num_syms, sym_size, j;
+  Elf_Addr *offs;
+  Elf_Sym *syms, *sym;
+
+  grub_memset (info, 0, sizeof (*info));
+
+  sections = SUFFIX (prelink_sections) (e, mod_size, image_target);
+  if (!sections)
+    {
+      grub_util_info ("%s is not an object file for this target, not pre-linking it",
+		      name);
+      return 0;
+    }
+  num_sections = grub_target_to_host16 (e->e_shnum);
+  entsize = grub_target_to_host16 (e->e_shentsize);
+
+  symtab = SUFFIX (prelink_symtab) (e, sections, mod_size, image_target);
+  if (!symtab)
+    {
+      grub_util_info ("%s has no symbol table, not pre-linking it", name);
+      return 0;
+    }
+
+  offs = xcalloc (num_sections, sizeof (offs[0]));
+  info->size = SUFFIX (prelink_layout) (e, sections, mod_size, offs,
+					image_target);
+  if (!info->size)
+    {
+      grub_util_info ("the sections of %s cannot be used in place, not pre-linking it",
+		      name);
+      free (offs);
+      return 0;
+    }
+
+  sym_size = grub_target_to_host (symtab->sh_entsize);
+  num_syms = grub_target_to_host (symtab->sh_size) / sym_size;
+  syms = (Elf_Sym *) (mod_img + grub_target_to_host (symtab->sh_offset));
+
+  /* Common symbols are allocated by the loader, and a PC-relative
+     reference to an absolute symbol changes with the load address.  */
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Word target_index = grub_target_to_host32 (s->sh_info);
+      Elf_Word r_size, num_rs;
+      Elf_Rel *r;
+
+      if ((grub_target_to_host32 (s->sh_type) != SHT_REL
+	   && grub_target_to_host32 (s->sh_type) != SHT_RELA)
+	  || target_index >= num_sections
+	  || !(grub_target_to_host (((Elf_Shdr *) ((char *) sections
+						   + target_index * entsize))->sh_flags)
+	       & SHF_ALLOC))
+	continue;
+
+      r_size = grub_target_to_host (s->sh_entsize);
+      if (r_size < sizeof (Elf_Rel)
+	  || grub_target_to_host (s->sh_offset) > mod_size
+	  || grub_target_to_host (s->sh_size)
+	     > mod_size - grub_target_to_host (s->sh_offset))
+	goto fail;
+      num_rs = grub_target_to_host (s->sh_size) / r_size;
+
+      for (j = 0, r = (Elf_Rel *) (mod_img + grub_target_to_host (s->sh_offset));
+	   j < num_rs;
+	   j++, r = (Elf_Rel *) ((char *) r + r_size))
+	{
+	  Elf_Addr r_info = grub_target_to_host (r->r_info);
+	  enum prelink_kind kind = SUFFIX (prelink_kind) (r_info, image_target);
+	  Elf_Section sym_index;
+
+	  if (kind == PRELINK_UNSUPPORTED)
+	    {
+	      grub_util_info ("relocation 0x%x in %s is not pre-linked, not pre-linking it",
+			      (unsigned int) ELF_R_TYPE (r_info), name);
+	      goto fail;
+	    }
+	  if (ELF_R_SYM (r_info) >= num_syms)
+	    goto fail;
+	  sym = (Elf_Sym *) ((char *) syms + ELF_R_SYM (r_info) * sym_size);
+	  sym_index = grub_target_to_host16 (sym->st_shndx);
+	  if (sym_index == SHN_COMMON
+	      || ((kind == PRELINK_PC32 || kind == PRELINK_PC64)
+		  && (sym_index == STN_ABS || ELF_R_SYM (r_info) == 0)))
+	    {
+	      grub_util_info ("%s refers to a common or absolute symbol, not pre-linking it",
+			      name);
+	      goto fail;
+	    }
+	}
+    }
+
+  SUFFIX (module_symbols) (mod_img, sections, symtab, offs, info,
+			   image_target);
+
+  free (offs);
+  return 1;
+
+ fail:
+  free (offs);
+  return 0;
+}
+
+/* Pre-link the module MOD_IMG of MOD_SIZE bytes, scanned by
+   grub_mkimage_prelink_scan, for it to run at BASE: resolve its undefined
+   symbols in SYMBOLS, apply its relocations and add the fixups for its
+   absolute ones to LAYOUT.  Its sections get their offsets in the module
+   as addresses.  */
+void
+SUFFIX (grub_mkimage_prelink) (char *mod_img, size_t mod_size,
+			       grub_uint64_t base,
+			       const struct grub_mkimage_symbol *symbols,
+			       size_t nsymbols,
+			       struct grub_mkimage_layout *layout,
+			       const struct grub_install_image_target_desc *image_target)
+{
+  Elf_Ehdr *e = (Elf_Ehdr *) mod_img;
+  Elf_Shdr *sections, *symtab, *s;
+  Elf_Half num_sections, entsize, i;
+  Elf_Word sym_size;
+  const char *strtab;
+  Elf_Addr *offs;
+  struct translate_context ctx;
+
+  sections = SUFFIX (prelink_sections) (e, mod_size, image_target);
+  symtab = SUFFIX (prelink_symtab) (e, sections, mod_size, image_target);
+  num_sections = grub_target_to_host16 (e->e_shnum);
+  entsize = grub_target_to_host16 (e->e_shentsize);
+  sym_size = grub_target_to_host (symtab->sh_entsize);
+  strtab = mod_img + grub_target_to_host (((Elf_Shdr *) ((char *) sections
+							  + grub_target_to_host32 (symtab->sh_link)
+							  * entsize))->sh_offset);
+
+  offs = xcalloc (num_sections, sizeof (offs[0]));
+  SUFFIX (prelink_layout) (e, sections, mod_size, offs, image_target);
+
+  translate_reloc_start (&ctx);
+  ctx.fixups = layout->fixups;
+  ctx.nfixups = ctx.fixups_max = layout->nfixups;
+
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    if (grub_target_to_host (s->sh_flags) & SHF_ALLOC)
+      s->sh_addr = grub_host_to_target_addr (offs[i]);
+
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Word target_index = grub_target_to_host32 (s->sh_info);
+      int rela = grub_target_to_host32 (s->sh_type) == SHT_RELA;
+      Elf_Word r_size, num_rs, j;
+      Elf_Rela *r;
+
+      if ((grub_target_to_host32 (s->sh_type) != SHT_REL && !rela)
+	  || target_index >= num_sections
+	  || !(grub_target_to_host (((Elf_Shdr *) ((char *) sections
+						   + target_index * entsize))->sh_flags)
+	       & SHF_ALLOC))
+	continue;
+
+      r_size = grub_target_to_host (s->sh_entsize);
+      num_rs = grub_target_to_host (s->sh_size) / r_size;
+
+      for (j = 0, r = (Elf_Rela *) (mod_img + grub_target_to_host (s->sh_offset));
+	   j < num_rs;
+	   j++, r = (Elf_Rela *) ((char *) r + r_size))
+	{
+	  Elf_Addr info = grub_target_to_host (r->r_info);
+	  Elf_Addr offset = grub_target_to_host (r->r_offset);
+	  Elf_Sym *sym = (Elf_Sym *) (mod_img
+				      + grub_target_to_host (symtab->sh_offset)
+				      + ELF_R_SYM (info) * sym_size);
+	  Elf_Section sym_index = grub_target_to_host16 (sym->st_shndx);
+	  char *target = mod_img + offs[target_index] + offset;
+	  grub_uint64_t addr = base + offs[target_index] + offset;
+	  grub_uint64_t sym_addr, addend;
+	  int absolute = 0;
+
+	  addend = rela ? (grub_uint64_t) grub_target_to_host (r->r_addend) : 0;
+
+	  if (ELF_R_SYM (info) == 0 || sym_index == STN_ABS)
+	    {
+	      sym_addr = grub_target_to_host (sym->st_value);
+	      absolute = 1;
+	    }
+	  else if (sym_index == STN_UNDEF)
+	    {
+	      const char *name = strtab + grub_target_to_host32 (sym->st_name);
+	      const struct grub_mkimage_symbol *def;
+
+	      def = grub_mkimage_find_symbol (symbols, nsymbols, name);
+	      if (!def)
+		grub_util_error ("undefined symbol %s", name);
+	      sym_addr = def->addr;
+	    }
+	  else
+	    sym_addr = base + offs[sym_index] + grub_target_to_host (sym->st_value);
+
+	  switch (SUFFIX (prelink_kind) (info, image_target))
+	    {
+	    case PRELINK_NONE:
+	    case PRELINK_UNSUPPORTED:
+	      break;
+
+	    case PRELINK_ABS32:
+	      *(grub_uint32_t *) target
+		= grub_host_to_target32 (grub_target_to_host32 (*(grub_uint32_t *) target)
+					 + addend + sym_addr);
+	      if (!absolute)
+		add_fixup_entry (&ctx, GRUB_PE32_REL_BASED_HIGHLOW, addr);
+	      break;
+
+	    case PRELINK_ABS64:
+	      *(grub_uint64_t *) target
+		= grub_host_to_target64 (grub_target_to_host64 (*(grub_uint64_t *) target)
+					 + addend + sym_addr);
+	      if (!absolute)
+		add_fixup_entry (&ctx, GRUB_PE32_REL_BASED_DIR64, addr);
+	      break;
+
+	    case PRELINK_PC32:
+	      {
+		grub_int64_t value = (grub_int32_t) grub_target_to_host32 (*(grub_uint32_t *) target)
+		  + addend + sym_addr - addr;
+
+		if (value != (grub_int32_t) value)
+		  grub_util_error ("relocation 0x%x at 0x%" GRUB_HOST_PRIxLONG_LONG
+				   " is out of range",
+				   (unsigned int) ELF_R_TYPE (info),
+				   (unsigned long long) addr);
+		*(grub_uint32_t *) target = grub_host_to_target32 (value);
+	      }
+	      break;
+
+	    case PRELINK_PC64:
+	      *(grub_uint64_t *) target
+		= grub_host_to_target64 (grub_target_to_host64 (*(grub_uint64_t *) target)
+					 + addend + sym_addr - addr);
+	      break;
+	    }
+	}
+    }
+
+  layout->fixups = ctx.fixups;
+  layout->nfixups = ctx.nfixups;
+  free (offs);
+}
+
+/* Rebuild .reloc from the fixups in LAYOUT, once those of the pre-linked
+   modules are in.  */
+void
+SUFFIX (grub_mkimage_make_pe_relocs) (struct grub_mkimage_layout *layout,
+				      const struct grub_install_image_target_desc *image_target)
+{
+  struct translate_context ctx;
+
+  translate_reloc_start (&ctx);
+  ctx.fixups = layout->fixups;
+  ctx.nfixups = ctx.fixups_max = layout->nfixups;
+
+  free (layout->reloc_section);
+  finish_reloc_translation_pe (&ctx, layout, image_target);
+}
+
+/* Sections the module loader looks up by name, whether they are loaded
+   or not.  */
+static const char *const module_metadata_sections[] =
+  {
+    ".modname",
+    ".moddeps",
+    ".module_license",
+  };
+
+struct strip_strtab
+{
+  char *buf;
+  grub_size_t len, max;
+};
+
+/* Append STR to TAB and return its offset in it.  */
+static grub_uint32_t
+strip_add_string (struct strip_strtab *tab, const char *str)
+{
+  grub_size_t len = strlen (str) + 1;
+  grub_uint32_t offset;
+
+  if (!*str)
+    return 0;
+  if (tab->len + len > tab->max)
+    {
+      tab->max = 2 * (tab->len + len);
+      tab->buf = xrealloc (tab->buf, tab->max);
+    }
+  offset = tab->len;
+  memcpy (tab->buf + offset, str, len);
+  tab->len += len;
+  return offset;
+}
+
+/* Rebuild the module MOD_IMG of MOD_SIZE bytes with only what the loader
+   uses: the allocatable and metadata sections, the relocations applying
+   to them, and the global symbols and those relocations refer to.
+   Return the new module and its size in STRIPPED_SIZE, or NULL if it is
+   not an object file for this target or would not get any smaller.  */
+char *
+SUFFIX (grub_mkimage_strip_module) (const char *mod_img, size_t mod_size,
+				    size_t *stripped_size,
+				    const struct grub_install_image_target_desc *image_target)
+{
+  const Elf_Ehdr *e = (const Elf_Ehdr *) mod_img;
+  Elf_Shdr *sections, *symtab, *s, *out_shdrs;
+  Elf_Half num_sections, entsize, shstrndx, num_kept = 0, i;
+  Elf_Word num_syms = 0, sym_size = 0, num_kept_syms = 0, first_global = 0, j;
+  Elf_Word symtab_index = 0, strtab_index = 0;
+  grub_uint8_t *keep_section;
+  Elf_Half *new_section;
+  Elf_Word *new_sym = NULL;
+  const char *shstrtab, *strtab = NULL;
+  const Elf_Sym *syms = NULL, *sym;
+  struct strip_strtab names = { NULL, 0, 0 }, sym_names = { NULL, 0, 0 };
+  grub_uint32_t *sh_names;
+  Elf_Sym *out_syms = NULL;
+  char *out = NULL;
+  Elf_Ehdr *out_e;
+  Elf_Off offset, shoff;
+
+  sections = SUFFIX (prelink_sections) ((Elf_Ehdr *) e, mod_size, image_target);
+  if (!sections)
+    return NULL;
+  num_sections = grub_target_to_host16 (e->e_shnum);
+  entsize = grub_target_to_host16 (e->e_shentsize);
+  shstrndx = grub_target_to_host16 (e->e_shstrndx);
+  if (shstrndx == SHN_UNDEF || shstrndx >= num_sections)
+    return NULL;
+
+  /* Every section but those without contents has to be in the file.  */
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    if (grub_target_to_host32 (s->sh_type) != SHT_NOBITS
+	&& (grub_target_to_host (s->sh_offset) > mod_size
+	    || grub_target_to_host (s->sh_size)
+	       > mod_size - grub_target_to_host (s->sh_offset)))
+      return NULL;
+
+#define SECTION(i) ((Elf_Shdr *) ((char *) sections + (i) * entsize))
+
+  shstrtab = mod_img + grub_target_to_host (SECTION (shstrndx)->sh_offset);
+  keep_section = xcalloc (num_sections, sizeof (keep_section[0]));
+  new_section = xcalloc (num_sections, sizeof (new_section[0]));
+  sh_names = xcalloc (num_sections, sizeof (sh_names[0]));
+
+  keep_section[0] = 1;
+  keep_section[shstrndx] = 1;
+  for (i = 1, s = SECTION (1); i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      const char *name = shstrtab + grub_target_to_host32 (s->sh_name);
+      unsigned k;
+
+      if (grub_target_to_host32 (s->sh_name)
+	  >= grub_target_to_host (SECTION (shstrndx)->sh_size))
+	goto fail;
+      if (grub_target_to_host (s->sh_flags) & SHF_ALLOC)
+	keep_section[i] = 1;
+      for (k = 0; k < ARRAY_SIZE (module_metadata_sections); k++)
+	if (strcmp (name, module_metadata_sections[k]) == 0)
+	  keep_section[i] = 1;
+    }
+
+  symtab = SUFFIX (prelink_symtab) ((Elf_Ehdr *) e, sections, mod_size,
+				    image_target);
+  if (symtab)
+    {
+      symtab_index = ((char *) symtab - (char *) sections) / entsize;
+      strtab_index = grub_target_to_host32 (symtab->sh_link);
+      keep_section[symtab_index] = 1;
+      keep_section[strtab_index] = 1;
+      strtab = mod_img + grub_target_to_host (SECTION (strtab_index)->sh_offset);
+      sym_size = grub_target_to_host (symtab->sh_entsize);
+      num_syms = grub_target_to_host (symtab->sh_size) / sym_size;
+      syms = (const Elf_Sym *) (mod_img + grub_target_to_host (symtab->sh_offset));
+      new_sym = xcalloc (num_syms ? : 1, sizeof (new_sym[0]));
+
+      /* Mark the symbols to keep with 1 for now: the global ones, which
+	 the module exports or needs, and those relocations refer to.  */
+      for (j = 0, sym = syms; j < num_syms;
+	   j++, sym = (const Elf_Sym *) ((const char *) sym + sym_size))
+	if (j == 0 || ELF_ST_BIND (sym->st_info) != STB_LOCAL)
+	  new_sym[j] = 1;
+    }
+
+  for (i = 1, s = SECTION (1); i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Word target_index = grub_target_to_host32 (s->sh_info);
+      Elf_Word r_size, num_rs;
+      const Elf_Rel *r;
+
+      if (grub_target_to_host32 (s->sh_type) != SHT_REL
+	  && grub_target_to_host32 (s->sh_type) != SHT_RELA)
+	continue;
+      /* Relocations for sections which are not loaded are never
+	 applied.  */
+      if (target_index >= num_sections || !keep_section[target_index]
+	  || !(grub_target_to_host (SECTION (target_index)->sh_flags) & SHF_ALLOC))
+	continue;
+      if (!symtab || grub_target_to_host32 (s->sh_link) != symtab_index)
+	goto fail;
+
+      r_size = grub_target_to_host (s->sh_entsize);
+      if (r_size < sizeof (Elf_Rel))
+	goto fail;
+      num_rs = grub_target_to_host (s->sh_size) / r_size;
+      for (j = 0, r = (const Elf_Rel *) (mod_img + grub_target_to_host (s->sh_offset));
+	   j < num_rs;
+	   j++, r = (const Elf_Rel *) ((const char *) r + r_size))
+	{
+	  Elf_Addr r_info = grub_target_to_host (r->r_info);
+
+	  if (ELF_R_SYM (r_info) >= num_syms)
+	    goto fail;
+	  new_sym[ELF_R_SYM (r_info)] = 1;
+	}
+      keep_section[i] = 1;
+    }
+
+  /* A section a kept symbol is defined in stays too, so that the symbol
+     keeps its meaning.  */
+  for (j = 0, sym = syms; j < num_syms;
+       j++, sym = (const Elf_Sym *) ((const char *) sym + sym_size))
+    {
+      Elf_Section sym_index = grub_target_to_host16 (sym->st_shndx);
+
+      if (new_sym[j] && sym_index != SHN_UNDEF && sym_index < SHN_LORESERVE)
+	{
+	  if (sym_index >= num_sections)
+	    goto fail;
+	  keep_section[sym_index] = 1;
+	}
+    }
+
+  for (i = 0; i < num_sections; i++)
+    if (keep_section[i])
+      new_section[i] = num_kept++;
+
+  /* The string tables only get the names still in use.  When the section
+     names and the symbol names share a table, so do the new ones.  */
+  names.buf = xmalloc (1);
+  names.buf[0] = '\0';
+  names.len = names.max = 1;
+  for (i = 0, s = sections; i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    if (keep_section[i])
+      sh_names[i] = strip_add_string (&names,
+				      shstrtab + grub_target_to_host32 (s->sh_name));
+
+  if (symtab)
+    {
+      struct strip_strtab *tab = &sym_names;
+      Elf_Word sym_local = grub_target_to_host32 (symtab->sh_info);
+      Elf_Addr strtab_size = grub_target_to_host (SECTION (strtab_index)->sh_size);
+
+      if (strtab_index == shstrndx)
+	tab = &names;
+      else
+	{
+	  sym_names.buf = xmalloc (1);
+	  sym_names.buf[0] = '\0';
+	  sym_names.len = sym_names.max = 1;
+	}
+
+      out_syms = xcalloc (num_syms ? : 1, sizeof (out_syms[0]));
+      for (j = 0, sym = syms; j < num_syms;
+	   j++, sym = (const Elf_Sym *) ((const char *) sym + sym_size))
+	{
+	  Elf_Section sym_index = grub_target_to_host16 (sym->st_shndx);
+	  Elf_Sym *o;
+
+	  if (!new_sym[j])
+	    continue;
+	  if (grub_target_to_host32 (sym->st_name) >= strtab_size)
+	    goto fail;
+
+	  if (j < sym_local)
+	    first_global = num_kept_syms + 1;
+	  new_sym[j] = num_kept_syms;
+	  o = &out_syms[num_kept_syms++];
+	  *o = *sym;
+	  o->st_name = grub_host_to_target32 (strip_add_string (tab,
+								strtab
+								+ grub_target_to_host32 (sym->st_name)));
+	  if (sym_index != SHN_UNDEF && sym_index < SHN_LORESERVE)
+	    o->st_shndx = grub_host_to_target16 (new_section[sym_index]);
+	}
+    }
+
+  /* The contents first, each at its alignment, then the section headers.
+     Sections without contents take no room.  */
+  offset = sizeof (Elf_Ehdr);
+  for (i = 1, s = SECTION (1); i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Addr align = grub_target_to_host (s->sh_addralign) ? : 1;
+      Elf_Addr size = grub_target_to_host (s->sh_size);
+
+      if (!keep_section[i])
+	continue;
+      if (i == shstrndx)
+	size = names.len;
+      else if (i == strtab_index && symtab)
+	size = sym_names.len;
+      else if (i == symtab_index && symtab)
+	size = (Elf_Addr) num_kept_syms * sizeof (Elf_Sym);
+      if (grub_target_to_host32 (s->sh_type) != SHT_NOBITS)
+	offset = ALIGN_UP (offset, align) + size;
+    }
+  shoff = ALIGN_UP (offset, sizeof (Elf_Addr));
+  *stripped_size = shoff + (Elf_Off) num_kept * sizeof (Elf_Shdr);
+  if (*stripped_size >= mod_size)
+    goto fail;
+
+  out = xcalloc (1, *stripped_size);
+  out_e = (Elf_Ehdr *) out;
+  *out_e = *e;
+  out_e->e_phoff = 0;
+  out_e->e_phnum = 0;
+  out_e->e_phentsize = 0;
+  out_e->e_shoff = grub_host_to_target_addr (shoff);
+  out_e->e_shentsize = grub_host_to_target16 (sizeof (Elf_Shdr));
+  out_e->e_shnum = grub_host_to_target16 (num_kept);
+  out_e->e_shstrndx = grub_host_to_target16 (new_section[shstrndx]);
+  out_shdrs = (Elf_Shdr *) (out + shoff);
+
+  offset = sizeof (Elf_Ehdr);
+  for (i = 1, s = SECTION (1); i < num_sections;
+       i++, s = (Elf_Shdr *) ((char *) s + entsize))
+    {
+      Elf_Addr align = grub_target_to_host (s->sh_addralign) ? : 1;
+      Elf_Word type = grub_target_to_host32 (s->sh_type);
+      Elf_Word link = grub_target_to_host32 (s->sh_link);
+      Elf_Word info = grub_target_to_host32 (s->sh_info);
+      Elf_Shdr *o = &out_shdrs[new_section[i]];
+      const char *contents = mod_img + grub_target_to_host (s->sh_offset);
+      Elf_Addr size = grub_target_to_host (s->sh_size);
+
+      if (!keep_section[i])
+	continue;
+
+      *o = *s;
+      o->sh_name = grub_host_to_target32 (sh_names[i]);
+      o->sh_link = grub_host_to_target32 (link < num_sections && keep_section[link]
+					  ? new_section[link] : 0);
+      if (type == SHT_REL || type == SHT_RELA)
+	o->sh_info = grub_host_to_target32 (new_section[info]);
+      else if (type == SHT_SYMTAB)
+	o->sh_info = grub_host_to_target32 (first_global);
+
+      if (i == shstrndx)
+	{
+	  contents = names.buf;
+	  size = names.len;
+	}
+      else if (i == strtab_index && symtab)
+	{
+	  contents = sym_names.buf;
+	  size = sym_names.len;
+	}
+      else if (i == symtab_index && symtab)
+	{
+	  contents = (const char *) out_syms;
+	  size = (Elf_Addr) num_kept_syms * sizeof (Elf_Sym);
+	  o->sh_entsize = grub_host_to_target_addr (sizeof (Elf_Sym));
+	}
+      o->sh_size = grub_host_to_target_addr (size);
+
+      if (type == SHT_NOBITS)
+	{
+	  o->sh_offset = grub_host_to_target_addr (offset);
+	  continue;
+	}
+      offset = ALIGN_UP (offset, align);
+      o->sh_offset = grub_host_to_target_addr (offset);
+      memcpy (out + offset, contents, size);
+
+      /* The symbols the relocations refer to have moved.  */
+      if (type == SHT_REL || type == SHT_RELA)
+	{
+	  Elf_Word r_size = grub_target_to_host (s->sh_entsize);
+	  Elf_Word num_rs = size / r_size;
+	  Elf_Rel *r;
+
+	  for (j = 0, r = (Elf_Rel *) (out + offset); j < num_rs;
+	       j++, r = (Elf_Rel *) ((char *) r + r_size))
+	    {
+	      Elf_Addr r_info = grub_target_to_host (r->r_info);
+
+	      r->r_info = grub_host_to_target_addr (ELF_R_INFO ((Elf_Addr) new_sym[ELF_R_SYM (r_info)],
+								ELF_R_TYPE (r_info)));
+	    }
+	}
+      offset += size;
+    }
+
+#undef SECTION
+
+ fail:
+  free (keep_section);
+  free (new_section);
+  free (sh_names);
+  free (new_sym);
+  free (out_syms);
+  free (names.buf);
+  free (sym_names.buf);
+  return out;
+}
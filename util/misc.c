@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include <grub/kernel.h>
@@ -35,6 +36,10 @@
 #include <grub/mm.h>
 #include <grub/i18n.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #define ENABLE_RELOCATABLE 0
 #ifdef GRUB_BUILD
 const char *program_name = GRUB_BUILD_PROGRAM_NAME;
@@ -71,24 +76,11 @@ char *
 grub_util_read_image (const char *path)
 {
   char *img;
-  FILE *fp;
   size_t size;
 
-  grub_util_info ("reading %s", path);
-
   size = grub_util_get_image_size (path);
-  img = (char *) xmalloc (size);
-
-  fp = grub_util_fopen (path, "rb");
-  if (! fp)
-    grub_util_error (_("cannot open `%s': %s"), path,
-		     strerror (errno));
-
-  if (fread (img, 1, size, fp) != size)
-    grub_util_error (_("cannot read `%s': %s"), path,
-		     strerror (errno));
-
-  fclose (fp);
+  img = (char *) xmalloc (size ? : 1);
+  grub_util_load_image (path, img);
 
   return img;
 }
@@ -108,10 +100,105 @@ grub_util_write_image_at (const void *img, size_t size, off_t offset, FILE *out,
 		     name, strerror (errno));
 }
 
+/* Writes at least this large to a file go through batched I/O.  */
+#define BATCH_WRITE_MIN (4 << 20)
+/* Blocks of this many zeros are not written to a new part of a file,
+   leaving holes.  */
+#define SPARSE_BLOCK_SIZE 4096
+
+static int
+is_zero (const char *buf, size_t size)
+{
+  return buf[0] == 0 && memcmp (buf, buf + 1, size - 1) == 0;
+}
+
+/* Write the SIZE bytes of IMG at POS in OUT.  */
+static void
+write_run (const char *img, size_t size, FILE *out, off_t pos,
+	   const char *name)
+{
+  if (size >= BATCH_WRITE_MIN && fflush (out) == 0
+      && grub_util_batch_write (fileno (out), img, size, pos, name) == 0)
+    {
+      if (fseeko (out, pos + size, SEEK_SET) == -1)
+	grub_util_error (_("cannot seek `%s': %s"), name, strerror (errno));
+      return;
+    }
+
+  if (fseeko (out, pos, SEEK_SET) == -1)
+    grub_util_error (_("cannot seek `%s': %s"), name, strerror (errno));
+  if (fwrite (img, 1, size, out) != size)
+    grub_util_error (_("cannot write to `%s': %s"), name, strerror (errno));
+}
+
+/* Write the SIZE bytes of IMG at POS in OUT, which ends there, skipping
+   the blocks of zeros.  */
+static void
+write_sparse (const char *img, size_t size, FILE *out, off_t pos,
+	      const char *name)
+{
+  size_t start = 0, end, next;
+  struct stat st;
+
+  grub_util_info ("writing 0x%" GRUB_HOST_PRIxLONG_LONG " bytes, leaving holes",
+		  (unsigned long long) size);
+
+  while (start < size)
+    {
+      /* The blocks are aligned in the file, as its holes are.  */
+      end = start + SPARSE_BLOCK_SIZE - (pos + start) % SPARSE_BLOCK_SIZE;
+      if (end > size)
+	end = size;
+      if (is_zero (img + start, end - start))
+	{
+	  start = end;
+	  continue;
+	}
+
+      for (; end < size; end = next)
+	{
+	  next = end + SPARSE_BLOCK_SIZE < size ? end + SPARSE_BLOCK_SIZE : size;
+	  if (is_zero (img + end, next - end))
+	    break;
+	}
+      write_run (img + start, end - start, out, pos + start, name);
+      start = end;
+    }
+
+  /* Skipping zeros at the end does not make the file any longer.  */
+  if (fflush (out) != 0 || fstat (fileno (out), &st) < 0)
+    grub_util_error (_("cannot write to `%s': %s"), name, strerror (errno));
+  if (st.st_size < pos + (off_t) size
+      && ftruncate (fileno (out), pos + size) < 0)
+    grub_util_error (_("cannot write to `%s': %s"), name, strerror (errno));
+  if (fseeko (out, pos + size, SEEK_SET) == -1)
+    grub_util_error (_("cannot seek `%s': %s"), name, strerror (errno));
+}
+
 void
 grub_util_write_image (const char *img, size_t size, FILE *out,
 		       const char *name)
 {
+  struct stat st;
+  off_t pos;
+
+  if (name && fflush (out) == 0 && (pos = ftello (out)) >= 0)
+    {
+      /* Only what is past the end of a regular file can be left as
+	 holes: anywhere else, the zeros have to overwrite what is there.  */
+      if (size >= SPARSE_BLOCK_SIZE && fstat (fileno (out), &st) == 0
+	  && S_ISREG (st.st_mode) && st.st_size <= pos)
+	{
+	  write_sparse (img, size, out, pos, name);
+	  return;
+	}
+      if (size >= BATCH_WRITE_MIN)
+	{
+	  write_run (img, size, out, pos, name);
+	  return;
+	}
+    }
+
   grub_util_info ("writing 0x%" GRUB_HOST_PRIxLONG_LONG " bytes", (unsigned long long) size);
   if (fwrite (img, 1, size, out) != size)
     {
@@ -124,6 +211,246 @@ grub_util_write_image (const char *img, size_t size, FILE *out,
     }
 }
 
+char *
+grub_util_next_word (char **p)
+{
+  char *word;
+
+  *p += strspn (*p, " \t\r");
+  if (!**p)
+    return NULL;
+
+  word = *p;
+  *p += strcspn (*p, " \t\r");
+  if (**p)
+    *(*p)++ = '\0';
+  return word;
+}
+
+/* The number of worker threads to use, 0 meaning one per online CPU.  */
+int grub_util_jobs;
+
+unsigned
+grub_util_get_jobs (void)
+{
+  long n = grub_util_jobs;
+
+#if defined (HAVE_PTHREAD) && defined (_SC_NPROCESSORS_ONLN)
+  if (n <= 0)
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (n <= 0)
+    n = 1;
+#ifndef HAVE_PTHREAD
+  n = 1;
+#endif
+
+  return n;
+}
+
+#ifdef HAVE_PTHREAD
+struct task_queue
+{
+  void (*fn) (void *data, grub_size_t i);
+  void *data;
+  grub_size_t n, next;
+  pthread_mutex_t lock;
+};
+
+/* Set while running a task.  Tasks started from a task run in its
+   thread, so that nested parallel work does not multiply the number of
+   threads.  */
+static __thread int in_task;
+
+static void *
+task_worker (void *arg)
+{
+  struct task_queue *q = arg;
+  int saved_in_task = in_task;
+
+  in_task = 1;
+  while (1)
+    {
+      grub_size_t i;
+
+      pthread_mutex_lock (&q->lock);
+      i = q->next++;
+      pthread_mutex_unlock (&q->lock);
+      if (i >= q->n)
+	break;
+      q->fn (q->data, i);
+    }
+  in_task = saved_in_task;
+
+  return NULL;
+}
+#endif
+
+void
+grub_util_run_tasks (grub_size_t n, void (*fn) (void *data, grub_size_t i),
+		     void *data)
+{
+  grub_size_t i;
+#ifdef HAVE_PTHREAD
+  unsigned nthreads = grub_util_get_jobs ();
+
+  /* Info messages from concurrent tasks would interleave, so keep them
+     in order when they are enabled.  */
+  if (verbosity > 0 || in_task)
+    nthreads = 1;
+  if (nthreads > n)
+    nthreads = n;
+
+  if (nthreads > 1)
+    {
+      struct task_queue q;
+      pthread_t *threads;
+      unsigned created;
+
+      q.fn = fn;
+      q.data = data;
+      q.n = n;
+      q.next = 0;
+      pthread_mutex_init (&q.lock, NULL);
+
+      threads = xcalloc (nthreads - 1, sizeof (threads[0]));
+      for (created = 0; created < nthreads - 1; created++)
+	if (pthread_create (&threads[created], NULL, task_worker, &q) != 0)
+	  break;
+
+      /* The calling thread is a worker too, so this completes even if
+	 no thread could be created.  */
+      task_worker (&q);
+
+      while (created--)
+	pthread_join (threads[created], NULL);
+      free (threads);
+      pthread_mutex_destroy (&q.lock);
+      return;
+    }
+#endif
+
+  for (i = 0; i < n; i++)
+    fn (data, i);
+}
+
+struct grub_util_job
+{
+  void (*fn) (void *data);
+  void *data;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  int started;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void *
+job_thread (void *arg)
+{
+  struct grub_util_job *job = arg;
+
+  job->fn (job->data);
+  return NULL;
+}
+#endif
+
+struct grub_util_job *
+grub_util_start_job (void (*fn) (void *data), void *data)
+{
+  struct grub_util_job *job = xmalloc (sizeof (*job));
+
+  job->fn = fn;
+  job->data = data;
+#ifdef HAVE_PTHREAD
+  /* Like the tasks, jobs run in order when info messages are enabled or
+     when there are no spare threads.  */
+  job->started = verbosity <= 0 && !in_task && grub_util_get_jobs () > 1
+    && pthread_create (&job->thread, NULL, job_thread, job) == 0;
+  if (job->started)
+    return job;
+#endif
+
+  fn (data);
+  return job;
+}
+
+void
+grub_util_finish_job (struct grub_util_job *job)
+{
+#ifdef HAVE_PTHREAD
+  if (job->started)
+    pthread_join (job->thread, NULL);
+#endif
+  free (job);
+}
+
+struct load_images_ctx
+{
+  char *const *paths;
+  char *const *bufs;
+};
+
+static void
+load_image_task (void *data, grub_size_t i)
+{
+  struct load_images_ctx *ctx = data;
+
+  grub_util_load_image (ctx->paths[i], ctx->bufs[i]);
+}
+
+void
+grub_util_load_images (grub_size_t n, char *const *paths, char *const *bufs)
+{
+  struct load_images_ctx ctx;
+  char **cached_paths, **cached_bufs, **large_paths, **large_bufs;
+  grub_size_t i, ncached = 0, nlarge = 0;
+
+  if (!grub_util_cache_files)
+    {
+      if (grub_util_batch_load (n, paths, bufs) == 0)
+	return;
+      ctx.paths = paths;
+      ctx.bufs = bufs;
+      grub_util_run_tasks (n, load_image_task, &ctx);
+      return;
+    }
+
+  /* The cached files are shared, and only ever read once, through
+     grub_util_load_image.  Large files are never cached, so they are
+     read the same way as without the cache.  */
+  cached_paths = xcalloc (n, sizeof (cached_paths[0]));
+  cached_bufs = xcalloc (n, sizeof (cached_bufs[0]));
+  large_paths = xcalloc (n, sizeof (large_paths[0]));
+  large_bufs = xcalloc (n, sizeof (large_bufs[0]));
+  for (i = 0; i < n; i++)
+    if (grub_util_get_image_size (paths[i]) >= GRUB_UTIL_LARGE_FILE_SIZE)
+      {
+	large_paths[nlarge] = paths[i];
+	large_bufs[nlarge++] = bufs[i];
+      }
+    else
+      {
+	cached_paths[ncached] = paths[i];
+	cached_bufs[ncached++] = bufs[i];
+      }
+
+  if (nlarge && grub_util_batch_load (nlarge, large_paths, large_bufs) != 0)
+    {
+      ctx.paths = large_paths;
+      ctx.bufs = large_bufs;
+      grub_util_run_tasks (nlarge, load_image_task, &ctx);
+    }
+  ctx.paths = cached_paths;
+  ctx.bufs = cached_bufs;
+  grub_util_run_tasks (ncached, load_image_task, &ctx);
+
+  free (cached_paths);
+  free (cached_bufs);
+  free (large_paths);
+  free (large_bufs);
+}
+
 static void
 grub_xputs_real (const char *str)
 {
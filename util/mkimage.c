@@ -34,12 +34,19 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <assert.h>
 #include <grub/efi/pe32.h>
 #include <grub/arm/reloc.h>
 #include <grub/arm64/reloc.h>
 #include <grub/util/install.h>
 #include <grub/util/mkimage.h>
+#include <grub/util/resolve.h>
+#include <grub/lib/sha256.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define ALIGN_ADDR(x) (ALIGN_UP((x), image_target->voidp_sizeof))
 
@@ -50,18 +57,22 @@
 /* use 2015-01-01T00:00:00+0000 as a stock timestamp */
 #define STABLE_EMBEDDING_TIMESTAMP 1420070400
 
+/* .text, .data, .bss, .got, mods, .modtext, .moddata, .memdisk and
+   .reloc.  */
+#define EFI_MAX_SECTIONS 9
+
 #define EFI32_HEADER_SIZE ALIGN_UP (GRUB_PE32_MSDOS_STUB_SIZE		\
 				    + GRUB_PE32_SIGNATURE_SIZE		\
 				    + sizeof (struct grub_pe32_coff_header) \
 				    + sizeof (struct grub_pe32_optional_header) \
-				    + 4 * sizeof (struct grub_pe32_section_table), \
+				    + EFI_MAX_SECTIONS * sizeof (struct grub_pe32_section_table), \
 				    GRUB_PE32_FILE_ALIGNMENT)
 
 #define EFI64_HEADER_SIZE ALIGN_UP (GRUB_PE32_MSDOS_STUB_SIZE		\
 				    + GRUB_PE32_SIGNATURE_SIZE		\
 				    + sizeof (struct grub_pe32_coff_header) \
 				    + sizeof (struct grub_pe64_optional_header) \
-				    + 4 * sizeof (struct grub_pe32_section_table), \
+				    + EFI_MAX_SECTIONS * sizeof (struct grub_pe32_section_table), \
 				    GRUB_PE32_FILE_ALIGNMENT)
 
 static const struct grub_install_image_target_desc image_targets[] =
@@ -306,7 +317,7 @@ init_pe_section(const struct grub_install_image_target_desc *image_target,
   section->virtual_size = grub_host_to_target32 (vsz);
   (*vma) = ALIGN_UP (*vma + vsz, valign);
 
-  section->raw_data_offset = grub_host_to_target32 (*rda);
+  section->raw_data_offset = grub_host_to_target32 (rsz ? *rda : 0);
   section->raw_data_size = grub_host_to_target32 (rsz);
   (*rda) = ALIGN_UP (*rda + rsz, GRUB_PE32_FILE_ALIGNMENT);
 
@@ -332,38 +343,892 @@ init_pe_section(const struct grub_install_image_target_desc *image_target,
 
 #define MOD_HDR_SIZE (sizeof (struct grub_module_header))
 
+/* With --align-modules, every module starts this far into the module
+   area, so that the runtime can use its sections in place.  */
+#define MODULE_ALIGN GRUB_MKIMAGE_MODULE_ALIGN
+
+/* The padding needed before a module header at OFFSET in the module area
+   for the module that follows it to be aligned.  */
+#define MODULE_PAD(offset) (ALIGN_UP ((offset) + MOD_HDR_SIZE, MODULE_ALIGN) \
+			    - (offset) - MOD_HDR_SIZE)
+
+/* The padding in front of the first header of the module area, which the
+   offset in the module info skips rather than a module header.  It is
+   there when the first header is that of an aligned module, or that of
+   the memdisk section with nothing before it.  FIXED_SIZE is as for
+   module_area_size.  */
+static size_t
+first_module_pad (size_t fixed_size, size_t modinfo_size, size_t nmods,
+		  int align_modules, int memdisk_section)
+{
+  if ((align_modules && nmods)
+      || (memdisk_section && !nmods && fixed_size == modinfo_size))
+    return MODULE_PAD (modinfo_size);
+  return 0;
+}
+
+/* Return the number of the NMODS modules marked in PRELINKED.  */
+static size_t
+count_prelinked (const int *prelinked, size_t nmods)
+{
+  size_t n = 0, j;
+
+  for (j = 0; prelinked && j < nmods; j++)
+    if (prelinked[j])
+      n++;
+  return n;
+}
+
+/* The size of the module area, of which FIXED_SIZE bytes do not depend on
+   the NMODS modules and the memdisk section.  Pre-linked modules are
+   sized with their sections without contents.  When there are any, the
+   modules end on a page boundary, so that what follows them is kept out
+   of their executable section.  */
+static size_t
+module_area_size (const struct grub_install_image_target_desc *image_target,
+		  size_t fixed_size, size_t modinfo_size,
+		  const size_t *mod_sizes,
+		  const struct grub_mkimage_prelink_info *prelink_info,
+		  const int *prelinked, size_t nmods, int align_modules,
+		  int memdisk_section, size_t memdisk_size)
+{
+  size_t mods_size, total, j;
+
+  mods_size = first_module_pad (fixed_size, modinfo_size, nmods,
+				align_modules, memdisk_section);
+  for (j = 0; j < nmods; j++)
+    {
+      size_t mod_size = (prelinked && prelinked[j]) ? prelink_info[j].size
+	: mod_sizes[j];
+
+      if (align_modules && j)
+	mods_size += MODULE_PAD (modinfo_size + mods_size);
+      mods_size += ALIGN_ADDR (mod_size) + MOD_HDR_SIZE;
+    }
+  if (count_prelinked (prelinked, nmods))
+    mods_size += ALIGN_UP (modinfo_size + mods_size, MODULE_ALIGN)
+      - modinfo_size - mods_size;
+  total = fixed_size + mods_size;
+
+  /* A memdisk section comes after everything else, starting on a page
+     boundary.  */
+  if (memdisk_section)
+    total += MODULE_PAD (total) + MOD_HDR_SIZE + ALIGN_UP (memdisk_size, 512);
+
+  return total;
+}
+
+struct load_modules_ctx
+{
+  const char *dir;
+  char **mods;
+  char **mod_imgs;
+  size_t *mod_sizes;
+  int strip;
+  const struct grub_install_image_target_desc *image_target;
+};
+
+/* Read the module J, stripping it if asked to.  */
+static void
+load_module_task (void *data, grub_size_t j)
+{
+  struct load_modules_ctx *ctx = data;
+  const struct grub_install_image_target_desc *image_target = ctx->image_target;
+  char *mod_path = grub_util_get_path (ctx->dir, ctx->mods[j]);
+  char *stripped;
+  size_t stripped_size;
+
+  ctx->mod_imgs[j] = xmalloc (ctx->mod_sizes[j] ? : 1);
+  grub_util_load_image (mod_path, ctx->mod_imgs[j]);
+  free (mod_path);
+
+  if (!ctx->strip)
+    return;
+
+  if (image_target->voidp_sizeof == 4)
+    stripped = grub_mkimage_strip_module32 (ctx->mod_imgs[j], ctx->mod_sizes[j],
+					    &stripped_size, image_target);
+  else
+    stripped = grub_mkimage_strip_module64 (ctx->mod_imgs[j], ctx->mod_sizes[j],
+					    &stripped_size, image_target);
+  if (!stripped)
+    return;
+
+  grub_util_info ("stripped %s from 0x%" GRUB_HOST_PRIxLONG_LONG
+		  " to 0x%" GRUB_HOST_PRIxLONG_LONG " bytes", ctx->mods[j],
+		  (unsigned long long) ctx->mod_sizes[j],
+		  (unsigned long long) stripped_size);
+  free (ctx->mod_imgs[j]);
+  ctx->mod_imgs[j] = stripped;
+  ctx->mod_sizes[j] = stripped_size;
+}
+
+/* The files to be read into the image, and the buffers they are read
+   into until the image is laid out.  */
+struct payloads
+{
+  char **paths;
+  char **bufs;
+  size_t n, max;
+};
+
+/* Return a buffer for the SIZE bytes of the file at PATH, which are read
+   into it by load_payloads.  */
+static char *
+add_payload (struct payloads *payloads, const char *path, size_t size)
+{
+  if (payloads->n == payloads->max)
+    {
+      payloads->max = payloads->max ? 2 * payloads->max : 16;
+      payloads->paths = xrealloc (payloads->paths,
+				  payloads->max * sizeof (payloads->paths[0]));
+      payloads->bufs = xrealloc (payloads->bufs,
+				 payloads->max * sizeof (payloads->bufs[0]));
+    }
+  payloads->paths[payloads->n] = xstrdup (path);
+  payloads->bufs[payloads->n] = xmalloc (size ? : 1);
+  return payloads->bufs[payloads->n++];
+}
+
+static void
+load_payloads (void *data)
+{
+  struct payloads *payloads = data;
+
+  grub_util_load_images (payloads->n, payloads->paths, payloads->bufs);
+}
+
+static int
+map_symbol_cmp (const void *a, const void *b)
+{
+  const struct grub_mkimage_map_symbol *sa = a, *sb = b;
+
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+  return strcmp (sa->name, sb->name);
+}
+
+/* Write the kernel symbols of LAYOUT and the NMODS modules in MAP_MODS
+   to PATH, one "ADDRESS SIZE TYPE NAME" line each in the order of their
+   addresses.  The addresses and sizes are fixed-width hex, so the file
+   can be searched by address.  */
+static void
+write_symbol_map (const char *path, const struct grub_mkimage_layout *layout,
+		  const struct grub_mkimage_map_symbol *map_mods, size_t nmods)
+{
+  struct grub_mkimage_map_symbol *map;
+  size_t n = layout->nmap_symbols + nmods, i;
+  FILE *f;
+
+  map = xcalloc (n ? : 1, sizeof (map[0]));
+  memcpy (map, layout->map_symbols,
+	  layout->nmap_symbols * sizeof (map[0]));
+  memcpy (map + layout->nmap_symbols, map_mods, nmods * sizeof (map[0]));
+  qsort (map, n, sizeof (map[0]), map_symbol_cmp);
+
+  f = grub_util_fopen (path, "w");
+  if (!f)
+    grub_util_error (_("cannot open `%s': %s"), path, strerror (errno));
+
+  for (i = 0; i < n; i++)
+    fprintf (f, "%016llx %016llx %c %s\n", (unsigned long long) map[i].addr,
+	     (unsigned long long) map[i].size, map[i].type, map[i].name);
+
+  if (fclose (f) == EOF)
+    grub_util_error (_("cannot close `%s': %s"), path, strerror (errno));
+  free (map);
+}
+
+/* Put the memdisk module with the contents MEMDISK_IMG at OFFSET in
+   KERNEL_IMG and return the offset after it.  */
+static size_t
+put_memdisk (const struct grub_install_image_target_desc *image_target,
+	     char *kernel_img, size_t offset, const char *memdisk_img,
+	     size_t memdisk_size)
+{
+  struct grub_module_header *header;
+
+  header = (struct grub_module_header *) (kernel_img + offset);
+  header->type = grub_host_to_target32 (OBJ_TYPE_MEMDISK);
+  header->pad_size = ALIGN_UP (memdisk_size, 512) - memdisk_size;
+  header->size =
+      grub_host_to_target32 (ALIGN_UP (memdisk_size, 512) + MOD_HDR_SIZE);
+  offset += MOD_HDR_SIZE;
+
+  memcpy (kernel_img + offset, memdisk_img, memdisk_size);
+  return offset + ALIGN_UP (memdisk_size, 512);
+}
+
+static int
+symbol_cmp (const void *a, const void *b)
+{
+  const struct grub_mkimage_symbol *sa = a, *sb = b;
+
+  return strcmp (sa->name, sb->name);
+}
+
+void
+grub_mkimage_sort_symbols (struct grub_mkimage_symbol *symbols,
+			   size_t nsymbols)
+{
+  qsort (symbols, nsymbols, sizeof (symbols[0]), symbol_cmp);
+}
+
+/* Look NAME up in SYMBOLS, sorted by grub_mkimage_sort_symbols.  */
+const struct grub_mkimage_symbol *
+grub_mkimage_find_symbol (const struct grub_mkimage_symbol *symbols,
+			  size_t nsymbols, const char *name)
+{
+  struct grub_mkimage_symbol key;
+
+  key.name = (char *) name;
+  return bsearch (&key, symbols, nsymbols, sizeof (symbols[0]), symbol_cmp);
+}
+
+/* Decide which of the NMODS modules scanned into INFO get pre-linked.
+   A module can only be if all the symbols it needs come from the kernel
+   or from other pre-linked modules, so those taking symbols from a
+   module which is not are dropped until none is left.  */
+static void
+select_prelinked (const char *const *mods,
+		  const struct grub_mkimage_prelink_info *info,
+		  int *prelinked, size_t nmods,
+		  const struct grub_mkimage_layout *layout)
+{
+  struct grub_mkimage_symbol *defs;
+  size_t ndefs, i, j;
+  int changed;
+
+  do
+    {
+      changed = 0;
+
+      for (i = 0, ndefs = 0; i < nmods; i++)
+	if (prelinked[i])
+	  ndefs += info[i].ndefs;
+      defs = xcalloc (ndefs ? : 1, sizeof (defs[0]));
+      for (i = 0, ndefs = 0; i < nmods; i++)
+	if (prelinked[i])
+	  {
+	    memcpy (defs + ndefs, info[i].defs,
+		    info[i].ndefs * sizeof (defs[0]));
+	    ndefs += info[i].ndefs;
+	  }
+      grub_mkimage_sort_symbols (defs, ndefs);
+
+      for (i = 0; i < nmods; i++)
+	for (j = 0; prelinked[i] && j < info[i].nundefs; j++)
+	  if (!grub_mkimage_find_symbol (layout->symbols, layout->nsymbols,
+					 info[i].undefs[j])
+	      && !grub_mkimage_find_symbol (defs, ndefs, info[i].undefs[j]))
+	    {
+	      grub_util_info ("%s needs %s, which is neither in the kernel nor in a pre-linked module, not pre-linking it",
+			      mods[i], info[i].undefs[j]);
+	      prelinked[i] = 0;
+	      changed = 1;
+	    }
+
+      free (defs);
+    }
+  while (changed);
+}
+
+/* Build the table of the kernel symbols in LAYOUT for the runtime to look
+   them up by name.  Return it, with its size in SIZE.  */
+static char *
+make_symhash (const struct grub_mkimage_layout *layout,
+	      const struct grub_install_image_target_desc *image_target,
+	      size_t *size)
+{
+  struct grub_module_symhash *table;
+  size_t nbuckets = 1, nsymbols = 0, names_size = 1, i;
+  char *names;
+
+  for (i = 0; i < layout->nsymbols; i++)
+    if (i == 0 || strcmp (layout->symbols[i - 1].name,
+			  layout->symbols[i].name) != 0)
+      {
+	nsymbols++;
+	names_size += strlen (layout->symbols[i].name) + 1;
+      }
+
+  /* Kept at most half full, for probe sequences to stay short.  */
+  while (nbuckets < 2 * nsymbols)
+    nbuckets <<= 1;
+
+  *size = sizeof (*table) + nbuckets * sizeof (table->entries[0]) + names_size;
+  table = xcalloc (1, *size);
+  table->nbuckets = grub_host_to_target32 (nbuckets);
+  table->nsymbols = grub_host_to_target32 (nsymbols);
+
+  /* The names start with an empty one, so that no entry has its name at
+     the offset 0.  */
+  names = (char *) &table->entries[nbuckets];
+  names_size = 1;
+
+  for (i = 0; i < layout->nsymbols; i++)
+    {
+      const char *name = layout->symbols[i].name;
+      grub_uint32_t hash, slot;
+
+      if (i && strcmp (layout->symbols[i - 1].name, name) == 0)
+	continue;
+
+      hash = grub_symhash (name);
+      for (slot = hash & (nbuckets - 1); table->entries[slot].name;
+	   slot = (slot + 1) & (nbuckets - 1));
+
+      table->entries[slot].hash = grub_host_to_target32 (hash);
+      table->entries[slot].name
+	= grub_host_to_target32 (names + names_size - (char *) table);
+      table->entries[slot].rva = grub_host_to_target32 (layout->symbols[i].addr);
+      strcpy (names + names_size, name);
+      names_size += strlen (name) + 1;
+    }
+
+  return (char *) table;
+}
+
+static void
+write_json_string (FILE *f, const char *str)
+{
+  fputc ('"', f);
+  for (; *str; str++)
+    if (*str == '"' || *str == '\\')
+      fprintf (f, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      fprintf (f, "\\u%04x", (unsigned char) *str);
+    else
+      fputc (*str, f);
+  fputc ('"', f);
+}
+
+/* A part of the image, for the layout report and the size budgets.
+   OFFSET is in the file and RVA in memory, either of which the part may
+   not have.  PADDING is what goes with it without being part of it: the
+   alignment after it and, in the module area, its header.  */
+struct image_component
+{
+  const char *name;
+  grub_uint64_t offset;
+  grub_uint64_t rva;
+  grub_uint64_t size;
+  grub_uint64_t padding;
+  int in_file;
+  int mapped;
+};
+
+struct image_components
+{
+  struct image_component *list;
+  size_t n, max;
+};
+
+static struct image_component *
+add_component (struct image_components *components, const char *name,
+	       grub_uint64_t offset, grub_uint64_t size, grub_uint64_t padding)
+{
+  struct image_component *c;
+
+  if (components->n == components->max)
+    {
+      components->max = components->max ? 2 * components->max : 32;
+      components->list = xrealloc (components->list,
+				   components->max * sizeof (components->list[0]));
+    }
+  c = &components->list[components->n++];
+  c->name = name;
+  c->offset = c->rva = offset;
+  c->size = size;
+  c->padding = padding;
+  c->in_file = c->mapped = 1;
+  return c;
+}
+
+/* Add the contents of the module area at MODBASE in KERNEL_IMG to
+   COMPONENTS, at their offsets in KERNEL_IMG.  ELF modules are named
+   after MODS, in order.  */
+static void
+add_module_components (struct image_components *components,
+		       const char *kernel_img, size_t modbase,
+		       size_t modinfo_size, char *mods[],
+		       const struct grub_install_image_target_desc *image_target)
+{
+  grub_uint64_t start, size, p;
+  size_t nelf = 0;
+
+  if (image_target->voidp_sizeof == 8)
+    {
+      const struct grub_module_info64 *modinfo
+	= (const struct grub_module_info64 *) (kernel_img + modbase);
+
+      start = grub_target_to_host64 (modinfo->offset);
+      size = grub_target_to_host64 (modinfo->size);
+    }
+  else
+    {
+      const struct grub_module_info32 *modinfo
+	= (const struct grub_module_info32 *) (kernel_img + modbase);
+
+      start = grub_target_to_host32 (modinfo->offset);
+      size = grub_target_to_host32 (modinfo->size);
+    }
+
+  add_component (components, "module info", modbase, modinfo_size,
+		 start - modinfo_size);
+
+  for (p = start; p < size; )
+    {
+      const struct grub_module_header *header
+	= (const struct grub_module_header *) (kernel_img + modbase + p);
+      grub_uint32_t mod_size = grub_target_to_host32 (header->size);
+      grub_uint16_t pad_size = grub_target_to_host16 (header->pad_size);
+      const char *name;
+
+      if (mod_size < MOD_HDR_SIZE + pad_size)
+	break;
+
+      switch (grub_target_to_host16 (header->type))
+	{
+	case OBJ_TYPE_ELF:
+	case OBJ_TYPE_ELF_PRELINKED:
+	  name = mods[nelf++];
+	  break;
+	case OBJ_TYPE_MEMDISK:
+	  name = "memdisk";
+	  break;
+	case OBJ_TYPE_CONFIG:
+	  name = "config";
+	  break;
+	case OBJ_TYPE_PREFIX:
+	  name = "prefix";
+	  break;
+	case OBJ_TYPE_FONT:
+	  name = "font";
+	  break;
+	case OBJ_TYPE_SYMHASH:
+	  name = "symbol hash";
+	  break;
+	default:
+	  name = "unknown";
+	  break;
+	}
+
+      add_component (components, name, modbase + p + MOD_HDR_SIZE,
+		     mod_size - MOD_HDR_SIZE - pad_size,
+		     MOD_HDR_SIZE + pad_size + ALIGN_ADDR (mod_size) - mod_size);
+      p += ALIGN_ADDR (mod_size);
+    }
+}
+
+static int
+component_cmp (const void *a, const void *b)
+{
+  const struct image_component *ca = a, *cb = b;
+  grub_uint64_t ka, kb;
+
+  /* What is mapped goes first, by address, and the rest after it by
+     file offset.  */
+  if (ca->mapped != cb->mapped)
+    return ca->mapped ? -1 : 1;
+  ka = ca->mapped ? ca->rva : ca->offset;
+  kb = cb->mapped ? cb->rva : cb->offset;
+  return (ka > kb) - (ka < kb);
+}
+
+/* Check the sizes of COMPONENTS and of the IMAGE_SIZE bytes of the whole
+   image, under the name "image", against the budgets in the file at PATH:
+   "NAME SIZE" lines, where '#' starts a comment.  */
+static void
+check_size_budgets (const char *path, const struct image_components *components,
+		    size_t image_size)
+{
+  size_t size, i;
+  char *buf, *p, *next;
+
+  size = grub_util_get_image_size (path);
+  buf = xmalloc (size + 1);
+  grub_util_load_image (path, buf);
+  buf[size] = '\0';
+
+  for (p = buf; *p; p = next)
+    {
+      unsigned long long budget, total = 0;
+      char *end, *name, *value;
+      int found = 0;
+
+      next = strchr (p, '\n');
+      if (next)
+	*next++ = '\0';
+      else
+	next = p + strlen (p);
+
+      end = strchr (p, '#');
+      if (end)
+	*end = '\0';
+
+      name = grub_util_next_word (&p);
+      if (!name)
+	continue;
+      value = grub_util_next_word (&p);
+      if (!value || !grub_isdigit (*value))
+	grub_util_error (_("invalid size budget for `%s' in `%s'"), name, path);
+      budget = strtoull (value, &end, 0);
+      if (*end)
+	grub_util_error (_("invalid size budget for `%s' in `%s'"), name, path);
+
+      if (strcmp (name, "image") == 0)
+	{
+	  total = image_size;
+	  found = 1;
+	}
+      for (i = 0; i < components->n; i++)
+	if (strcmp (components->list[i].name, name) == 0)
+	  {
+	    total += components->list[i].size;
+	    found = 1;
+	  }
+
+      if (!found)
+	grub_util_warn (_("the image has no `%s' to check the size budget of"),
+			name);
+      else if (total > budget)
+	grub_util_error (_("`%s' is %llu bytes, over its budget of %llu bytes"),
+			 name, total, budget);
+    }
+
+  free (buf);
+}
+
+/* Write the relocation and layout statistics of the image to PATH as a
+   JSON object, with the parts of the image in COMPONENTS.  */
+static void
+write_layout_stats (const char *path, const struct grub_mkimage_layout *layout,
+		    const struct grub_install_image_target_desc *image_target,
+		    size_t total_module_size, size_t image_size,
+		    const struct image_components *components)
+{
+  const struct grub_mkimage_stats *stats = &layout->stats;
+  size_t i, j;
+  FILE *f;
+
+  f = grub_util_fopen (path, "w");
+  if (!f)
+    grub_util_error (_("cannot open `%s': %s"), path, strerror (errno));
+
+  fprintf (f, "{\n  \"target\": ");
+  write_json_string (f, grub_util_get_target_name (image_target));
+  fprintf (f, ",\n  \"image_size\": %llu", (unsigned long long) image_size);
+  fprintf (f, ",\n  \"exec_size\": %llu", (unsigned long long) layout->exec_size);
+  fprintf (f, ",\n  \"kernel_size\": %llu", (unsigned long long) layout->kernel_size);
+  fprintf (f, ",\n  \"module_size\": %llu", (unsigned long long) total_module_size);
+  fprintf (f, ",\n  \"bss_size\": %llu", (unsigned long long) stats->bss_size);
+  fprintf (f, ",\n  \"gc_removed_sections\": %llu", (unsigned long long) stats->gc_sections);
+  fprintf (f, ",\n  \"gc_removed_size\": %llu", (unsigned long long) stats->gc_size);
+  fprintf (f, ",\n  \"section_padding\": %llu", (unsigned long long) stats->section_padding);
+  fprintf (f, ",\n  \"trampoline_size\": %llu", (unsigned long long) stats->tramp_size);
+  fprintf (f, ",\n  \"got_size\": %llu", (unsigned long long) stats->got_size);
+  fprintf (f, ",\n  \"fixups\": %llu", (unsigned long long) stats->nfixups);
+  fprintf (f, ",\n  \"reloc_size\": %llu", (unsigned long long) layout->reloc_size);
+  fprintf (f, ",\n  \"reloc_padding\": %llu", (unsigned long long) stats->reloc_padding);
+  fprintf (f, ",\n  \"relocations\": {");
+  for (i = 0; i < stats->nsections; i++)
+    {
+      fprintf (f, "%s\n    ", i ? "," : "");
+      write_json_string (f, stats->sections[i].name);
+      fprintf (f, ": {");
+      for (j = 0; j < stats->sections[i].nrelocs; j++)
+	fprintf (f, "%s\"%u\": %llu", j ? ", " : " ",
+		 (unsigned) stats->sections[i].relocs[j].type,
+		 (unsigned long long) stats->sections[i].relocs[j].count);
+      fprintf (f, " }");
+    }
+  fprintf (f, "%s}", stats->nsections ? "\n  " : "");
+  fprintf (f, ",\n  \"components\": [");
+  for (i = 0; i < components->n; i++)
+    {
+      const struct image_component *c = &components->list[i];
+
+      fprintf (f, "%s\n    { \"name\": ", i ? "," : "");
+      write_json_string (f, c->name);
+      if (c->in_file)
+	fprintf (f, ", \"offset\": %llu", (unsigned long long) c->offset);
+      else
+	fprintf (f, ", \"offset\": null");
+      if (c->mapped)
+	fprintf (f, ", \"rva\": %llu", (unsigned long long) c->rva);
+      else
+	fprintf (f, ", \"rva\": null");
+      fprintf (f, ", \"size\": %llu, \"padding\": %llu }",
+	       (unsigned long long) c->size, (unsigned long long) c->padding);
+    }
+  fprintf (f, "%s]\n}\n", components->n ? "\n  " : "");
+
+  if (fclose (f) == EOF)
+    grub_util_error (_("cannot close `%s': %s"), path, strerror (errno));
+}
+
+/* The image is written in pieces of this size, each of which is hashed
+   right after being written, while it is still in the cache.  */
+#define WRITE_CHUNK_SIZE (1 << 20)
+
+/* Add the 16-bit little-endian words of the LEN bytes at BUF to the PE
+   checksum accumulator SUM.  LEN must be even unless BUF is the end of the
+   file.  The carries are only folded in by pe_checksum_finish.  */
+static grub_uint64_t
+pe_checksum_update (grub_uint64_t sum, const char *buf, size_t len)
+{
+  const grub_uint8_t *p = (const grub_uint8_t *) buf;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i acc = zero;
+  grub_uint64_t lanes[2];
+
+  while (len >= 16)
+    {
+      /* A 32-bit lane grows by at most 0x1fffe per vector.  */
+      size_t n = len / 16 < 0x8000 ? len / 16 : 0x8000;
+      __m128i acc32 = zero;
+
+      len -= n * 16;
+      for (; n; n--, p += 16)
+	{
+	  __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+
+	  acc32 = _mm_add_epi32 (acc32,
+				 _mm_add_epi32 (_mm_unpacklo_epi16 (v, zero),
+						_mm_unpackhi_epi16 (v, zero)));
+	}
+      acc = _mm_add_epi64 (acc,
+			   _mm_add_epi64 (_mm_unpacklo_epi32 (acc32, zero),
+					  _mm_unpackhi_epi32 (acc32, zero)));
+    }
+
+  _mm_storeu_si128 ((__m128i *) lanes, acc);
+  sum += lanes[0] + lanes[1];
+#endif
+
+  for (; len >= 2; len -= 2, p += 2)
+    sum += p[0] | (p[1] << 8);
+  if (len)
+    sum += p[0];
+
+  return sum;
+}
+
+static grub_uint32_t
+pe_checksum_finish (grub_uint64_t sum, size_t size)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum + size;
+}
+
+/* Write the PE image IMG to OUT.  On the way, compute its checksum if
+   CHECKSUM is set, and its Authenticode digest if DIGEST is not NULL.
+   The checksum field at CHECKSUM_OFF must be zero.  It is patched in once
+   everything else has been written, or filled in beforehand if OUT cannot
+   seek.  The digest covers the first HASH_SIZE bytes of the file, which
+   leaves out the certificate table at its end, except for the checksum
+   and the certificate table entry of the optional header, at CHECKSUM_OFF
+   and CERTDIR_OFF.  */
+static void
+write_pe_image (char *img, size_t size, size_t hash_size,
+		size_t checksum_off, size_t certdir_off, int checksum,
+		FILE *out, const char *name,
+		grub_uint8_t digest[GRUB_SHA256_DIGEST_SIZE])
+{
+  const struct
+  {
+    size_t off;
+    size_t len;
+  } skip[] =
+    {
+      { checksum_off, sizeof (grub_uint32_t) },
+      { certdir_off, sizeof (struct grub_pe32_data_directory) }
+    };
+  struct grub_sha256_ctx ctx;
+  grub_uint64_t sum = 0;
+  grub_uint32_t field;
+  size_t off, end, limit, pos = 0;
+  off_t start = 0;
+  unsigned s = 0;
+
+  if (checksum)
+    {
+      if (fseeko (out, 0, SEEK_CUR) == 0)
+	start = ftello (out);
+      else
+	{
+	  field = grub_cpu_to_le32 (pe_checksum_finish (pe_checksum_update (0, img, size),
+							size));
+	  memcpy (img + checksum_off, &field, sizeof (field));
+	  checksum = 0;
+	}
+    }
+
+  if (digest)
+    grub_sha256_init (&ctx);
+
+  for (off = 0; off < size; off = end)
+    {
+      end = size - off < WRITE_CHUNK_SIZE ? size : off + WRITE_CHUNK_SIZE;
+      grub_util_write_image (img + off, end - off, out, name);
+
+      if (checksum)
+	sum = pe_checksum_update (sum, img + off, end - off);
+
+      if (!digest)
+	continue;
+
+      limit = end < hash_size ? end : hash_size;
+      while (pos < limit)
+	if (s < ARRAY_SIZE (skip) && skip[s].off < limit)
+	  {
+	    if (pos < skip[s].off)
+	      grub_sha256_update (&ctx, img + pos, skip[s].off - pos);
+	    pos = skip[s].off + skip[s].len;
+	    s++;
+	  }
+	else
+	  {
+	    grub_sha256_update (&ctx, img + pos, limit - pos);
+	    pos = limit;
+	  }
+    }
+
+  if (digest)
+    grub_sha256_final (&ctx, digest);
+
+  if (checksum)
+    {
+      field = grub_cpu_to_le32 (pe_checksum_finish (sum, size));
+      memcpy (img + checksum_off, &field, sizeof (field));
+      grub_util_write_image_at (&field, sizeof (field), start + checksum_off,
+				out, name);
+    }
+}
+
+static void
+write_digest (const char *path, const grub_uint8_t *digest, size_t size)
+{
+  FILE *f;
+  size_t i;
+
+  f = grub_util_fopen (path, "w");
+  if (!f)
+    grub_util_error (_("cannot open `%s': %s"), path, strerror (errno));
+
+  for (i = 0; i < size; i++)
+    fprintf (f, "%02x", digest[i]);
+  fputc ('\n', f);
+
+  if (fclose (f) == EOF)
+    grub_util_error (_("cannot close `%s': %s"), path, strerror (errno));
+}
+
 void
 grub_install_generate_image (const char *dir, const char *prefix,
 			     FILE *out, const char *outname, char *mods[],
 			     char *memdisk_path, char *config_path,
 			     const struct grub_install_image_target_desc *image_target,
 			     grub_compression_t comp,
-			     const char *font_path, int pe32)
+			     const char *font_path, int pe32,
+			     const struct grub_install_image_options *options)
 {
+  /* The features the target does not support are turned off below.  */
+  struct grub_install_image_options opts = *options;
   char *kernel_img, *core_img;
   size_t total_module_size, core_size;
   size_t memdisk_size = 0, config_size = 0;
   size_t prefix_size = 0, font_size = 0;
   char *kernel_path;
-  size_t offset;
+  size_t offset, modbase, modinfo_size, fixed_size, mod_pad = 0;
+  size_t memdisk_off = 0;
+  /* The part of the image holding the pre-linked modules, if any.  */
+  size_t prelink_start = 0, prelink_end = 0;
+  struct grub_module_header *prev = NULL;
   size_t j;
   size_t decompress_size = 0;
   struct grub_mkimage_layout layout;
-
+  size_t pe_checksum_off = 0, pe_certdir_off = 0, pe_cert_size = 0;
+  size_t nmods;
+  char **mod_imgs = NULL;
+  size_t *mod_sizes = NULL, *mod_offs = NULL;
+  struct grub_mkimage_prelink_info *prelink_info = NULL;
+  int *prelinked = NULL;
+  char *symhash = NULL;
+  size_t symhash_size = 0;
+  char **resolved = NULL;
+  struct grub_mkimage_map_symbol *map_mods = NULL;
+  struct image_components components = { NULL, 0, 0 };
+  struct payloads payloads = { NULL, NULL, 0, 0 };
+  struct grub_util_job *payloads_job;
+  char *memdisk_img = NULL, *font_img = NULL, *config_img = NULL;
+  off_t image_start;
+
+  if (opts.authenticode_path && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("Authenticode digests are only computed for EFI images"));
+      opts.authenticode_path = NULL;
+    }
+  if (opts.cert_reserve && image_target->id != IMAGE_EFI)
+    grub_util_warn ("%s", _("a certificate table can only be reserved in EFI images"));
+  if (opts.pe_checksum && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("checksums are only computed for EFI images"));
+      opts.pe_checksum = 0;
+    }
+  if (opts.memdisk_section && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("a memdisk section can only be made in EFI images"));
+      opts.memdisk_section = 0;
+    }
+  if (!memdisk_path)
+    opts.memdisk_section = 0;
+  if (opts.prelink && (image_target->id != IMAGE_EFI
+		  || (image_target->elf_target != EM_386
+		      && image_target->elf_target != EM_X86_64)))
+    {
+      grub_util_warn ("%s", _("modules can only be pre-linked in x86 EFI images"));
+      opts.prelink = 0;
+    }
+  if (opts.symbol_map_path && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("a symbol map can only be written for EFI images"));
+      opts.symbol_map_path = NULL;
+    }
+  if (opts.size_budget_path && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("size budgets can only be checked for EFI images"));
+      opts.size_budget_path = NULL;
+    }
+  if (opts.symbol_hash && image_target->id != IMAGE_EFI)
+    {
+      grub_util_warn ("%s", _("a symbol hash table can only be embedded in EFI images"));
+      opts.symbol_hash = 0;
+    }
   if (comp == GRUB_COMPRESSION_AUTO)
     comp = image_target->default_compression;
 
+  if (opts.resolve_deps || opts.deps_cache)
+    mods = resolved = grub_util_resolve_dependencies (dir, mods,
+						      opts.deps_cache,
+						      image_target);
+
   kernel_path = grub_util_get_path (dir, "kernel.img");
 
   if (image_target->voidp_sizeof == 8)
-    total_module_size = sizeof (struct grub_module_info64);
+    modinfo_size = sizeof (struct grub_module_info64);
   else
-    total_module_size = sizeof (struct grub_module_info32);
+    modinfo_size = sizeof (struct grub_module_info32);
+  total_module_size = modinfo_size;
 
   if (memdisk_path)
   {
     memdisk_size = grub_util_get_image_size (memdisk_path);
-    total_module_size += ALIGN_UP (memdisk_size, 512) + MOD_HDR_SIZE;
+    if (!opts.memdisk_section)
+      total_module_size += ALIGN_UP (memdisk_size, 512) + MOD_HDR_SIZE;
   }
 
   if (font_path)
@@ -384,23 +1249,125 @@ grub_install_generate_image (const char *dir, const char *prefix,
     total_module_size += ALIGN_ADDR (prefix_size) + MOD_HDR_SIZE;
   }
 
-  for (j = 0; mods[j]; j++)
+  for (nmods = 0; mods[nmods]; nmods++);
+
+  mod_sizes = xcalloc (nmods ? : 1, sizeof (mod_sizes[0]));
+  for (j = 0; j < nmods; j++)
   {
     char *mod_path = grub_util_get_path (dir, mods[j]);
-    size_t mod_size = grub_util_get_image_size (mod_path);
-    total_module_size += ALIGN_ADDR (mod_size) + MOD_HDR_SIZE;
+    mod_sizes[j] = grub_util_get_image_size (mod_path);
     free (mod_path);
   }
 
+  /* Modules which are rewritten are read up front, in parallel.  */
+  if (opts.prelink || opts.strip_modules)
+  {
+    struct load_modules_ctx ctx;
+
+    mod_imgs = xcalloc (nmods ? : 1, sizeof (mod_imgs[0]));
+    ctx.dir = dir;
+    ctx.mods = mods;
+    ctx.mod_imgs = mod_imgs;
+    ctx.mod_sizes = mod_sizes;
+    ctx.strip = opts.strip_modules;
+    ctx.image_target = image_target;
+    grub_util_run_tasks (nmods, load_module_task, &ctx);
+  }
+
+  if (opts.prelink)
+  {
+    mod_offs = xcalloc (nmods ? : 1, sizeof (mod_offs[0]));
+    prelink_info = xcalloc (nmods ? : 1, sizeof (prelink_info[0]));
+    prelinked = xcalloc (nmods ? : 1, sizeof (prelinked[0]));
+    for (j = 0; j < nmods; j++)
+    {
+      if (image_target->voidp_sizeof == 4)
+	prelinked[j] = grub_mkimage_prelink_scan32 (mod_imgs[j], mod_sizes[j],
+						    mods[j], &prelink_info[j],
+						    image_target);
+      else
+	prelinked[j] = grub_mkimage_prelink_scan64 (mod_imgs[j], mod_sizes[j],
+						    mods[j], &prelink_info[j],
+						    image_target);
+    }
+    /* Pre-linked modules are used in place.  */
+    if (count_prelinked (prelinked, nmods))
+      opts.align_modules = 1;
+  }
+
+  /* The other payloads are read in the background while the kernel is
+     relocated, and copied in place once the image is laid out.  */
+  if (!mod_imgs)
+  {
+    mod_imgs = xcalloc (nmods ? : 1, sizeof (mod_imgs[0]));
+    for (j = 0; j < nmods; j++)
+    {
+      char *mod_path = grub_util_get_path (dir, mods[j]);
+      mod_imgs[j] = add_payload (&payloads, mod_path, mod_sizes[j]);
+      free (mod_path);
+    }
+  }
+  if (memdisk_path)
+    memdisk_img = add_payload (&payloads, memdisk_path, memdisk_size);
+  if (font_path)
+    font_img = add_payload (&payloads, font_path, font_size);
+  if (config_path)
+  {
+    config_img = add_payload (&payloads, config_path, config_size);
+    config_img[config_size - 1] = '\0';
+  }
+  payloads_job = grub_util_start_job (load_payloads, &payloads);
+
+  /* Until the kernel symbols are known, every module which can be
+     pre-linked is taken to be, which makes for the largest size.  */
+  fixed_size = total_module_size;
+  total_module_size = module_area_size (image_target, fixed_size,
+					modinfo_size, mod_sizes, prelink_info,
+					prelinked, nmods, opts.align_modules,
+					opts.memdisk_section, memdisk_size);
+
   grub_util_info ("the total module size is 0x%" GRUB_HOST_PRIxLONG_LONG,
             (unsigned long long) total_module_size);
 
   if (image_target->voidp_sizeof == 4)
     kernel_img = grub_mkimage_load_image32 (kernel_path, total_module_size,
-                          &layout, image_target);
+                          &layout, &opts, image_target);
   else
     kernel_img = grub_mkimage_load_image64 (kernel_path, total_module_size,
-                          &layout, image_target);
+                          &layout, &opts, image_target);
+
+  if (opts.symbol_hash)
+    {
+      symhash = make_symhash (&layout, image_target, &symhash_size);
+      fixed_size += ALIGN_ADDR (symhash_size) + MOD_HDR_SIZE;
+    }
+
+  if (opts.prelink || opts.symbol_hash)
+    {
+      size_t size;
+
+      if (opts.prelink)
+	{
+	  select_prelinked ((const char *const *) mods, prelink_info,
+			    prelinked, nmods, &layout);
+	  opts.align_modules = options->align_modules
+	    || count_prelinked (prelinked, nmods);
+	}
+      size = module_area_size (image_target, fixed_size, modinfo_size,
+			       mod_sizes, prelink_info, prelinked, nmods,
+			       opts.align_modules, opts.memdisk_section,
+			       memdisk_size);
+
+      /* The symbol hash table was not accounted for when loading the
+	 kernel.  */
+      if (size > total_module_size)
+	{
+	  kernel_img = xrealloc (kernel_img, layout.kernel_size + size);
+	  memset (kernel_img + layout.kernel_size + total_module_size, 0,
+		  size - total_module_size);
+	}
+      total_module_size = size;
+    }
 
   if ((image_target->flags & PLATFORM_FLAGS_DECOMPRESSORS)
       && (image_target->total_module_size != TARGET_NO_FIELD))
@@ -413,6 +1380,17 @@ grub_install_generate_image (const char *dir, const char *prefix,
     memset (kernel_img, 0, total_module_size);
   }
 
+  if (image_target->flags & PLATFORM_FLAGS_MODULES_BEFORE_KERNEL)
+    modbase = 0;
+  else
+    modbase = layout.kernel_size;
+
+  /* The padding in front of the first module is skipped by the offset in
+     the module info, the one in front of the others is the trailing
+     padding of the module before.  */
+  mod_pad = first_module_pad (fixed_size, modinfo_size, nmods,
+			      opts.align_modules, opts.memdisk_section);
+
   if (image_target->voidp_sizeof == 8)
   {
     /* Fill in the grub_module_info structure.  */
@@ -422,13 +1400,8 @@ grub_install_generate_image (const char *dir, const char *prefix,
     else
       modinfo = (struct grub_module_info64 *) (kernel_img + layout.kernel_size);
     modinfo->magic = grub_host_to_target32 (GRUB_MODULE_MAGIC);
-    modinfo->offset =
-        grub_host_to_target_addr (sizeof (struct grub_module_info64));
+    modinfo->offset = grub_host_to_target_addr (modinfo_size + mod_pad);
     modinfo->size = grub_host_to_target_addr (total_module_size);
-    if (image_target->flags & PLATFORM_FLAGS_MODULES_BEFORE_KERNEL)
-      offset = sizeof (struct grub_module_info64);
-    else
-      offset = layout.kernel_size + sizeof (struct grub_module_info64);
   }
   else
   {
@@ -439,46 +1412,139 @@ grub_install_generate_image (const char *dir, const char *prefix,
     else
       modinfo = (struct grub_module_info32 *) (kernel_img + layout.kernel_size);
     modinfo->magic = grub_host_to_target32 (GRUB_MODULE_MAGIC);
-    modinfo->offset =
-        grub_host_to_target_addr (sizeof (struct grub_module_info32));
+    modinfo->offset = grub_host_to_target_addr (modinfo_size + mod_pad);
     modinfo->size = grub_host_to_target_addr (total_module_size);
-    if (image_target->flags & PLATFORM_FLAGS_MODULES_BEFORE_KERNEL)
-      offset = sizeof (struct grub_module_info32);
-    else
-      offset = layout.kernel_size + sizeof (struct grub_module_info32);
   }
 
+  offset = modbase + modinfo_size + mod_pad;
+
+  if (opts.symbol_map_path)
+    map_mods = xcalloc (nmods ? : 1, sizeof (map_mods[0]));
+
+  grub_util_finish_job (payloads_job);
+  for (j = 0; j < payloads.n; j++)
+    free (payloads.paths[j]);
+  free (payloads.paths);
+  free (payloads.bufs);
+
   for (j = 0; mods[j]; j++)
   {
     struct grub_module_header *header;
-    char *mod_path = grub_util_get_path (dir, mods[j]);
-    size_t mod_size = grub_util_get_image_size (mod_path);
+    size_t mod_size = mod_sizes[j];
+
+    /* A pre-linked module is followed by its sections without
+       contents, which are left zeroed.  */
+    if (opts.prelink && prelinked[j])
+      mod_size = prelink_info[j].size;
+
+    mod_pad = ALIGN_ADDR (mod_size) - mod_size;
+    if (opts.align_modules && mods[j + 1])
+      mod_pad += MODULE_PAD (offset - modbase + MOD_HDR_SIZE
+			     + ALIGN_ADDR (mod_size));
+    else if (!mods[j + 1] && count_prelinked (prelinked, nmods))
+      mod_pad += ALIGN_UP (offset - modbase + MOD_HDR_SIZE
+			   + ALIGN_ADDR (mod_size), MODULE_ALIGN)
+	- (offset - modbase + MOD_HDR_SIZE + ALIGN_ADDR (mod_size));
 
     header = (struct grub_module_header *) (kernel_img + offset);
-    header->type = grub_host_to_target32 (OBJ_TYPE_ELF);
-    header->pad_size = ALIGN_ADDR (mod_size) - mod_size;
-    header->size = grub_host_to_target32 (ALIGN_ADDR (mod_size) + MOD_HDR_SIZE);
+    header->type = grub_host_to_target32 ((opts.prelink && prelinked[j])
+					  ? OBJ_TYPE_ELF_PRELINKED
+					  : OBJ_TYPE_ELF);
+    header->pad_size = mod_pad;
+    header->size = grub_host_to_target32 (mod_size + mod_pad + MOD_HDR_SIZE);
     offset += MOD_HDR_SIZE;
 
-    grub_util_load_image (mod_path, kernel_img + offset);
-    offset += ALIGN_ADDR (mod_size);
-    free (mod_path);
+    memcpy (kernel_img + offset, mod_imgs[j], mod_sizes[j]);
+    if (opts.prelink)
+      mod_offs[j] = offset;
+    if (opts.prelink && prelinked[j])
+      {
+	if (!prelink_end)
+	  prelink_start = offset;
+	prelink_end = offset + mod_size;
+      }
+    if (map_mods)
+      {
+	map_mods[j].name = mods[j];
+	map_mods[j].addr = offset + image_target->vaddr_offset;
+	map_mods[j].size = mod_size;
+	map_mods[j].type = 'M';
+      }
+    offset += mod_size + mod_pad;
+    prev = header;
   }
 
-  if (memdisk_path)
-  {
-    struct grub_module_header *header;
+  if (opts.prelink)
+    {
+      struct grub_mkimage_symbol *symbols;
+      size_t nsymbols = layout.nsymbols, k;
+
+      /* The kernel symbols and those of the pre-linked modules, at
+	 their addresses in the image.  */
+      for (j = 0; j < nmods; j++)
+	if (prelinked[j])
+	  nsymbols += prelink_info[j].ndefs;
+      symbols = xcalloc (nsymbols ? : 1, sizeof (symbols[0]));
+      memcpy (symbols, layout.symbols,
+	      layout.nsymbols * sizeof (symbols[0]));
+      nsymbols = layout.nsymbols;
+      for (j = 0; j < nmods; j++)
+	for (k = 0; prelinked[j] && k < prelink_info[j].ndefs; k++)
+	  {
+	    symbols[nsymbols].name = prelink_info[j].defs[k].name;
+	    symbols[nsymbols].addr = prelink_info[j].defs[k].addr
+	      + mod_offs[j] + image_target->vaddr_offset;
+	    nsymbols++;
+	  }
+      grub_mkimage_sort_symbols (symbols, nsymbols);
+      for (k = 1; k < nsymbols; k++)
+	if (strcmp (symbols[k - 1].name, symbols[k].name) == 0)
+	  grub_util_error (_("symbol `%s' is defined more than once"),
+			   symbols[k].name);
+
+      for (j = 0; j < nmods; j++)
+	if (prelinked[j])
+	  {
+	    grub_util_info ("pre-linking %s at 0x%" GRUB_HOST_PRIxLONG_LONG,
+			    mods[j], (unsigned long long) (mod_offs[j]
+							   + image_target->vaddr_offset));
+	    if (image_target->voidp_sizeof == 4)
+	      grub_mkimage_prelink32 (kernel_img + mod_offs[j], mod_sizes[j],
+				      mod_offs[j] + image_target->vaddr_offset,
+				      symbols, nsymbols, &layout, image_target);
+	    else
+	      grub_mkimage_prelink64 (kernel_img + mod_offs[j], mod_sizes[j],
+				      mod_offs[j] + image_target->vaddr_offset,
+				      symbols, nsymbols, &layout, image_target);
+	  }
+      free (symbols);
 
-    header = (struct grub_module_header *) (kernel_img + offset);
-    header->type = grub_host_to_target32 (OBJ_TYPE_MEMDISK);
-    header->pad_size = ALIGN_UP (memdisk_size, 512) - memdisk_size;
-    header->size =
-        grub_host_to_target32 (ALIGN_UP (memdisk_size, 512) + MOD_HDR_SIZE);
-    offset += MOD_HDR_SIZE;
+      if (image_target->voidp_sizeof == 4)
+	grub_mkimage_make_pe_relocs32 (&layout, image_target);
+      else
+	grub_mkimage_make_pe_relocs64 (&layout, image_target);
 
-    grub_util_load_image (memdisk_path, kernel_img + offset);
-    offset += ALIGN_UP (memdisk_size, 512);
-  }
+      for (j = 0; j < nmods; j++)
+	{
+	  for (k = 0; k < prelink_info[j].ndefs; k++)
+	    free (prelink_info[j].defs[k].name);
+	  for (k = 0; k < prelink_info[j].nundefs; k++)
+	    free (prelink_info[j].undefs[k]);
+	  free (prelink_info[j].defs);
+	  free (prelink_info[j].undefs);
+	}
+      free (prelink_info);
+      free (prelinked);
+      free (mod_offs);
+    }
+  for (j = 0; j < nmods; j++)
+    free (mod_imgs[j]);
+  free (mod_imgs);
+  free (mod_sizes);
+
+  if (memdisk_path && !opts.memdisk_section)
+    offset = put_memdisk (image_target, kernel_img, offset, memdisk_img,
+			  memdisk_size);
 
   if (font_path)
   {
@@ -490,8 +1556,10 @@ grub_install_generate_image (const char *dir, const char *prefix,
     header->size = grub_host_to_target32 (ALIGN_ADDR (font_size) + MOD_HDR_SIZE);
     offset += MOD_HDR_SIZE;
 
-    grub_util_load_image (font_path, kernel_img + offset);
+    memcpy (kernel_img + offset, font_img, font_size);
+    free (font_img);
     offset += ALIGN_ADDR (font_size);
+    prev = header;
   }
 
   if (config_path)
@@ -504,8 +1572,10 @@ grub_install_generate_image (const char *dir, const char *prefix,
     header->size = grub_host_to_target32 (ALIGN_ADDR (config_size) + MOD_HDR_SIZE);
     offset += MOD_HDR_SIZE;
 
-    grub_util_load_image (config_path, kernel_img + offset);
+    memcpy (kernel_img + offset, config_img, config_size);
+    free (config_img);
     offset += ALIGN_ADDR (config_size);
+    prev = header;
   }
 
   if (prefix)
@@ -520,8 +1590,50 @@ grub_install_generate_image (const char *dir, const char *prefix,
 
     grub_strcpy (kernel_img + offset, prefix);
     offset += ALIGN_ADDR (prefix_size);
+    prev = header;
   }
 
+  if (symhash)
+  {
+    struct grub_module_header *header;
+
+    header = (struct grub_module_header *) (kernel_img + offset);
+    header->type = grub_host_to_target32 (OBJ_TYPE_SYMHASH);
+    header->pad_size = ALIGN_ADDR (symhash_size) - symhash_size;
+    header->size = grub_host_to_target32 (ALIGN_ADDR (symhash_size) + MOD_HDR_SIZE);
+    offset += MOD_HDR_SIZE;
+
+    memcpy (kernel_img + offset, symhash, symhash_size);
+    offset += ALIGN_ADDR (symhash_size);
+    free (symhash);
+    prev = header;
+  }
+
+  /* The padding up to the memdisk goes into the module before it, or
+     into the offset in the module info if it is the only one.  */
+  if (opts.memdisk_section)
+  {
+    size_t pad = MODULE_PAD (offset - modbase);
+
+    if (prev)
+      {
+	prev->pad_size += pad;
+	prev->size = grub_host_to_target32 (grub_target_to_host32 (prev->size)
+					    + pad);
+      }
+    offset += pad;
+    memdisk_off = offset + MOD_HDR_SIZE;
+    offset = put_memdisk (image_target, kernel_img, offset, memdisk_img,
+			  memdisk_size);
+  }
+
+  free (memdisk_img);
+
+  if (image_target->id == IMAGE_EFI
+      && (opts.stats_path || opts.size_budget_path))
+    add_module_components (&components, kernel_img, modbase, modinfo_size,
+			   mods, image_target);
+
   grub_util_info ("kernel_img=%p, kernel_size=0x%" GRUB_HOST_PRIxLONG_LONG,
                   kernel_img, (unsigned long long) layout.kernel_size);
   compress_kernel (image_target, kernel_img,
@@ -615,9 +1727,9 @@ grub_install_generate_image (const char *dir, const char *prefix,
     case IMAGE_EFI:
       {
 	char *pe_img, *header;
-	struct grub_pe32_section_table *section;
-	size_t scn_size;
-	grub_uint32_t vma, raw_data;
+	struct grub_pe32_section_table *section, *first_section;
+	size_t scn_size, bss_size = 0;
+	grub_uint32_t vma, raw_data, mods_flags, mods_size;
 	size_t pe_size, header_size;
 	struct grub_pe32_coff_header *c;
 	static const grub_uint8_t stub[] = GRUB_PE32_MSDOS_STUB;
@@ -631,11 +1743,27 @@ grub_install_generate_image (const char *dir, const char *prefix,
 
 	vma = raw_data = header_size;
 
-	pe_size = ALIGN_UP (header_size + core_size, GRUB_PE32_FILE_ALIGNMENT) +
-          ALIGN_UP (layout.reloc_size, GRUB_PE32_FILE_ALIGNMENT);
-	header = pe_img = xcalloc (1, pe_size);
+	if (layout.virtual_bss)
+	  bss_size = layout.end - layout.bss_start;
 
-	memcpy (pe_img + raw_data, core_img, core_size);
+	pe_size = ALIGN_UP (header_size + core_size - bss_size,
+			    GRUB_PE32_FILE_ALIGNMENT) +
+          ALIGN_UP (layout.reloc_size, GRUB_PE32_FILE_ALIGNMENT);
+	/* The certificate table goes after everything else.  Its entries
+	   are 8-byte aligned.  */
+	pe_cert_size = ALIGN_UP (opts.cert_reserve, 8);
+	header = pe_img = xcalloc (1, pe_size + pe_cert_size);
+
+	/* A virtual .bss is cut out of the file; what follows it is moved
+	   down, while keeping its virtual address.  */
+	if (bss_size)
+	  {
+	    memcpy (pe_img + raw_data, core_img, layout.bss_start);
+	    memcpy (pe_img + raw_data + layout.bss_start, core_img + layout.end,
+		    core_size - layout.end);
+	  }
+	else
+	  memcpy (pe_img + raw_data, core_img, core_size);
 
 	/* The magic.  */
 	memcpy (header, stub, GRUB_PE32_MSDOS_STUB_SIZE);
@@ -647,7 +1775,6 @@ grub_install_generate_image (const char *dir, const char *prefix,
 					      + GRUB_PE32_SIGNATURE_SIZE);
 	c->machine = grub_host_to_target16 (image_target->pe_target);
 
-	c->num_sections = grub_host_to_target16 (4);
 	c->time = grub_host_to_target32 (STABLE_EMBEDDING_TIMESTAMP);
 	c->characteristics = grub_host_to_target16 (GRUB_PE32_EXECUTABLE_IMAGE
 						    | GRUB_PE32_LINE_NUMS_STRIPPED
@@ -680,11 +1807,11 @@ grub_install_generate_image (const char *dir, const char *prefix,
 
 	    section = (struct grub_pe32_section_table *)(o64 + 1);
 	  }
+	first_section = section;
 
 	PE_OHDR (o32, o64, header_size) = grub_host_to_target32 (header_size);
 	PE_OHDR (o32, o64, entry_addr) = grub_host_to_target32 (layout.start_address);
 	PE_OHDR (o32, o64, image_base) = 0;
-	PE_OHDR (o32, o64, image_size) = grub_host_to_target32 (pe_size);
 	PE_OHDR (o32, o64, section_alignment) = grub_host_to_target32 (image_target->section_align);
 	PE_OHDR (o32, o64, file_alignment) = grub_host_to_target32 (GRUB_PE32_FILE_ALIGNMENT);
 	PE_OHDR (o32, o64, subsystem) = grub_host_to_target16 (GRUB_PE32_SUBSYSTEM_EFI_APPLICATION);
@@ -697,6 +1824,9 @@ grub_install_generate_image (const char *dir, const char *prefix,
 
 	PE_OHDR (o32, o64, num_data_directories) = grub_host_to_target32 (GRUB_PE32_NUM_DATA_DIRECTORIES);
 
+	pe_checksum_off = (char *) &PE_OHDR (o32, o64, checksum) - header;
+	pe_certdir_off = (char *) &PE_OHDR (o32, o64, certificate_table) - header;
+
 	/* The sections.  */
 	PE_OHDR (o32, o64, code_base) = grub_host_to_target32 (vma);
 	PE_OHDR (o32, o64, code_size) = grub_host_to_target32 (layout.exec_size);
@@ -708,10 +1838,13 @@ grub_install_generate_image (const char *dir, const char *prefix,
 				   GRUB_PE32_SCN_MEM_EXECUTE |
 				   GRUB_PE32_SCN_MEM_READ);
 
-	scn_size = ALIGN_UP (layout.kernel_size - layout.exec_size, GRUB_PE32_FILE_ALIGNMENT);
-	PE_OHDR (o32, o64, data_size) = grub_host_to_target32 (scn_size +
-							       ALIGN_UP (total_module_size,
-									 GRUB_PE32_FILE_ALIGNMENT));
+	scn_size = ALIGN_UP ((bss_size ? layout.bss_start : layout.kernel_size)
+			     - layout.exec_size, GRUB_PE32_FILE_ALIGNMENT);
+	PE_OHDR (o32, o64, data_size)
+	  = grub_host_to_target32 (pe_size - header_size - layout.exec_size
+				   - ALIGN_UP (layout.reloc_size,
+					       GRUB_PE32_FILE_ALIGNMENT));
+	PE_OHDR (o32, o64, bss_size) = grub_host_to_target32 (bss_size);
 
 	section = init_pe_section (image_target, section, ".data",
 				   &vma, scn_size, image_target->section_align,
@@ -720,28 +1853,159 @@ grub_install_generate_image (const char *dir, const char *prefix,
 				   GRUB_PE32_SCN_MEM_READ |
 				   GRUB_PE32_SCN_MEM_WRITE);
 
+	if (bss_size)
+	  {
+	    section = init_pe_section (image_target, section, ".bss",
+				       &vma, bss_size, image_target->section_align,
+				       &raw_data, 0,
+				       GRUB_PE32_SCN_CNT_UNINITIALIZED_DATA |
+				       GRUB_PE32_SCN_MEM_READ |
+				       GRUB_PE32_SCN_MEM_WRITE);
+
+	    /* The GOT is placed after .bss, but mods has to start with the
+	       module info.  */
+	    scn_size = layout.kernel_size - layout.end;
+	    if (scn_size)
+	      section = init_pe_section (image_target, section, ".got",
+					 &vma, scn_size,
+					 image_target->section_align,
+					 &raw_data, scn_size,
+					 GRUB_PE32_SCN_CNT_INITIALIZED_DATA |
+					 GRUB_PE32_SCN_MEM_READ |
+					 GRUB_PE32_SCN_MEM_WRITE);
+	  }
+
+	mods_flags = GRUB_PE32_SCN_CNT_INITIALIZED_DATA
+	  | GRUB_PE32_SCN_MEM_READ | GRUB_PE32_SCN_MEM_WRITE;
+
 	scn_size = pe_size - layout.reloc_size - raw_data;
-	section = init_pe_section (image_target, section, "mods",
-				   &vma, scn_size, image_target->section_align,
-				   &raw_data, scn_size,
-				   GRUB_PE32_SCN_CNT_INITIALIZED_DATA |
-				   GRUB_PE32_SCN_MEM_READ |
-				   GRUB_PE32_SCN_MEM_WRITE);
+	mods_size = memdisk_off ? memdisk_off - layout.kernel_size : scn_size;
+	scn_size -= mods_size;
+
+	/* Pre-linked modules run where they are, so the pages holding them
+	   go into an executable section of their own.  They start and end
+	   on page boundaries of the module area.  */
+	if (prelink_end)
+	  {
+	    grub_uint32_t start = prelink_start - layout.kernel_size;
+	    grub_uint32_t end = ALIGN_UP (prelink_end - layout.kernel_size,
+					  MODULE_ALIGN);
+
+	    section = init_pe_section (image_target, section, "mods",
+				       &vma, start,
+				       image_target->section_align,
+				       &raw_data, start, mods_flags);
+	    section = init_pe_section (image_target, section, ".modtext",
+				       &vma, end - start,
+				       image_target->section_align,
+				       &raw_data, end - start,
+				       GRUB_PE32_SCN_CNT_CODE |
+				       GRUB_PE32_SCN_MEM_EXECUTE |
+				       GRUB_PE32_SCN_MEM_READ |
+				       GRUB_PE32_SCN_MEM_WRITE);
+	    if (mods_size > end)
+	      section = init_pe_section (image_target, section, ".moddata",
+					 &vma, mods_size - end,
+					 image_target->section_align,
+					 &raw_data, mods_size - end,
+					 mods_flags);
+	  }
+	else
+	  section = init_pe_section (image_target, section, "mods",
+				     &vma, mods_size,
+				     image_target->section_align,
+				     &raw_data, mods_size, mods_flags);
+
+	if (memdisk_off)
+	  section = init_pe_section (image_target, section, ".memdisk",
+				     &vma, scn_size,
+				     image_target->section_align,
+				     &raw_data, scn_size,
+				     GRUB_PE32_SCN_CNT_INITIALIZED_DATA |
+				     GRUB_PE32_SCN_MEM_READ);
 
 	scn_size = layout.reloc_size;
 	PE_OHDR (o32, o64, base_relocation_table.rva) = grub_host_to_target32 (vma);
 	PE_OHDR (o32, o64, base_relocation_table.size) = grub_host_to_target32 (scn_size);
 	memcpy (pe_img + raw_data, layout.reloc_section, scn_size);
-	init_pe_section (image_target, section, ".reloc",
-			 &vma, scn_size, image_target->section_align,
-			 &raw_data, scn_size,
-			 GRUB_PE32_SCN_CNT_INITIALIZED_DATA |
-			 GRUB_PE32_SCN_MEM_DISCARDABLE |
-			 GRUB_PE32_SCN_MEM_READ);
+	section = init_pe_section (image_target, section, ".reloc",
+				   &vma, scn_size, image_target->section_align,
+				   &raw_data, scn_size,
+				   GRUB_PE32_SCN_CNT_INITIALIZED_DATA |
+				   GRUB_PE32_SCN_MEM_DISCARDABLE |
+				   GRUB_PE32_SCN_MEM_READ);
+
+	c->num_sections = grub_host_to_target16 (section - first_section);
+	PE_OHDR (o32, o64, image_size) = grub_host_to_target32 (vma);
+
+	if (opts.stats_path || opts.size_budget_path)
+	  {
+	    struct image_component *part;
+
+	    /* The module area is mapped after the kernel and, like the
+	       kernel, moved down in the file by a virtual .bss.  */
+	    for (j = 0; j < components.n; j++)
+	      {
+		part = &components.list[j];
+		part->rva = header_size + part->offset;
+		part->offset = header_size + part->offset - bss_size;
+	      }
+
+	    add_component (&components, "header", 0, header_size, 0);
+	    add_component (&components, ".text", header_size,
+			   layout.exec_size, 0);
+	    add_component (&components, ".data",
+			   header_size + layout.exec_size,
+			   layout.bss_start - layout.exec_size, 0);
+	    if (layout.end > layout.bss_start)
+	      {
+		part = add_component (&components, ".bss",
+				      header_size + layout.bss_start,
+				      layout.end - layout.bss_start, 0);
+		part->in_file = !bss_size;
+	      }
+	    if (layout.kernel_size > layout.end)
+	      {
+		part = add_component (&components, ".got",
+				      header_size + layout.end,
+				      layout.kernel_size - layout.end, 0);
+		part->offset -= bss_size;
+	      }
+	    part = add_component (&components, ".reloc",
+				  raw_data - ALIGN_UP (layout.reloc_size,
+						       GRUB_PE32_FILE_ALIGNMENT),
+				  layout.reloc_size,
+				  ALIGN_UP (layout.reloc_size,
+					    GRUB_PE32_FILE_ALIGNMENT)
+				  - layout.reloc_size);
+	    part->rva = vma - ALIGN_UP (layout.reloc_size,
+					image_target->section_align);
+	    if (pe_cert_size)
+	      {
+		part = add_component (&components, "certificate table", pe_size,
+				      pe_cert_size, 0);
+		part->mapped = 0;
+	      }
+	    qsort (components.list, components.n, sizeof (components.list[0]),
+		   component_cmp);
+	  }
+
+	/* Left zeroed, for a signer to write the signature into in place.
+	   Until then the directory points at a WIN_CERTIFICATE with a zero
+	   dwLength, which some loaders reject as malformed: the image is
+	   only meant to be used once it is signed.  The directory is set
+	   now so that the region stays out of the Authenticode digest.
+	   The certificate table is not mapped, so its "RVA" is a file
+	   offset.  */
+	if (pe_cert_size)
+	  {
+	    PE_OHDR (o32, o64, certificate_table.rva) = grub_host_to_target32 (pe_size);
+	    PE_OHDR (o32, o64, certificate_table.size) = grub_host_to_target32 (pe_cert_size);
+	  }
 
 	free (core_img);
 	core_img = pe_img;
-	core_size = pe_size;
+	core_size = pe_size + pe_cert_size;
       }
       break;
 
@@ -758,8 +2022,50 @@ grub_install_generate_image (const char *dir, const char *prefix,
       break;
     }
 
-  grub_util_write_image (core_img, core_size, out, outname);
+  if (opts.size_budget_path)
+    check_size_budgets (opts.size_budget_path, &components, core_size);
+  if (opts.stats_path)
+    write_layout_stats (opts.stats_path, &layout, image_target,
+			total_module_size, core_size, &components);
+  if (opts.symbol_map_path)
+    write_symbol_map (opts.symbol_map_path, &layout, map_mods, nmods);
+
+  /* A large image is not going to be read back soon, so it is dropped
+     from the page cache once written.  */
+  image_start = core_size >= GRUB_UTIL_LARGE_FILE_SIZE ? ftello (out) : -1;
+
+  if (opts.authenticode_path || opts.pe_checksum)
+    {
+      grub_uint8_t digest[GRUB_SHA256_DIGEST_SIZE];
+
+      write_pe_image (core_img, core_size, core_size - pe_cert_size,
+		      pe_checksum_off, pe_certdir_off, opts.pe_checksum, out,
+		      outname, opts.authenticode_path ? digest : NULL);
+      if (opts.authenticode_path)
+	write_digest (opts.authenticode_path, digest, sizeof (digest));
+    }
+  else
+    grub_util_write_image (core_img, core_size, out, outname);
+  if (image_start >= 0 && fflush (out) == 0)
+    grub_util_drop_cache (fileno (out), image_start, core_size);
   free (core_img);
   free (kernel_path);
   free (layout.reloc_section);
+  for (j = 0; j < layout.nsymbols; j++)
+    free (layout.symbols[j].name);
+  free (layout.symbols);
+  for (j = 0; j < layout.nmap_symbols; j++)
+    free (layout.map_symbols[j].name);
+  free (layout.map_symbols);
+  free (map_mods);
+  free (components.list);
+  free (layout.fixups);
+  for (j = 0; j < layout.stats.nsections; j++)
+    {
+      free (layout.stats.sections[j].name);
+      free (layout.stats.sections[j].relocs);
+    }
+  free (layout.stats.sections);
+  if (resolved)
+    grub_util_free_module_list (resolved);
 }
@@ -0,0 +1,614 @@
+/* resolve.c - resolve the dependencies of modules */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2024  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <grub/types.h>
+#include <grub/elf.h>
+#include <grub/i18n.h>
+#include <grub/emu/misc.h>
+#include <grub/util/misc.h>
+#include <grub/misc.h>
+#include <grub/util/install.h>
+#include <grub/util/mkimage.h>
+#include <grub/util/resolve.h>
+#include <grub/lib/sha256.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define CACHE_MAGIC "# mkimage module dependencies "
+#define CACHE_END "# modules "
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cache_seq_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+struct mod_node
+{
+  char *name;
+  char **deps;
+  size_t ndeps;
+  enum
+    {
+      NODE_NEW,
+      NODE_VISITING,
+      NODE_DONE
+    } state;
+};
+
+/* The modules and what they depend on, sorted by name once complete.  */
+struct mod_graph
+{
+  struct mod_node *nodes;
+  size_t nnodes, max;
+};
+
+struct mod_provider
+{
+  const char *symbol;
+  size_t module;
+};
+
+static struct mod_node *
+graph_add (struct mod_graph *graph, const char *name)
+{
+  struct mod_node *node;
+
+  if (graph->nnodes == graph->max)
+    {
+      graph->max = graph->max ? 2 * graph->max : 256;
+      graph->nodes = xrealloc (graph->nodes,
+			       graph->max * sizeof (graph->nodes[0]));
+    }
+  node = &graph->nodes[graph->nnodes++];
+  node->name = xstrdup (name);
+  node->deps = NULL;
+  node->ndeps = 0;
+  node->state = NODE_NEW;
+  return node;
+}
+
+static void
+node_add_dep (struct mod_node *node, const char *dep)
+{
+  size_t i;
+
+  for (i = 0; i < node->ndeps; i++)
+    if (strcmp (node->deps[i], dep) == 0)
+      return;
+
+  node->deps = xrealloc (node->deps, (node->ndeps + 1) * sizeof (node->deps[0]));
+  node->deps[node->ndeps++] = xstrdup (dep);
+}
+
+static int
+node_cmp (const void *a, const void *b)
+{
+  const struct mod_node *na = a, *nb = b;
+
+  return strcmp (na->name, nb->name);
+}
+
+static struct mod_node *
+graph_find (struct mod_graph *graph, const char *name)
+{
+  struct mod_node key;
+
+  key.name = (char *) name;
+  return bsearch (&key, graph->nodes, graph->nnodes, sizeof (graph->nodes[0]),
+		  node_cmp);
+}
+
+/* Sort GRAPH, adding the modules which are only named as dependencies.  */
+static void
+graph_finish (struct mod_graph *graph)
+{
+  size_t i, j, n;
+
+  qsort (graph->nodes, graph->nnodes, sizeof (graph->nodes[0]), node_cmp);
+
+  n = graph->nnodes;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < graph->nodes[i].ndeps; j++)
+      if (!bsearch (&(struct mod_node) { .name = graph->nodes[i].deps[j] },
+		    graph->nodes, n, sizeof (graph->nodes[0]), node_cmp))
+	{
+	  size_t k;
+
+	  /* Only add it once.  */
+	  for (k = n; k < graph->nnodes; k++)
+	    if (strcmp (graph->nodes[k].name, graph->nodes[i].deps[j]) == 0)
+	      break;
+	  if (k == graph->nnodes)
+	    graph_add (graph, graph->nodes[i].deps[j]);
+	}
+
+  if (graph->nnodes != n)
+    qsort (graph->nodes, graph->nnodes, sizeof (graph->nodes[0]), node_cmp);
+}
+
+static void
+graph_free (struct mod_graph *graph)
+{
+  size_t i, j;
+
+  for (i = 0; i < graph->nnodes; i++)
+    {
+      for (j = 0; j < graph->nodes[i].ndeps; j++)
+	free (graph->nodes[i].deps[j]);
+      free (graph->nodes[i].deps);
+      free (graph->nodes[i].name);
+    }
+  free (graph->nodes);
+}
+
+/* Read dependencies in the format of moddep.lst, "name: dep dep ...",
+   from BUF into GRAPH.  Lines starting with a '#' are ignored.  */
+static void
+parse_moddep (struct mod_graph *graph, char *buf, const char *path)
+{
+  char *p, *next;
+
+  for (p = buf; *p; p = next)
+    {
+      struct mod_node *node;
+      char *colon, *dep, *q;
+
+      next = strchr (p, '\n');
+      if (next)
+	*next++ = '\0';
+      else
+	next = p + strlen (p);
+
+      if (*p == '#')
+	continue;
+      colon = strchr (p, ':');
+      if (!colon)
+	{
+	  q = p;
+	  if (grub_util_next_word (&q))
+	    grub_util_error (_("invalid line `%s' in `%s'"), p, path);
+	  continue;
+	}
+      *colon = '\0';
+
+      node = graph_add (graph, p);
+      q = colon + 1;
+      while ((dep = grub_util_next_word (&q)))
+	node_add_dep (node, dep);
+    }
+}
+
+static int
+provider_cmp (const void *a, const void *b)
+{
+  const struct mod_provider *pa = a, *pb = b;
+  int ret = strcmp (pa->symbol, pb->symbol);
+
+  if (ret)
+    return ret;
+  return (pa->module > pb->module) - (pa->module < pb->module);
+}
+
+static int
+name_cmp (const void *a, const void *b)
+{
+  return strcmp (*(const char *const *) a, *(const char *const *) b);
+}
+
+/* Return the names of the modules in DIR, sorted.  */
+static size_t
+list_modules (const char *dir, char ***names)
+{
+  size_t n = 0, max = 0;
+  struct dirent *de;
+  DIR *d;
+
+  d = opendir (dir);
+  if (!d)
+    grub_util_error (_("cannot open directory `%s': %s"), dir,
+		     strerror (errno));
+
+  *names = NULL;
+  while ((de = readdir (d)))
+    {
+      size_t len = strlen (de->d_name);
+
+      if (len <= 4 || strcmp (de->d_name + len - 4, ".mod") != 0)
+	continue;
+      if (n == max)
+	{
+	  max = max ? 2 * max : 256;
+	  *names = xrealloc (*names, max * sizeof (**names));
+	}
+      (*names)[n] = xstrdup (de->d_name);
+      (*names)[n++][len - 4] = '\0';
+    }
+  closedir (d);
+
+  qsort (*names, n, sizeof (**names), name_cmp);
+  return n;
+}
+
+/* Make GRAPH from the symbols of the NAMES modules in DIR: a module
+   depends on those defining what it needs.  Symbols no module defines
+   come from the kernel.  */
+static void
+derive_graph (struct mod_graph *graph, const char *dir, char **names,
+	      size_t nnames,
+	      const struct grub_install_image_target_desc *image_target)
+{
+  struct grub_mkimage_prelink_info *info;
+  struct mod_provider *providers;
+  size_t nproviders = 0, i, j, k;
+
+  info = xcalloc (nnames ? : 1, sizeof (info[0]));
+  for (i = 0; i < nnames; i++)
+    {
+      char *file = xasprintf ("%s.mod", names[i]);
+      char *path = grub_util_get_path (dir, file);
+      size_t size = grub_util_get_image_size (path);
+      char *img = grub_util_read_image (path);
+      int ok;
+
+      if (image_target->voidp_sizeof == 4)
+	ok = grub_mkimage_module_symbols32 (img, size, &info[i], image_target);
+      else
+	ok = grub_mkimage_module_symbols64 (img, size, &info[i], image_target);
+      if (!ok)
+	grub_util_warn (_("`%s' is not a module for this target"), path);
+      nproviders += info[i].ndefs;
+      free (img);
+      free (path);
+      free (file);
+    }
+
+  /* Where a symbol is defined twice, the first module by name wins.  */
+  providers = xcalloc (nproviders ? : 1, sizeof (providers[0]));
+  for (i = 0, k = 0; i < nnames; i++)
+    for (j = 0; j < info[i].ndefs; j++, k++)
+      {
+	providers[k].symbol = info[i].defs[j].name;
+	providers[k].module = i;
+      }
+  qsort (providers, nproviders, sizeof (providers[0]), provider_cmp);
+
+  for (i = 0; i < nnames; i++)
+    {
+      struct mod_node *node = graph_add (graph, names[i]);
+
+      for (j = 0; j < info[i].nundefs; j++)
+	{
+	  struct mod_provider key, *p;
+
+	  key.symbol = info[i].undefs[j];
+	  key.module = 0;
+	  /* The first entry for the symbol.  */
+	  p = providers;
+	  for (k = nproviders; k; k /= 2)
+	    if (provider_cmp (&key, &p[k / 2]) > 0)
+	      {
+		p += k / 2 + 1;
+		k--;
+	      }
+	  if (p == providers + nproviders || strcmp (p->symbol, key.symbol) != 0
+	      || p->module == i)
+	    continue;
+	  node_add_dep (node, names[p->module]);
+	}
+      qsort (node->deps, node->ndeps, sizeof (node->deps[0]), name_cmp);
+    }
+
+  free (providers);
+  for (i = 0; i < nnames; i++)
+    {
+      for (j = 0; j < info[i].ndefs; j++)
+	free (info[i].defs[j].name);
+      for (j = 0; j < info[i].nundefs; j++)
+	free (info[i].undefs[j]);
+      free (info[i].defs);
+      free (info[i].undefs);
+    }
+  free (info);
+}
+
+static void
+hash_file (struct grub_sha256_ctx *ctx, const char *path, const char *name)
+{
+  struct stat st;
+  char *line;
+
+  if (stat (path, &st) < 0)
+    grub_util_error (_("cannot stat `%s': %s"), path, strerror (errno));
+
+  line = xasprintf ("%s %llu %llu\n", name, (unsigned long long) st.st_size,
+		    (unsigned long long) st.st_mtime);
+  grub_sha256_update (ctx, line, strlen (line));
+  free (line);
+}
+
+/* Compute the key the cache is valid for into KEY: the sizes and times
+   of moddep.lst, or of the modules NAMES when there is none.  */
+static void
+cache_key (const char *dir, const char *moddep, char **names, size_t nnames,
+	   char key[2 * GRUB_SHA256_DIGEST_SIZE + 1])
+{
+  grub_uint8_t digest[GRUB_SHA256_DIGEST_SIZE];
+  struct grub_sha256_ctx ctx;
+  size_t i;
+
+  grub_sha256_init (&ctx);
+  grub_sha256_update (&ctx, dir, strlen (dir) + 1);
+  if (moddep)
+    hash_file (&ctx, moddep, "moddep.lst");
+  else
+    for (i = 0; i < nnames; i++)
+      {
+	char *file = xasprintf ("%s.mod", names[i]);
+	char *path = grub_util_get_path (dir, file);
+
+	hash_file (&ctx, path, file);
+	free (path);
+	free (file);
+      }
+  grub_sha256_final (&ctx, digest);
+
+  for (i = 0; i < sizeof (digest); i++)
+    sprintf (key + 2 * i, "%02x", digest[i]);
+}
+
+/* Read GRAPH from the cache at PATH if it is there, made for KEY and
+   complete: it ends in a line giving the number of modules before it.  */
+static int
+read_cache (struct mod_graph *graph, const char *path, const char *key)
+{
+  unsigned long long count, nlines = 0;
+  size_t size;
+  char *buf, *last, *p, *end;
+  FILE *f;
+  off_t sz;
+
+  /* The file is sized and read through the same handle, as a writer may
+     replace it meanwhile.  */
+  f = grub_util_fopen (path, "rb");
+  if (!f)
+    return 0;
+  if (fseeko (f, 0, SEEK_END) < 0 || (sz = ftello (f)) < 0
+      || fseeko (f, 0, SEEK_SET) < 0)
+    grub_util_error (_("cannot seek `%s': %s"), path, strerror (errno));
+  size = sz;
+  if (size != (unsigned long long) sz)
+    grub_util_error (_("file `%s' is too big"), path);
+  buf = xmalloc (size + 1);
+  if (fread (buf, 1, size, f) != size)
+    grub_util_error (_("cannot read `%s': %s"), path, strerror (errno));
+  fclose (f);
+  buf[size] = '\0';
+
+  if (strncmp (buf, CACHE_MAGIC, sizeof (CACHE_MAGIC) - 1) != 0
+      || strncmp (buf + sizeof (CACHE_MAGIC) - 1, key, strlen (key)) != 0)
+    {
+      grub_util_info ("the dependency cache %s is out of date", path);
+      free (buf);
+      return 0;
+    }
+
+  /* A cache cut short, by a writer which did not finish or by anything
+     else, is not used.  */
+  last = NULL;
+  if (size && buf[size - 1] == '\n')
+    {
+      buf[size - 1] = '\0';
+      last = strrchr (buf, '\n');
+      buf[size - 1] = '\n';
+    }
+  if (!last || strncmp (last + 1, CACHE_END, sizeof (CACHE_END) - 1) != 0)
+    goto incomplete;
+  count = strtoull (last + 1 + sizeof (CACHE_END) - 1, &end, 10);
+  if (*end != '\n' || end == last + sizeof (CACHE_END))
+    goto incomplete;
+  for (p = strchr (buf, '\n'); p && p < last; p = strchr (p, '\n'))
+    if (*++p != '#')
+      nlines++;
+  if (nlines != count)
+    goto incomplete;
+
+  grub_util_info ("reading the module dependencies from %s", path);
+  parse_moddep (graph, buf, path);
+  free (buf);
+  return 1;
+
+ incomplete:
+  grub_util_warn (_("the dependency cache `%s' is incomplete, ignoring it"),
+		  path);
+  free (buf);
+  return 0;
+}
+
+/* Write GRAPH to the cache at PATH.  It is written to a file of its own
+   and renamed over PATH, so that the images built at the same time never
+   see it half written.  */
+static void
+write_cache (const struct mod_graph *graph, const char *path, const char *key)
+{
+  static unsigned long seq;
+  unsigned long n;
+  char *tmp;
+  FILE *f;
+  size_t i, j;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&cache_seq_lock);
+#endif
+  n = seq++;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&cache_seq_lock);
+#endif
+  tmp = xasprintf ("%s.%lu.%lu.tmp", path, (unsigned long) getpid (), n);
+
+  f = grub_util_fopen (tmp, "w");
+  if (!f)
+    grub_util_error (_("cannot open `%s': %s"), tmp, strerror (errno));
+
+  fprintf (f, "%s%s\n", CACHE_MAGIC, key);
+  for (i = 0; i < graph->nnodes; i++)
+    {
+      fprintf (f, "%s:", graph->nodes[i].name);
+      for (j = 0; j < graph->nodes[i].ndeps; j++)
+	fprintf (f, " %s", graph->nodes[i].deps[j]);
+      fputc ('\n', f);
+    }
+  fprintf (f, "%s%llu\n", CACHE_END, (unsigned long long) graph->nnodes);
+
+  if (grub_util_file_sync (f) < 0)
+    grub_util_error (_("cannot sync `%s': %s"), tmp, strerror (errno));
+  if (fclose (f) == EOF)
+    grub_util_error (_("cannot close `%s': %s"), tmp, strerror (errno));
+  if (grub_util_rename (tmp, path) < 0)
+    grub_util_error (_("cannot rename `%s' to `%s': %s"), tmp, path,
+		     strerror (errno));
+  free (tmp);
+}
+
+/* Append NODE to LIST after what it depends on.  */
+static void
+visit (struct mod_graph *graph, struct mod_node *node, char **list,
+       size_t *n)
+{
+  size_t i;
+
+  if (node->state == NODE_DONE)
+    return;
+  if (node->state == NODE_VISITING)
+    grub_util_error (_("circular dependency involving module `%s'"), node->name);
+
+  node->state = NODE_VISITING;
+  for (i = 0; i < node->ndeps; i++)
+    visit (graph, graph_find (graph, node->deps[i]), list, n);
+  node->state = NODE_DONE;
+
+  list[(*n)++] = xasprintf ("%s.mod", node->name);
+}
+
+char **
+grub_util_resolve_dependencies (const char *dir, char *modules[],
+				const char *cache_path,
+				const struct grub_install_image_target_desc *image_target)
+{
+  struct mod_graph graph = { NULL, 0, 0 };
+  char key[2 * GRUB_SHA256_DIGEST_SIZE + 1];
+  char *moddep, **names = NULL, **list;
+  size_t nnames = 0, n = 0, i;
+
+  moddep = grub_util_get_path (dir, "moddep.lst");
+  if (access (moddep, F_OK) < 0)
+    {
+      free (moddep);
+      moddep = NULL;
+      nnames = list_modules (dir, &names);
+    }
+
+  if (cache_path)
+    cache_key (dir, moddep, names, nnames, key);
+
+  if (!cache_path || !read_cache (&graph, cache_path, key))
+    {
+      if (moddep)
+	{
+	  size_t size = grub_util_get_image_size (moddep);
+	  char *buf = xmalloc (size + 1);
+
+	  grub_util_load_image (moddep, buf);
+	  buf[size] = '\0';
+	  parse_moddep (&graph, buf, moddep);
+	  free (buf);
+	}
+      else
+	{
+	  grub_util_info ("no moddep.lst in %s, using the symbols of the modules",
+			  dir);
+	  derive_graph (&graph, dir, names, nnames, image_target);
+	}
+      graph_finish (&graph);
+      if (cache_path)
+	write_cache (&graph, cache_path, key);
+    }
+  else
+    graph_finish (&graph);
+
+  list = xcalloc (graph.nnodes + 1, sizeof (list[0]));
+  for (i = 0; modules[i]; i++)
+    {
+      size_t len = strlen (modules[i]);
+      char *name = xstrdup (modules[i]);
+      struct mod_node *node;
+
+      if (len > 4 && strcmp (name + len - 4, ".mod") == 0)
+	name[len - 4] = '\0';
+
+      node = graph_find (&graph, name);
+      if (node)
+	visit (&graph, node, list, &n);
+      else
+	{
+	  /* Not known, let loading it tell whether it exists.  */
+	  char *file = xasprintf ("%s.mod", name);
+	  size_t j;
+
+	  for (j = 0; j < n && strcmp (list[j], file) != 0; j++);
+	  if (j == n)
+	    {
+	      list = xrealloc (list, (graph.nnodes + n + 2) * sizeof (list[0]));
+	      list[n++] = file;
+	    }
+	  else
+	    free (file);
+	}
+      free (name);
+    }
+  list[n] = NULL;
+
+  for (i = 0; i < n; i++)
+    grub_util_info ("embedding %s", list[i]);
+
+  for (i = 0; i < nnames; i++)
+    free (names[i]);
+  free (names);
+  free (moddep);
+  graph_free (&graph);
+  return list;
+}
+
+void
+grub_util_free_module_list (char **list)
+{
+  size_t i;
+
+  for (i = 0; list[i]; i++)
+    free (list[i]);
+  free (list);
+}